@@ -0,0 +1,103 @@
+#include <stdlib.h>
+#include <malloc.h>
+#include "libhvm.h"
+
+// Shared by every thread. Sizes are the usable sizes malloc reports, so a
+// free doesn't need to know what the allocation asked for.
+static size_t current_bytes = 0;
+static size_t peak_bytes = 0;
+static size_t allocations[HVM_MEMORY_KIND_COUNT];
+static size_t allocated_bytes[HVM_MEMORY_KIND_COUNT];
+
+static void count_in(size_t size, int kind)
+{
+    __atomic_fetch_add(&allocations[kind], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&allocated_bytes[kind], size, __ATOMIC_RELAXED);
+    size_t now = __atomic_add_fetch(&current_bytes, size, __ATOMIC_RELAXED);
+
+    size_t peak = __atomic_load_n(&peak_bytes, __ATOMIC_RELAXED);
+    while (now > peak && !__atomic_compare_exchange_n(&peak_bytes, &peak, now,
+        1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static void count_out(size_t size)
+{
+    __atomic_fetch_sub(&current_bytes, size, __ATOMIC_RELAXED);
+}
+
+void *hvm_malloc(size_t size, int kind)
+{
+    void *p = malloc(size ? size : 1);
+    if (p)
+        count_in(malloc_usable_size(p), kind);
+    return p;
+}
+
+void *hvm_calloc(size_t count, size_t size, int kind)
+{
+    void *p = calloc(count ? count : 1, size ? size : 1);
+    if (p)
+        count_in(malloc_usable_size(p), kind);
+    return p;
+}
+
+void *hvm_realloc(void *p, size_t size, int kind)
+{
+    size_t old_size = p ? malloc_usable_size(p) : 0;
+    void *grown = realloc(p, size ? size : 1);
+    if (!grown)
+        return NULL;
+
+    // Counted as a new allocation and the release of the old one
+    count_out(old_size);
+    count_in(malloc_usable_size(grown), kind);
+    return grown;
+}
+
+void hvm_free(void *p)
+{
+    if (!p)
+        return;
+    count_out(malloc_usable_size(p));
+    free(p);
+}
+
+void hvm_count_mapping(size_t size)
+{
+    count_in(size, HVM_MEM_IO);
+}
+
+void hvm_count_unmapping(size_t size)
+{
+    count_out(size);
+}
+
+void hvm_memory_stats(Hvm_Memory_Stats *m)
+{
+    m->current = __atomic_load_n(&current_bytes, __ATOMIC_RELAXED);
+    m->peak = __atomic_load_n(&peak_bytes, __ATOMIC_RELAXED);
+    for (int k = 0; k < HVM_MEMORY_KIND_COUNT; k++) {
+        m->allocations[k] = __atomic_load_n(&allocations[k], __ATOMIC_RELAXED);
+        m->bytes[k] = __atomic_load_n(&allocated_bytes[k], __ATOMIC_RELAXED);
+    }
+}
+
+void hvm_reset_memory_stats(void)
+{
+    size_t now = __atomic_load_n(&current_bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&peak_bytes, now, __ATOMIC_RELAXED);
+    for (int k = 0; k < HVM_MEMORY_KIND_COUNT; k++) {
+        __atomic_store_n(&allocations[k], 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&allocated_bytes[k], 0, __ATOMIC_RELAXED);
+    }
+}
+
+char *hvm_memory_kind_name(int kind)
+{
+    static char *names[HVM_MEMORY_KIND_COUNT] = {
+        "io", "line index", "instructions", "symbols", "output", "analysis",
+        "other"
+    };
+    return names[kind];
+}
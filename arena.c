@@ -0,0 +1,38 @@
+#include <stdlib.h>
+#include "arena.h"
+#include "libhvm.h"
+
+#define ARENA_ALIGN                        8
+
+void *hvm_arena_alloc(Arena *a, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+    Arena_Block *b = a->head;
+    if (!b || b->size - b->used < size) {
+        // Oversized allocations get a block of their own
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        b = hvm_malloc(sizeof(Arena_Block) + block_size, HVM_MEM_SYMBOLS);
+        if (!b)
+            return NULL;
+        b->size = block_size;
+        b->used = 0;
+        b->next = a->head;
+        a->head = b;
+    }
+
+    void *p = b->data + b->used;
+    b->used += size;
+    return p;
+}
+
+void hvm_arena_free(Arena *a)
+{
+    Arena_Block *b = a->head;
+    while (b) {
+        Arena_Block *next = b->next;
+        hvm_free(b);
+        b = next;
+    }
+    a->head = NULL;
+}
@@ -0,0 +1,27 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_BLOCK_SIZE                   (64 * 1024)
+
+typedef struct Arena_Block {
+    struct Arena_Block *next;
+    size_t size;
+    size_t used;
+    char data[];
+} Arena_Block;
+
+// Bump allocator. Everything allocated from it is released at once by
+// hvm_arena_free, individual allocations are never freed.
+typedef struct {
+    Arena_Block *head;
+} Arena;
+
+#define ARENA_INIT ((Arena) { .head = NULL })
+
+// Returns 'size' bytes aligned to 8, or NULL if out of memory
+void *hvm_arena_alloc(Arena *a, size_t size);
+void hvm_arena_free(Arena *a);
+
+#endif // ARENA_H
@@ -0,0 +1,393 @@
+/*
+ hvm_bench - microbenchmarks for the lexing primitives and the parse loop
+
+ Usage: hvm_bench [filter] [--input file.vm] [--samples n]
+        make bench
+
+ Runs every benchmark whose name contains 'filter' (all by default). Each
+ one is calibrated so a sample takes about 2ms, warmed up, then timed over
+ a number of samples. Reports the median, 5th and 95th percentile time per
+ operation, the median time per input byte and the median throughput.
+
+ The parse benchmarks run on a generated program mixing the instructions
+ compiled Jack code is made of, or on '--input' if given.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "text.h"
+#include "scan.h"
+#include "file.h"
+#include "libhvm.h"
+
+#define BENCH_SAMPLE_NS                    (2 * 1000 * 1000)
+#define BENCH_WARMUP_SAMPLES               5
+#define BENCH_DEFAULT_SAMPLES              31
+#define BENCH_MAX_SAMPLES                  1001
+#define BENCH_CORPUS_FUNCTIONS             2000
+
+// Runs the operation 'iterations' times. Returns something computed from
+// the results, so the compiler can't drop the work.
+typedef size_t (*Bench_Run)(void *arg, size_t iterations);
+
+typedef struct {
+    char *name;
+    Bench_Run run;
+    void *arg;
+    size_t bytes; // Input bytes one operation goes through, 0 if none
+} Bench;
+
+// Inputs a primitive cycles through, so no single one is all that's timed
+typedef struct {
+    char **strings;
+    size_t count;
+    char *pattern;
+} String_Set;
+
+// A whole input for the parse benchmarks
+typedef struct {
+    char *buf;
+    size_t size;
+} Corpus;
+
+static volatile size_t bench_sink;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+// Value at 'fraction' of the sorted 'samples'
+static double percentile(double *samples, int count, double fraction)
+{
+    int k = (int) (fraction * (count - 1) + 0.5);
+    return samples[k];
+}
+
+static double time_run(Bench *b, size_t iterations)
+{
+    double start = now_ns();
+    bench_sink += b->run(b->arg, iterations);
+    return now_ns() - start;
+}
+
+// Iterations for a sample of about BENCH_SAMPLE_NS, so short operations
+// aren't lost in the clock's resolution
+static size_t calibrate(Bench *b)
+{
+    size_t iterations = 1;
+    double ns;
+    while ((ns = time_run(b, iterations)) < BENCH_SAMPLE_NS / 8)
+        iterations *= 2;
+
+    size_t scaled = (size_t) (iterations * (BENCH_SAMPLE_NS / ns));
+    return scaled ? scaled : 1;
+}
+
+static void run_bench(Bench *b, int sample_count)
+{
+    size_t iterations = calibrate(b);
+    for (int k = 0; k < BENCH_WARMUP_SAMPLES; k++)
+        time_run(b, iterations);
+
+    double samples[BENCH_MAX_SAMPLES];
+    for (int k = 0; k < sample_count; k++)
+        samples[k] = time_run(b, iterations) / iterations;
+    qsort(samples, sample_count, sizeof(double), compare_doubles);
+
+    double median = percentile(samples, sample_count, 0.5);
+    printf("%-28s %11zu %12.1f %12.1f %12.1f", b->name, iterations, median,
+        percentile(samples, sample_count, 0.05),
+        percentile(samples, sample_count, 0.95));
+    if (b->bytes)
+        printf(" %9.3f %9.1f\n", median / b->bytes,
+            b->bytes / median * 1e9 / (1024.0 * 1024.0));
+    else
+        printf(" %9s %9s\n", "-", "-");
+}
+
+// Bytes of the average string, rounded up
+static size_t average_length(String_Set *s)
+{
+    size_t bytes = 0;
+    for (size_t k = 0; k < s->count; k++)
+        bytes += strlen(s->strings[k]);
+    return (bytes + s->count - 1) / s->count;
+}
+
+static size_t run_power(void *arg, size_t iterations)
+{
+    (void) arg;
+    size_t sum = 0;
+    for (size_t n = 0; n < iterations; n++)
+        sum += (size_t) hvm_power(10, (int) (n % 5));
+    return sum;
+}
+
+static size_t run_parse_next_int(void *arg, size_t iterations)
+{
+    String_Set *s = arg;
+    size_t sum = 0;
+    for (size_t n = 0; n < iterations; n++) {
+        char *str = s->strings[n % s->count];
+        sum += (size_t) hvm_parse_next_int(str, str + strlen(str) - 1);
+    }
+    return sum;
+}
+
+static size_t run_str_begins_with(void *arg, size_t iterations)
+{
+    String_Set *s = arg;
+    size_t sum = 0;
+    for (size_t n = 0; n < iterations; n++)
+        sum += hvm_str_begins_with(s->strings[n % s->count], s->pattern);
+    return sum;
+}
+
+static size_t run_find_next_any(void *arg, size_t iterations)
+{
+    String_Set *s = arg;
+    size_t sum = 0;
+    for (size_t n = 0; n < iterations; n++) {
+        char *str = s->strings[n % s->count];
+        sum += (size_t) (hvm_find_next_any(str, s->pattern) - str);
+    }
+    return sum;
+}
+
+static size_t run_strstr_range(void *arg, size_t iterations)
+{
+    String_Set *s = arg;
+    size_t sum = 0;
+    for (size_t n = 0; n < iterations; n++) {
+        char *str = s->strings[n % s->count];
+        sum += (size_t) hvm_strstr_range(str, str + strlen(str) - 1,
+            s->pattern);
+    }
+    return sum;
+}
+
+static size_t run_strindex_last(void *arg, size_t iterations)
+{
+    String_Set *s = arg;
+    size_t sum = 0;
+    for (size_t n = 0; n < iterations; n++)
+        sum += (size_t) hvm_strindex_last(s->strings[n % s->count], s->pattern);
+    return sum;
+}
+
+static size_t run_line_index(void *arg, size_t iterations)
+{
+    Corpus *c = arg;
+    size_t sum = 0;
+    for (size_t n = 0; n < iterations; n++) {
+        Line_Index li;
+        if (hvm_build_line_index(c->buf, c->size, &li) != 0)
+            return 0;
+        sum += li.count;
+        hvm_free_line_index(&li);
+    }
+    return sum;
+}
+
+// Lexing and parsing, with objects only adding a copy of the result
+static size_t run_parse(void *arg, size_t iterations)
+{
+    Corpus *c = arg;
+    Hvm_Options options = HVM_OPTIONS_DEFAULT;
+    options.terminated_input = 1;
+
+    size_t sum = 0;
+    for (size_t n = 0; n < iterations; n++) {
+        Hvm_Result r = hvm_compile_object(c->buf, c->size, &options);
+        sum += r.instruction_count;
+        hvm_free_result(&r);
+    }
+    return sum;
+}
+
+static size_t translate_at(Corpus *c, size_t iterations, int level)
+{
+    Hvm_Options options = HVM_OPTIONS_DEFAULT;
+    options.terminated_input = 1;
+    options.passes = hvm_level_passes(level);
+
+    size_t sum = 0;
+    for (size_t n = 0; n < iterations; n++) {
+        Hvm_Result r = hvm_translate(c->buf, c->size, "Bench", &options);
+        sum += r.output_size;
+        hvm_free_result(&r);
+    }
+    return sum;
+}
+
+static size_t run_translate(void *arg, size_t iterations)
+{
+    return translate_at(arg, iterations, 0);
+}
+
+// Also builds the control-flow graphs, for unreachable
+static size_t run_translate_o2(void *arg, size_t iterations)
+{
+    return translate_at(arg, iterations, 2);
+}
+
+// Appends to a growing buffer, keeping it '\0' terminated
+static void append(Corpus *c, size_t *capacity, char *text)
+{
+    size_t len = strlen(text);
+    while (c->size + len + 1 > *capacity) {
+        *capacity *= 2;
+        c->buf = hvm_realloc(c->buf, *capacity, HVM_MEM_IO);
+    }
+    memcpy(c->buf + c->size, text, len + 1);
+    c->size += len;
+}
+
+// A program shaped like compiled Jack: functions of pushes and pops over
+// every segment, arithmetic, branches and calls, with comments and
+// indentation
+static Corpus generate_corpus(void)
+{
+    static char *segments[] = {
+        "argument", "local", "static", "constant", "this", "that", "temp"
+    };
+    static char *arithmetic[] = {
+        "add", "sub", "neg", "eq", "gt", "lt", "and", "or", "not"
+    };
+
+    Corpus c = { .buf = NULL, .size = 0 };
+    size_t capacity = 4096;
+    c.buf = hvm_malloc(capacity, HVM_MEM_IO);
+    c.buf[0] = '\0';
+
+    char line[128];
+    unsigned seed = 1;
+    for (int f = 0; f < BENCH_CORPUS_FUNCTIONS; f++) {
+        snprintf(line, sizeof(line), "// Class%i.method%i\n"
+            "function Class%i.method%i %i\n", f, f, f % 50, f, f % 4);
+        append(&c, &capacity, line);
+        for (int k = 0; k < 24; k++) {
+            seed = seed * 1103515245 + 12345;
+            unsigned r = seed >> 16;
+            if (k % 8 == 7) {
+                snprintf(line, sizeof(line), "label L%i\n    if-goto L%i\n",
+                    k, k);
+            } else if (k % 6 == 5) {
+                snprintf(line, sizeof(line),
+                    "    call Class%u.method%u %u // call\n", r % 50, r % 2000,
+                    r % 3);
+            } else if (r % 3 == 0) {
+                snprintf(line, sizeof(line), "    %s\n", arithmetic[r % 9]);
+            } else {
+                char *segment = segments[r % 7];
+                unsigned index = r % (strcmp(segment, "temp") == 0 ? 8 : 1000);
+                snprintf(line, sizeof(line), "    %s %s %u\n",
+                    r % 2 && strcmp(segment, "constant") != 0 ? "pop" : "push",
+                    segment, index);
+            }
+            append(&c, &capacity, line);
+        }
+        append(&c, &capacity, "    push constant 0\n    return\n\n");
+    }
+    return c;
+}
+
+int main(int argc, char *argv[])
+{
+    char *filter = "";
+    char *input = NULL;
+    int sample_count = BENCH_DEFAULT_SAMPLES;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--input") == 0 && i + 1 < argc) {
+            input = argv[++i];
+        } else if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+            sample_count = atoi(argv[++i]);
+            if (sample_count < 1 || sample_count > BENCH_MAX_SAMPLES) {
+                printf("Samples must be from 1 to %i\n", BENCH_MAX_SAMPLES);
+                return 1;
+            }
+        } else {
+            filter = argv[i];
+        }
+    }
+
+    Corpus corpus;
+    Loaded_File file = { .buf = NULL, .size = 0, .map_size = 0 };
+    if (input) {
+        file = load_file(input);
+        if (!file.buf)
+            return 1;
+        corpus.buf = file.buf;
+        corpus.size = file.size;
+    } else {
+        corpus = generate_corpus();
+    }
+
+    char *numbers[] = { "0", "7", "17", "256", "1024", "32767", "00042", "5" };
+    char *lines[] = {
+        "push constant 17 // seventeen",
+        "pop local 0",
+        "call Math.multiply 2",
+        "function Main.main 4",
+        "label WHILE_EXP0",
+        "if-goto IF_TRUE1",
+        "add",
+        "push argument 1"
+    };
+    char *paths[] = {
+        "Main.vm", "src/Main.vm", "projects/08/FunctionCalls/Sys.vm",
+        "a/b/c/d/Memory.vm", "Keyboard.vm", "../Screen.vm", "x.vm", "Output.vm"
+    };
+    String_Set number_set = { numbers, 8, NULL };
+    String_Set prefix_set = { lines, 8, "push" };
+    String_Set delimiter_set = { lines, 8, " \t/" };
+    String_Set comment_set = { lines, 8, "//" };
+    String_Set extension_set = { paths, 8, ".vm" };
+
+    Bench benches[] = {
+        { "power", run_power, NULL, 0 },
+        { "parse_next_int", run_parse_next_int, &number_set,
+            average_length(&number_set) },
+        { "str_begins_with", run_str_begins_with, &prefix_set,
+            average_length(&prefix_set) },
+        { "find_next_any", run_find_next_any, &delimiter_set,
+            average_length(&delimiter_set) },
+        { "strstr_range", run_strstr_range, &comment_set,
+            average_length(&comment_set) },
+        { "strindex_last", run_strindex_last, &extension_set,
+            average_length(&extension_set) },
+        { "line index", run_line_index, &corpus, corpus.size },
+        { "parse", run_parse, &corpus, corpus.size },
+        { "translate", run_translate, &corpus, corpus.size },
+        { "translate -O2", run_translate_o2, &corpus, corpus.size }
+    };
+    int bench_count = sizeof(benches) / sizeof(benches[0]);
+
+    printf("Input: %s, %zu bytes, scan kernel %s, %i samples\n",
+        input ? input : "generated", corpus.size, hvm_scan_kernel_name(),
+        sample_count);
+    printf("%-28s %11s %12s %12s %12s %9s %9s\n", "benchmark", "iterations",
+        "median ns", "p5 ns", "p95 ns", "ns/byte", "MB/s");
+    for (int k = 0; k < bench_count; k++) {
+        if (strstr(benches[k].name, filter))
+            run_bench(benches + k, sample_count);
+    }
+
+    if (input)
+        unload_file(&file);
+    else
+        hvm_free(corpus.buf);
+    return 0;
+}
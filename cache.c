@@ -0,0 +1,241 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "hash.h"
+#include "cache.h"
+#include "libhvm.h"
+
+#define CACHE_PATH_SIZE                    4096
+#define HASH_SEED                          0x9e3779b97f4a7c15ull
+#define MEMORY_CACHE_INITIAL_SLOTS         1024
+
+uint64_t cache_key(char *buf, size_t size, char *basename, uint64_t options)
+{
+    uint64_t h = hvm_hash_bytes(HASH_SEED, buf, size);
+    h = hvm_hash_bytes(h, basename, strlen(basename));
+    return hvm_hash_bytes(h, &options, sizeof(options));
+}
+
+int cache_open(char *dir)
+{
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        printf("Couldn't create cache directory '%s'\n", dir);
+        return 1;
+    }
+    return 0;
+}
+
+static int entry_path(char *path, char *dir, uint64_t key)
+{
+    int n = snprintf(path, CACHE_PATH_SIZE, "%s/%016llx.asm", dir,
+        (unsigned long long) key);
+    return n < 0 || n >= CACHE_PATH_SIZE;
+}
+
+char *cache_lookup(char *dir, uint64_t key, size_t *size)
+{
+    char path[CACHE_PATH_SIZE];
+    if (entry_path(path, dir, key))
+        return NULL;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t total = (size_t) st.st_size;
+    char *buf = hvm_malloc(total + 1, HVM_MEM_IO);
+    if (!buf) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t done = 0;
+    while (done < total) {
+        ssize_t n = read(fd, buf + done, total - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            // Entry changed under us, treat as a miss
+            hvm_free(buf);
+            close(fd);
+            return NULL;
+        }
+        done += (size_t) n;
+    }
+    close(fd);
+
+    buf[total] = '\0';
+    *size = total;
+    return buf;
+}
+
+int cache_store(char *dir, uint64_t key, char *buf, size_t size)
+{
+    char path[CACHE_PATH_SIZE];
+    char tmp_path[CACHE_PATH_SIZE];
+    if (entry_path(path, dir, key))
+        return 1;
+
+    // Unique per process and per store, as threads may store the same key
+    static unsigned long store_count = 0;
+    unsigned long k = __atomic_fetch_add(&store_count, 1, __ATOMIC_RELAXED);
+    int n = snprintf(tmp_path, CACHE_PATH_SIZE, "%s.%ld.%lu.tmp", path,
+        (long) getpid(), k);
+    if (n < 0 || n >= CACHE_PATH_SIZE)
+        return 1;
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        return 1;
+
+    size_t done = 0;
+    while (done < size) {
+        ssize_t written = write(fd, buf + done, size - done);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0) {
+            close(fd);
+            unlink(tmp_path);
+            return 1;
+        }
+        done += (size_t) written;
+    }
+
+    if (close(fd) == -1 || rename(tmp_path, path) == -1) {
+        unlink(tmp_path);
+        return 1;
+    }
+
+    return 0;
+}
+
+void memory_cache_init(Memory_Cache *mc, size_t max_bytes)
+{
+    pthread_mutex_init(&mc->lock, NULL);
+    mc->slots = NULL;
+    mc->slot_count = 0;
+    mc->count = 0;
+    mc->bytes = 0;
+    mc->max_bytes = max_bytes;
+    mc->hits = 0;
+    mc->misses = 0;
+}
+
+// Drops every entry, keeps the slots
+static void memory_cache_clear(Memory_Cache *mc)
+{
+    for (size_t k = 0; k < mc->slot_count; k++) {
+        hvm_free(mc->slots[k].buf);
+        mc->slots[k].buf = NULL;
+    }
+    mc->count = 0;
+    mc->bytes = 0;
+}
+
+void memory_cache_free(Memory_Cache *mc)
+{
+    memory_cache_clear(mc);
+    hvm_free(mc->slots);
+    mc->slots = NULL;
+    mc->slot_count = 0;
+    pthread_mutex_destroy(&mc->lock);
+}
+
+// Returns slot holding 'key', or the empty slot where it would go
+static Memory_Entry *find_entry(Memory_Cache *mc, uint64_t key)
+{
+    size_t mask = mc->slot_count - 1;
+    for (size_t k = key & mask;; k = (k + 1) & mask) {
+        Memory_Entry *e = mc->slots + k;
+        if (!e->buf || e->key == key)
+            return e;
+    }
+}
+
+char *memory_cache_lookup(Memory_Cache *mc, uint64_t key, size_t *size)
+{
+    char *copy = NULL;
+
+    pthread_mutex_lock(&mc->lock);
+    Memory_Entry *e = mc->slot_count ? find_entry(mc, key) : NULL;
+    if (e && e->buf) {
+        copy = hvm_malloc(e->size + 1, HVM_MEM_OUTPUT);
+        if (copy) {
+            memcpy(copy, e->buf, e->size + 1);
+            *size = e->size;
+        }
+    }
+    if (copy)
+        mc->hits++;
+    else
+        mc->misses++;
+    pthread_mutex_unlock(&mc->lock);
+
+    return copy;
+}
+
+// Doubles slot count and reinserts every entry. Returns 1 if out of memory.
+static int grow_entries(Memory_Cache *mc)
+{
+    size_t slot_count = mc->slot_count ? mc->slot_count * 2
+        : MEMORY_CACHE_INITIAL_SLOTS;
+    Memory_Entry *slots = hvm_calloc(slot_count, sizeof(Memory_Entry),
+        HVM_MEM_OTHER);
+    if (!slots)
+        return 1;
+
+    Memory_Entry *old = mc->slots;
+    size_t old_count = mc->slot_count;
+    mc->slots = slots;
+    mc->slot_count = slot_count;
+    for (size_t k = 0; k < old_count; k++) {
+        if (old[k].buf)
+            *find_entry(mc, old[k].key) = old[k];
+    }
+    hvm_free(old);
+    return 0;
+}
+
+void memory_cache_store(Memory_Cache *mc, uint64_t key, char *buf, size_t size)
+{
+    char *copy = hvm_malloc(size + 1, HVM_MEM_OUTPUT);
+    if (!copy)
+        return;
+    memcpy(copy, buf, size);
+    copy[size] = '\0';
+
+    pthread_mutex_lock(&mc->lock);
+    if (mc->bytes + size > mc->max_bytes)
+        memory_cache_clear(mc);
+
+    // Keep the load factor under one half
+    if ((mc->count + 1) * 2 > mc->slot_count && grow_entries(mc) != 0) {
+        pthread_mutex_unlock(&mc->lock);
+        hvm_free(copy);
+        return;
+    }
+
+    Memory_Entry *e = find_entry(mc, key);
+    if (e->buf) {
+        // Another thread stored the same output first
+        hvm_free(copy);
+    } else {
+        e->key = key;
+        e->buf = copy;
+        e->size = size;
+        mc->count++;
+        mc->bytes += size;
+    }
+    pthread_mutex_unlock(&mc->lock);
+}
@@ -0,0 +1,53 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Key of one translation: the input bytes, the basename (static and label
+// names depend on it) and a word describing every option that changes the
+// output. Translations with the same key produce the same bytes.
+uint64_t cache_key(char *buf, size_t size, char *basename, uint64_t options);
+
+// Creates 'dir' if it doesn't exist. Returns 0 on success.
+int cache_open(char *dir);
+
+// Returns the cached output for 'key' in an hvm_malloc'd buffer followed
+// by a '\0', with its size (excluding the '\0') in 'size'. NULL on a miss.
+char *cache_lookup(char *dir, uint64_t key, size_t *size);
+
+// Stores 'size' bytes of output under 'key'. The entry is written to a
+// temporary file and renamed into place, so concurrent runs sharing the
+// directory never see a partial entry. Returns 0 on success.
+int cache_store(char *dir, uint64_t key, char *buf, size_t size);
+
+typedef struct {
+    uint64_t key;
+    char *buf; // NULL if the slot is empty
+    size_t size;
+} Memory_Entry;
+
+// In-process cache of outputs, for a long running server. Safe to use from
+// several threads. Once it holds more than 'max_bytes' it is emptied.
+typedef struct {
+    pthread_mutex_t lock;
+    Memory_Entry *slots;
+    size_t slot_count;
+    size_t count;
+    size_t bytes;
+    size_t max_bytes;
+    size_t hits;
+    size_t misses;
+} Memory_Cache;
+
+void memory_cache_init(Memory_Cache *mc, size_t max_bytes);
+void memory_cache_free(Memory_Cache *mc);
+
+// Same contract as cache_lookup, the result is a copy
+char *memory_cache_lookup(Memory_Cache *mc, uint64_t key, size_t *size);
+
+// Keeps a copy of 'size' bytes of 'buf' under 'key'
+void memory_cache_store(Memory_Cache *mc, uint64_t key, char *buf, size_t size);
+
+#endif // CACHE_H
@@ -0,0 +1,471 @@
+#include <string.h>
+#include "cfg.h"
+#include "libhvm.h"
+
+#define DEPTH_UNREACHED                    INT32_MAX
+
+// Change in working stack depth by opcode, calls aside. A lookup instead of
+// a switch keeps the depth loops free of unpredictable branches.
+static const signed char OPCODE_STACK_EFFECTS[OPCODE_COUNT] = {
+    [OP_ADD]      = -1, [OP_SUB]     = -1,
+    [OP_EQ]       = -1, [OP_GT]      = -1, [OP_LT]      = -1,
+    [OP_AND]      = -1, [OP_OR]      = -1,
+    [OP_POP]      = -1, [OP_PUSH]    = 1,
+    [OP_IF_GOTO]  = -1, [OP_RETURN]  = -1,
+};
+
+static int starts_block(Instruction *insts, size_t k)
+{
+    if (k == 0 || insts[k].opcode == OP_FUNCTION || insts[k].opcode == OP_LABEL)
+        return 1;
+    uint8_t previous = insts[k - 1].opcode;
+    return previous == OP_GOTO || previous == OP_IF_GOTO
+        || previous == OP_RETURN;
+}
+
+static int starts_function(Instruction *insts, size_t k)
+{
+    return k == 0 || insts[k].opcode == OP_FUNCTION;
+}
+
+void hvm_cfg_free(Cfg *cfg)
+{
+    hvm_free(cfg->blocks);
+    hvm_free(cfg->predecessors);
+    hvm_free(cfg->functions);
+    hvm_free(cfg->calls);
+    memset(cfg, 0, sizeof(Cfg));
+}
+
+// Fills in blocks and functions, both already counted
+static void split_blocks(Cfg *cfg)
+{
+    Instruction *insts = cfg->instructions;
+    uint32_t b = 0, f = 0;
+    for (size_t k = 0; k < cfg->count; k++) {
+        if (starts_function(insts, k)) {
+            if (f > 0) {
+                cfg->functions[f - 1].end = k;
+                cfg->functions[f - 1].end_block = b;
+            }
+            Cfg_Function *func = cfg->functions + f++;
+            func->symbol = insts[k].opcode == OP_FUNCTION ? insts[k].symbol
+                : NO_SYMBOL;
+            func->first = k;
+            func->first_block = b;
+            func->first_call = 0;
+            func->call_count = 0;
+        }
+        if (starts_block(insts, k)) {
+            if (b > 0)
+                cfg->blocks[b - 1].end = k;
+            Basic_Block *block = cfg->blocks + b++;
+            block->first = k;
+            block->function = f - 1;
+            block->successors[0] = CFG_NONE;
+            block->successors[1] = CFG_NONE;
+            block->first_predecessor = 0;
+            block->predecessor_count = 0;
+        }
+    }
+    if (b > 0)
+        cfg->blocks[b - 1].end = cfg->count;
+    if (f > 0) {
+        cfg->functions[f - 1].end = cfg->count;
+        cfg->functions[f - 1].end_block = b;
+    }
+}
+
+// Points each block at the blocks that can run after it. 'label_block' and
+// 'label_function' are indexed by symbol id.
+static void link_blocks(Cfg *cfg, uint32_t *label_block,
+    uint32_t *label_function)
+{
+    Instruction *insts = cfg->instructions;
+    for (uint32_t f = 0; f < cfg->function_count; f++) {
+        Cfg_Function *func = cfg->functions + f;
+        for (uint32_t b = func->first_block; b < func->end_block; b++) {
+            Instruction *first = insts + cfg->blocks[b].first;
+            if (first->opcode == OP_LABEL && label_function[first->symbol] != f) {
+                label_function[first->symbol] = f;
+                label_block[first->symbol] = b;
+            }
+        }
+
+        for (uint32_t b = func->first_block; b < func->end_block; b++) {
+            Basic_Block *block = cfg->blocks + b;
+            Instruction *last = insts + block->end - 1;
+            uint32_t next = b + 1 < func->end_block ? b + 1 : CFG_NONE;
+            uint32_t target = CFG_NONE;
+            if (last->opcode == OP_GOTO || last->opcode == OP_IF_GOTO)
+                if (label_function[last->symbol] == f)
+                    target = label_block[last->symbol];
+
+            if (last->opcode == OP_GOTO)
+                block->successors[0] = target;
+            else if (last->opcode == OP_IF_GOTO) {
+                block->successors[0] = target;
+                block->successors[1] = target == next ? CFG_NONE : next;
+            } else if (last->opcode != OP_RETURN)
+                block->successors[0] = next;
+        }
+    }
+}
+
+// Fills in the predecessor lists from the successors
+static int link_predecessors(Cfg *cfg)
+{
+    uint32_t edges = 0;
+    for (uint32_t b = 0; b < cfg->block_count; b++)
+        for (int s = 0; s < 2; s++)
+            if (cfg->blocks[b].successors[s] != CFG_NONE) {
+                cfg->blocks[cfg->blocks[b].successors[s]].predecessor_count++;
+                edges++;
+            }
+
+    cfg->predecessors = hvm_malloc(edges * sizeof(uint32_t), HVM_MEM_ANALYSIS);
+    if (!cfg->predecessors)
+        return 1;
+    uint32_t offset = 0;
+    for (uint32_t b = 0; b < cfg->block_count; b++) {
+        cfg->blocks[b].first_predecessor = offset;
+        offset += cfg->blocks[b].predecessor_count;
+        cfg->blocks[b].predecessor_count = 0;
+    }
+    for (uint32_t b = 0; b < cfg->block_count; b++)
+        for (int s = 0; s < 2; s++) {
+            uint32_t succ = cfg->blocks[b].successors[s];
+            if (succ == CFG_NONE)
+                continue;
+            Basic_Block *target = cfg->blocks + succ;
+            cfg->predecessors[target->first_predecessor
+                + target->predecessor_count++] = b;
+        }
+    return 0;
+}
+
+// Fills in every function's call sites. 'function_of' is indexed by
+// symbol id.
+static int link_calls(Cfg *cfg, uint32_t *function_of)
+{
+    Instruction *insts = cfg->instructions;
+    uint32_t count = 0;
+    for (size_t k = 0; k < cfg->count; k++)
+        count += insts[k].opcode == OP_CALL;
+
+    cfg->calls = hvm_malloc(count * sizeof(Call_Site), HVM_MEM_ANALYSIS);
+    if (!cfg->calls)
+        return 1;
+    for (uint32_t f = 0; f < cfg->function_count; f++) {
+        Cfg_Function *func = cfg->functions + f;
+        func->first_call = cfg->call_count;
+        for (size_t k = func->first; k < func->end; k++) {
+            if (insts[k].opcode != OP_CALL)
+                continue;
+            Call_Site *site = cfg->calls + cfg->call_count++;
+            site->instruction = k;
+            site->callee = function_of[insts[k].symbol];
+        }
+        func->call_count = cfg->call_count - func->first_call;
+    }
+    return 0;
+}
+
+int hvm_cfg_build(Cfg *cfg, Instruction *instructions, size_t count,
+    Symbol_Table *st)
+{
+    memset(cfg, 0, sizeof(Cfg));
+    cfg->instructions = instructions;
+    cfg->count = count;
+    for (size_t k = 0; k < count; k++) {
+        cfg->block_count += starts_block(instructions, k);
+        cfg->function_count += starts_function(instructions, k);
+    }
+
+    // Symbol id to function, and to the block of a label and the function
+    // declaring it
+    size_t symbols = st->count ? st->count : 1;
+    uint32_t *function_of = hvm_malloc(3 * symbols * sizeof(uint32_t),
+        HVM_MEM_ANALYSIS);
+    cfg->blocks = hvm_malloc(cfg->block_count * sizeof(Basic_Block),
+        HVM_MEM_ANALYSIS);
+    cfg->functions = hvm_malloc(cfg->function_count * sizeof(Cfg_Function),
+        HVM_MEM_ANALYSIS);
+    if (!function_of || !cfg->blocks || !cfg->functions) {
+        hvm_free(function_of);
+        hvm_cfg_free(cfg);
+        return 1;
+    }
+    uint32_t *label_block = function_of + symbols;
+    uint32_t *label_function = label_block + symbols;
+    memset(function_of, 0xff, 3 * symbols * sizeof(uint32_t));
+
+    split_blocks(cfg);
+    for (uint32_t f = cfg->function_count; f > 0; f--) {
+        uint32_t symbol = cfg->functions[f - 1].symbol;
+        if (symbol != NO_SYMBOL)
+            function_of[symbol] = f - 1;
+    }
+    link_blocks(cfg, label_block, label_function);
+    int failed = link_predecessors(cfg) || link_calls(cfg, function_of);
+    hvm_free(function_of);
+    if (failed)
+        hvm_cfg_free(cfg);
+    return failed;
+}
+
+uint32_t hvm_cfg_block_of(Cfg *cfg, size_t instruction)
+{
+    uint32_t low = 0, high = cfg->block_count;
+    while (high - low > 1) {
+        uint32_t mid = low + (high - low) / 2;
+        if (cfg->blocks[mid].first <= instruction)
+            low = mid;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+int hvm_instruction_stack_effect(Instruction *i)
+{
+    return i->opcode == OP_CALL ? 1 - i->number
+        : OPCODE_STACK_EFFECTS[i->opcode];
+}
+
+// Takes the depth reaching the start of 'b' along one more edge. Returns 1
+// if that changed it.
+static int merge_depth(int32_t *block_depth, uint32_t b, int32_t depth)
+{
+    if (block_depth[b] == DEPTH_UNREACHED) {
+        block_depth[b] = depth;
+        return 1;
+    }
+    if (block_depth[b] != depth && block_depth[b] != CFG_UNKNOWN_DEPTH) {
+        block_depth[b] = CFG_UNKNOWN_DEPTH;
+        return 1;
+    }
+    return 0;
+}
+
+int32_t *hvm_cfg_stack_depths(Cfg *cfg)
+{
+    int32_t *depths = hvm_malloc((cfg->count ? cfg->count : 1)
+        * sizeof(int32_t), HVM_MEM_ANALYSIS);
+    // Each block changes at most twice: once reached, once found unknown
+    uint32_t *worklist = hvm_malloc((2 * (size_t) cfg->block_count + 1)
+        * sizeof(uint32_t), HVM_MEM_ANALYSIS);
+    int32_t *block_depth = hvm_malloc((cfg->block_count + 1) * sizeof(int32_t),
+        HVM_MEM_ANALYSIS);
+    if (!depths || !worklist || !block_depth) {
+        hvm_free(depths);
+        hvm_free(worklist);
+        hvm_free(block_depth);
+        return NULL;
+    }
+
+    size_t pending = 0;
+    for (uint32_t b = 0; b < cfg->block_count; b++)
+        block_depth[b] = DEPTH_UNREACHED;
+    for (uint32_t f = 0; f < cfg->function_count; f++) {
+        block_depth[cfg->functions[f].first_block] = 0;
+        worklist[pending++] = cfg->functions[f].first_block;
+    }
+
+    while (pending > 0) {
+        Basic_Block *block = cfg->blocks + worklist[--pending];
+        int32_t depth = block_depth[block - cfg->blocks];
+        if (depth != CFG_UNKNOWN_DEPTH)
+            for (size_t k = block->first; k < block->end; k++)
+                depth += hvm_instruction_stack_effect(cfg->instructions + k);
+        for (int s = 0; s < 2; s++) {
+            uint32_t succ = block->successors[s];
+            if (succ != CFG_NONE && merge_depth(block_depth, succ, depth))
+                worklist[pending++] = succ;
+        }
+    }
+
+    for (uint32_t b = 0; b < cfg->block_count; b++) {
+        Basic_Block *block = cfg->blocks + b;
+        int32_t depth = block_depth[b] == DEPTH_UNREACHED ? CFG_UNKNOWN_DEPTH
+            : block_depth[b];
+        for (size_t k = block->first; k < block->end; k++) {
+            depths[k] = depth;
+            if (depth != CFG_UNKNOWN_DEPTH)
+                depth += hvm_instruction_stack_effect(cfg->instructions + k);
+        }
+    }
+    hvm_free(worklist);
+    hvm_free(block_depth);
+    return depths;
+}
+
+int hvm_dataflow_problem_init(Dataflow_Problem *p, Cfg *cfg,
+    enum DATAFLOW_DIRECTION direction, enum DATAFLOW_MEET meet, size_t bits)
+{
+    p->direction = direction;
+    p->meet = meet;
+    p->bits = bits;
+    p->words = bitset_words(bits);
+    p->boundary = NULL;
+    size_t size = (cfg->block_count * p->words + 1) * sizeof(uint64_t);
+    p->gen = hvm_calloc(1, size, HVM_MEM_ANALYSIS);
+    p->kill = hvm_calloc(1, size, HVM_MEM_ANALYSIS);
+    if (!p->gen || !p->kill) {
+        hvm_dataflow_problem_free(p);
+        return 1;
+    }
+    return 0;
+}
+
+void hvm_dataflow_problem_free(Dataflow_Problem *p)
+{
+    hvm_free(p->gen);
+    hvm_free(p->kill);
+    p->gen = NULL;
+    p->kill = NULL;
+}
+
+void hvm_dataflow_result_free(Dataflow_Result *r)
+{
+    hvm_free(r->in);
+    r->in = NULL;
+    r->out = NULL;
+}
+
+// Every bit of the lattice set, none past it
+static void fill_set(uint64_t *set, size_t words, size_t bits)
+{
+    memset(set, 0xff, words * sizeof(uint64_t));
+    if (bits % 64)
+        set[words - 1] = ((uint64_t) 1 << (bits % 64)) - 1;
+}
+
+static void meet_set(enum DATAFLOW_MEET meet, uint64_t *to, uint64_t *from,
+    size_t words)
+{
+    for (size_t w = 0; w < words; w++)
+        to[w] = meet == DATAFLOW_UNION ? to[w] | from[w] : to[w] & from[w];
+}
+
+// Neighbours that flow into 'block': predecessors going forward,
+// successors going backward. Returns how many went into 'from'.
+static int flow_sources(Cfg *cfg, Dataflow_Problem *p, uint32_t block,
+    uint32_t *from, uint32_t **sources)
+{
+    Basic_Block *b = cfg->blocks + block;
+    if (p->direction == DATAFLOW_FORWARD) {
+        *sources = cfg->predecessors + b->first_predecessor;
+        return (int) b->predecessor_count;
+    }
+    int count = 0;
+    for (int s = 0; s < 2; s++)
+        if (b->successors[s] != CFG_NONE)
+            from[count++] = b->successors[s];
+    *sources = from;
+    return count;
+}
+
+// Whether the boundary set also flows into 'block'
+static int on_boundary(Cfg *cfg, Dataflow_Problem *p, uint32_t block)
+{
+    Basic_Block *b = cfg->blocks + block;
+    if (p->direction == DATAFLOW_FORWARD)
+        return cfg->functions[b->function].first_block == block;
+    return b->successors[0] == CFG_NONE && b->successors[1] == CFG_NONE;
+}
+
+int hvm_dataflow_solve(Cfg *cfg, Dataflow_Problem *p, Dataflow_Result *r)
+{
+    size_t words = p->words;
+    uint32_t blocks = cfg->block_count;
+    r->words = words;
+    r->in = hvm_malloc((2 * blocks * words + 1) * sizeof(uint64_t),
+        HVM_MEM_ANALYSIS);
+    r->out = r->in + blocks * words;
+    uint64_t *scratch = hvm_malloc((words + 1) * sizeof(uint64_t),
+        HVM_MEM_ANALYSIS);
+    uint32_t *queue = hvm_malloc((blocks + 1) * sizeof(uint32_t),
+        HVM_MEM_ANALYSIS);
+    char *queued = hvm_malloc(blocks + 1, HVM_MEM_ANALYSIS);
+    if (!r->in || !scratch || !queue || !queued) {
+        hvm_dataflow_result_free(r);
+        hvm_free(scratch);
+        hvm_free(queue);
+        hvm_free(queued);
+        return 1;
+    }
+
+    // 'before' is what the meet produces, 'after' what the transfer does
+    int forward = p->direction == DATAFLOW_FORWARD;
+    uint64_t *before = forward ? r->in : r->out;
+    uint64_t *after = forward ? r->out : r->in;
+    for (uint32_t b = 0; b < blocks; b++) {
+        if (p->meet == DATAFLOW_UNION) {
+            memset(before + b * words, 0, words * sizeof(uint64_t));
+            memset(after + b * words, 0, words * sizeof(uint64_t));
+        } else {
+            fill_set(before + b * words, words, p->bits);
+            fill_set(after + b * words, words, p->bits);
+        }
+    }
+
+    // Blocks run in flow order at first, so most sets are final after one
+    // pass over loop-free code
+    size_t head = 0, pending = blocks;
+    for (uint32_t k = 0; k < blocks; k++) {
+        queue[k] = forward ? k : blocks - 1 - k;
+        queued[k] = 1;
+    }
+
+    while (pending > 0) {
+        uint32_t b = queue[head];
+        head = head + 1 == blocks ? 0 : head + 1;
+        pending--;
+        queued[b] = 0;
+
+        uint32_t successors[2], *sources;
+        int source_count = flow_sources(cfg, p, b, successors, &sources);
+        uint64_t *in = before + b * words;
+        int boundary = on_boundary(cfg, p, b);
+        if (p->meet == DATAFLOW_UNION)
+            memset(in, 0, words * sizeof(uint64_t));
+        else
+            fill_set(in, words, p->bits);
+        if (boundary) {
+            if (p->boundary)
+                meet_set(p->meet, in, p->boundary, words);
+            else if (p->meet == DATAFLOW_INTERSECTION)
+                memset(in, 0, words * sizeof(uint64_t));
+        }
+        for (int k = 0; k < source_count; k++)
+            meet_set(p->meet, in, after + sources[k] * words, words);
+
+        uint64_t *gen = p->gen + b * words, *kill = p->kill + b * words;
+        uint64_t *out = after + b * words;
+        int changed = 0;
+        for (size_t w = 0; w < words; w++) {
+            scratch[w] = gen[w] | (in[w] & ~kill[w]);
+            changed |= scratch[w] != out[w];
+        }
+        if (!changed)
+            continue;
+        memcpy(out, scratch, words * sizeof(uint64_t));
+
+        // The blocks this one flows into need another look
+        Basic_Block *block = cfg->blocks + b;
+        for (uint32_t k = 0; k < (forward ? 2 : block->predecessor_count); k++) {
+            uint32_t next = forward ? block->successors[k]
+                : cfg->predecessors[block->first_predecessor + k];
+            if (next == CFG_NONE || queued[next])
+                continue;
+            queue[(head + pending++) % blocks] = next;
+            queued[next] = 1;
+        }
+    }
+
+    hvm_free(scratch);
+    hvm_free(queue);
+    hvm_free(queued);
+    return 0;
+}
@@ -0,0 +1,151 @@
+#ifndef CFG_H
+#define CFG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "hvm.h"
+#include "symbol.h"
+
+#define CFG_NONE                           UINT32_MAX
+#define CFG_UNKNOWN_DEPTH                  INT32_MIN
+
+// Straight-line run of instructions. Blocks start at a function
+// declaration, at a label and after goto, if-goto and return.
+typedef struct {
+    size_t first; // First instruction
+    size_t end; // One past the last instruction
+    uint32_t function; // Index into Cfg.functions
+    // Block indices, CFG_NONE if absent. An if-goto's target comes first and
+    // the block after it second. Jumps to labels not declared in the same
+    // function have no successor.
+    uint32_t successors[2];
+    uint32_t first_predecessor; // Into Cfg.predecessors
+    uint32_t predecessor_count;
+} Basic_Block;
+
+typedef struct {
+    size_t instruction;
+    uint32_t callee; // Index into Cfg.functions, CFG_NONE if not declared
+} Call_Site;
+
+// Instructions from one function declaration to the next. Instructions
+// before the first declaration make up a function of their own, with
+// 'symbol' NO_SYMBOL.
+typedef struct {
+    uint32_t symbol;
+    size_t first; // First instruction
+    size_t end;
+    uint32_t first_block; // The entry block
+    uint32_t end_block;
+    uint32_t first_call; // Into Cfg.calls, in instruction order
+    uint32_t call_count;
+} Cfg_Function;
+
+// Control-flow graph of every function in an instruction array, and the
+// call graph between them. Edges never cross functions.
+typedef struct {
+    Instruction *instructions;
+    size_t count;
+    Basic_Block *blocks; // In instruction order
+    uint32_t block_count;
+    uint32_t *predecessors;
+    Cfg_Function *functions;
+    uint32_t function_count;
+    Call_Site *calls;
+    uint32_t call_count;
+} Cfg;
+
+// Builds the graphs of 'count' instructions named through 'st'. Labels
+// and calls resolve to the first declaration with their name. Returns 1 if
+// out of memory.
+int hvm_cfg_build(Cfg *cfg, Instruction *instructions, size_t count,
+    Symbol_Table *st);
+void hvm_cfg_free(Cfg *cfg);
+
+// Returns the block holding 'instruction'
+uint32_t hvm_cfg_block_of(Cfg *cfg, size_t instruction);
+
+// Change in working stack depth after running 'i'. A call replaces its
+// arguments with the return value, a return pops the return value.
+int hvm_instruction_stack_effect(Instruction *i);
+
+// Returns the working stack depth before each instruction, counted from the
+// start of its function: 0 at the declaration, negative if the function
+// popped more than it pushed. CFG_UNKNOWN_DEPTH where unreachable or where
+// paths merge with different depths. hvm_malloc'd, NULL if out of memory.
+int32_t *hvm_cfg_stack_depths(Cfg *cfg);
+
+static inline size_t bitset_words(size_t bits)
+{
+    return (bits + 63) / 64;
+}
+
+static inline void bitset_set(uint64_t *set, size_t bit)
+{
+    set[bit / 64] |= (uint64_t) 1 << (bit % 64);
+}
+
+static inline void bitset_clear(uint64_t *set, size_t bit)
+{
+    set[bit / 64] &= ~((uint64_t) 1 << (bit % 64));
+}
+
+static inline int bitset_test(uint64_t *set, size_t bit)
+{
+    return (set[bit / 64] >> (bit % 64)) & 1;
+}
+
+enum DATAFLOW_DIRECTION {
+    DATAFLOW_FORWARD = 0,
+    DATAFLOW_BACKWARD,
+};
+
+enum DATAFLOW_MEET {
+    DATAFLOW_UNION = 0, // May analyses, starting from the empty set
+    DATAFLOW_INTERSECTION, // Must analyses, starting from the full set
+};
+
+// Bit vector problem over the blocks of a Cfg. Each block's transfer
+// function is out = gen | (in & ~kill), with in and out swapped when going
+// backward. Sets are 'words' words each, block b's at gen + b * words.
+typedef struct {
+    enum DATAFLOW_DIRECTION direction;
+    enum DATAFLOW_MEET meet;
+    size_t bits;
+    size_t words;
+    uint64_t *gen;
+    uint64_t *kill;
+    // Set flowing into function entries going forward, or out of blocks
+    // without successors going backward. NULL for the empty set.
+    uint64_t *boundary;
+} Dataflow_Problem;
+
+// Sets holding before ('in') and after ('out') each block, in program
+// order whatever the direction
+typedef struct {
+    size_t words;
+    uint64_t *in;
+    uint64_t *out;
+} Dataflow_Result;
+
+// Allocates empty gen and kill sets of 'bits' bits for every block of
+// 'cfg'. Returns 1 if out of memory.
+int hvm_dataflow_problem_init(Dataflow_Problem *p, Cfg *cfg,
+    enum DATAFLOW_DIRECTION direction, enum DATAFLOW_MEET meet, size_t bits);
+void hvm_dataflow_problem_free(Dataflow_Problem *p);
+
+// Iterates 'p' over 'cfg' to its fixed point. Returns 1 if out of memory.
+int hvm_dataflow_solve(Cfg *cfg, Dataflow_Problem *p, Dataflow_Result *r);
+void hvm_dataflow_result_free(Dataflow_Result *r);
+
+static inline uint64_t *dataflow_in(Dataflow_Result *r, uint32_t block)
+{
+    return r->in + block * r->words;
+}
+
+static inline uint64_t *dataflow_out(Dataflow_Result *r, uint32_t block)
+{
+    return r->out + block * r->words;
+}
+
+#endif // CFG_H
@@ -0,0 +1,81 @@
+#include <stdlib.h>
+#include "emit.h"
+#include "libhvm.h"
+
+#define EMITTER_MIN_CAPACITY               4096
+
+static const char DIGIT_PAIRS[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+int hvm_emitter_alloc(Emitter *e, size_t size)
+{
+    e->buf = hvm_malloc(size, HVM_MEM_OUTPUT);
+    if (!e->buf)
+        return 1;
+
+    e->len = 0;
+    e->capacity = size;
+    return 0;
+}
+
+int hvm_emitter_grow(Emitter *e, size_t extra)
+{
+    // Double, so a run of small reserves costs amortized O(1) copies
+    size_t capacity = e->capacity ? e->capacity : EMITTER_MIN_CAPACITY;
+    while (capacity - e->len < extra)
+        capacity *= 2;
+
+    char *buf = hvm_realloc(e->buf, capacity, HVM_MEM_OUTPUT);
+    if (!buf)
+        return 1;
+
+    e->buf = buf;
+    e->capacity = capacity;
+    return 0;
+}
+
+void hvm_emitter_free(Emitter *e)
+{
+    hvm_free(e->buf);
+    *e = EMITTER_INIT;
+}
+
+size_t hvm_uint_digits(size_t v)
+{
+    size_t n = 1;
+    while (v >= 10) {
+        v /= 10;
+        n++;
+    }
+    return n;
+}
+
+void hvm_emit_uint(Emitter *e, size_t v)
+{
+    // Fill from the right, two digits at a time
+    char tmp[UINT_MAX_DIGITS];
+    char *p = tmp + UINT_MAX_DIGITS;
+    while (v >= 100) {
+        size_t pair = (v % 100) * 2;
+        v /= 100;
+        *--p = DIGIT_PAIRS[pair + 1];
+        *--p = DIGIT_PAIRS[pair];
+    }
+    if (v >= 10) {
+        *--p = DIGIT_PAIRS[v * 2 + 1];
+        *--p = DIGIT_PAIRS[v * 2];
+    } else {
+        *--p = (char) ('0' + v);
+    }
+
+    emit_bytes(e, p, tmp + UINT_MAX_DIGITS - p);
+}
@@ -0,0 +1,70 @@
+#ifndef EMIT_H
+#define EMIT_H
+
+#include <stddef.h>
+#include <string.h>
+
+// Growable output buffer. Writers reserve room for a whole snippet once,
+// then append pieces without bounds checks.
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t capacity;
+} Emitter;
+
+#define EMITTER_INIT ((Emitter) { .buf = NULL, .len = 0, .capacity = 0 })
+
+// Longest decimal written by hvm_emit_uint
+#define UINT_MAX_DIGITS                    20
+
+// Pre-split piece of Hack code, copied verbatim
+typedef struct {
+    const char *str;
+    size_t len;
+} Template;
+
+#define TEMPLATE(s) { (s), sizeof(s) - 1 }
+
+// Allocates exactly 'size' bytes for an empty emitter, for callers that
+// know their final output size. Returns 1 if out of memory.
+int hvm_emitter_alloc(Emitter *e, size_t size);
+
+// Slow path of emit_reserve. Returns 1 if out of memory.
+int hvm_emitter_grow(Emitter *e, size_t extra);
+void hvm_emitter_free(Emitter *e);
+
+// Makes sure 'extra' more bytes fit. Returns 1 if out of memory.
+static inline int emit_reserve(Emitter *e, size_t extra)
+{
+    if (e->capacity - e->len >= extra)
+        return 0;
+    return hvm_emitter_grow(e, extra);
+}
+
+// All emit_* writers below assume space was reserved
+
+static inline void emit_bytes(Emitter *e, const char *s, size_t n)
+{
+    memcpy(e->buf + e->len, s, n);
+    e->len += n;
+}
+
+static inline void emit_template(Emitter *e, Template t)
+{
+    emit_bytes(e, t.str, t.len);
+}
+
+static inline void emit_char(Emitter *e, char c)
+{
+    e->buf[e->len++] = c;
+}
+
+#define emit_literal(e, s) emit_bytes((e), (s), sizeof(s) - 1)
+
+// Writes 'v' in decimal, at most UINT_MAX_DIGITS bytes
+void hvm_emit_uint(Emitter *e, size_t v);
+
+// Number of decimal digits hvm_emit_uint writes for 'v'
+size_t hvm_uint_digits(size_t v);
+
+#endif // EMIT_H
@@ -1,65 +1,183 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <limits.h>
+#include <errno.h>
 #include "file.h"
+#include "libhvm.h"
 
-#define READ_BUF_SIZE 256
+#define READ_CHUNK_SIZE (64 * 1024)
+#define DIR_BUF_SIZE    (64 * 1024)
 
-// Completely read file, all at once
-char* load_file(char* file_path, size_t* size)
+// File system calls made so far
+static long syscall_count = 0;
+
+// Entry as returned by getdents64
+struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+void io_count_syscalls(long n)
+{
+    __atomic_fetch_add(&syscall_count, n, __ATOMIC_RELAXED);
+}
+
+long io_syscall_count(void)
+{
+    return __atomic_load_n(&syscall_count, __ATOMIC_RELAXED);
+}
+
+// Maps 'size' bytes of a regular file read-only, followed by a '\0' sentinel.
+// An anonymous zero mapping one byte longer than the file is reserved first
+// and the file is mapped over it, so the byte after the last one is always
+// readable and zero, even when the size is a multiple of the page size.
+static Loaded_File map_fd(int fd, size_t size)
+{
+    Loaded_File f = { .buf = NULL, .size = 0, .map_size = 0 };
+
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t map_size = (size + 1 + page - 1) & ~(page - 1);
+    io_count_syscalls(3);
+
+    char *base = mmap(NULL, map_size, PROT_READ,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return f;
+
+    if (mmap(base, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, map_size);
+        return f;
+    }
+
+    madvise(base, size, MADV_SEQUENTIAL);
+
+    f.buf = base;
+    f.size = size;
+    f.map_size = map_size;
+    hvm_count_mapping(map_size);
+    return f;
+}
+
+// Reads everything from 'fd' straight into a growing buffer, for pipes and
+// files that can't be mapped. 'size_hint' is the expected size, or 0.
+static Loaded_File read_fd(int fd, size_t size_hint)
+{
+    Loaded_File f = { .buf = NULL, .size = 0, .map_size = 0 };
+
+    size_t capacity = (size_hint ? size_hint : READ_CHUNK_SIZE) + 1;
+    char *buf = hvm_malloc(capacity, HVM_MEM_IO);
+    if (!buf)
+        return f;
+
+    size_t total_read = 0;
+    while (1) {
+        // Always keep room for the sentinel
+        if (total_read + 1 >= capacity) {
+            capacity *= 2;
+            char *grown = hvm_realloc(buf, capacity, HVM_MEM_IO);
+            if (!grown) {
+                hvm_free(buf);
+                return f;
+            }
+            buf = grown;
+        }
+
+        ssize_t bytes_read = read(fd, buf + total_read, capacity - 1 - total_read);
+        io_count_syscalls(1);
+        if (bytes_read < 0) {
+            hvm_free(buf);
+            return f;
+        }
+        if (bytes_read == 0)
+            break;
+        total_read += (size_t) bytes_read;
+    }
+    buf[total_read] = '\0';
+
+    f.buf = buf;
+    f.size = total_read;
+    return f;
+}
+
+// Completely load file, all at once. Regular files are memory-mapped,
+// anything else is read in bulk. On error, the returned buf is NULL.
+Loaded_File load_file(char* file_path)
 {
-    char buf[READ_BUF_SIZE];
+    Loaded_File f = { .buf = NULL, .size = 0, .map_size = 0 };
 
     int fd = open(file_path, O_RDONLY);
+    io_count_syscalls(3); // open, fstat, close
     if (fd == -1) {
         printf("Couldn't open %s\n", file_path);
-        return 0;
+        return f;
     }
 
     struct stat st;
     if (fstat(fd, &st) == -1) {
         printf("fstat failed\n");
-        return 0;
+        close(fd);
+        return f;
     }
 
-    size_t file_size = (size_t) st.st_size;
+    if (S_ISREG(st.st_mode) && st.st_size > 0)
+        f = map_fd(fd, (size_t) st.st_size);
+
+    // Not mappable (pipe, special file, or mmap refused)
+    if (!f.buf)
+        f = read_fd(fd, S_ISREG(st.st_mode) ? (size_t) st.st_size : 0);
 
-    // Set size pointer if given
-    if (size) {
-        *size = file_size;
+    close(fd);
+
+    if (!f.buf) {
+        printf("Couldn't read %s\n", file_path);
+        return f;
     }
 
-    size_t bytes_read = read(fd, buf, READ_BUF_SIZE);
-    if (bytes_read == 0) {
+    if (f.size == 0) {
         printf("File %s empty\n", file_path);
-        return 0;
-    }
-    if (bytes_read < 0) {
-        printf("Couldn't read %s\n", file_path);
-        return 0;
+        unload_file(&f);
+        return f;
     }
 
-    size_t total_read = 0;
-    char* file_string = malloc(file_size + 1);
+    return f;
+}
 
-    do {
-        for (size_t i = 0; i < bytes_read; i++) {
-            file_string[total_read + i] = buf[i];
-        }
-        total_read += bytes_read;
-        bytes_read = read(fd, buf, READ_BUF_SIZE);
-    } while(bytes_read > 0);
-    file_string[file_size] = '\0';
+// Release a file returned by load_file
+void unload_file(Loaded_File *f)
+{
+    if (!f->buf)
+        return;
 
-    return file_string;
+    if (f->map_size) {
+        munmap(f->buf, f->map_size);
+        io_count_syscalls(1);
+        hvm_count_unmapping(f->map_size);
+    }
+    else
+        hvm_free(f->buf);
+
+    f->buf = NULL;
+    f->size = 0;
+    f->map_size = 0;
 }
 
 // Completely write file, all at once
 int write_file(char *buf, char *path, size_t size)
 {
     FILE *fp = fopen(path, "wb");
+    io_count_syscalls(3); // open, write, close
     if (!fp) {
         printf("Couldn't open file '%s' for writing\n", path);
         return 1;
@@ -70,9 +188,210 @@ int write_file(char *buf, char *path, size_t size)
     int err = ferror(fp);
     if (err) {
         printf("I/O error %i when writing to file '%s'\n", err, path);
+        fclose(fp);
         return 1;
     }
 
     fclose(fp);
     return 0;
 }
+
+// Completely write file from 'iov_count' buffers in order, without joining
+// them first. Handles partial writes and more buffers than IOV_MAX.
+int write_file_vec(struct iovec *iov, int iov_count, char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    io_count_syscalls(2); // open, close
+    if (fd == -1) {
+        printf("Couldn't open file '%s' for writing\n", path);
+        return 1;
+    }
+
+    // Skip leading empty buffers so the loop below always makes progress
+    while (iov_count > 0 && iov->iov_len == 0) {
+        iov++;
+        iov_count--;
+    }
+
+    while (iov_count > 0) {
+        int batch = iov_count < IOV_MAX ? iov_count : IOV_MAX;
+        ssize_t written = writev(fd, iov, batch);
+        io_count_syscalls(1);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            printf("I/O error %i when writing to file '%s'\n", errno, path);
+            close(fd);
+            return 1;
+        }
+
+        // Drop fully written buffers, trim a partially written one.
+        // Adjusts the caller's array in place.
+        size_t left = (size_t) written;
+        while (iov_count > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            iov_count--;
+        }
+        if (iov_count > 0) {
+            iov->iov_base = (char*) iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+
+    if (close(fd) == -1) {
+        printf("I/O error %i when writing to file '%s'\n", errno, path);
+        return 1;
+    }
+
+    return 0;
+}
+
+int open_stream(char *path, int write)
+{
+    if (strcmp(path, "-") == 0)
+        return write ? STDOUT_FILENO : STDIN_FILENO;
+    if (write)
+        return open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    return open(path, O_RDONLY);
+}
+
+int close_stream(int fd)
+{
+    if (fd == STDIN_FILENO || fd == STDOUT_FILENO)
+        return 0;
+    return close(fd) == -1;
+}
+
+long read_stream(void *fd, char *buf, size_t size)
+{
+    while (1) {
+        ssize_t n = read(*(int*) fd, buf, size);
+        if (n >= 0 || errno != EINTR)
+            return n;
+    }
+}
+
+int write_stream(void *fd, char *buf, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = write(*(int*) fd, buf, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        buf += n;
+        size -= (size_t) n;
+    }
+    return 0;
+}
+
+int is_dir(char *path)
+{
+    struct stat st;
+    io_count_syscalls(1);
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+// Reads entries with getdents64 in large batches instead of one readdir
+// call per entry, and only stats entries whose type the file system
+// doesn't report
+char **list_dir(char *path, char *extension, int *count)
+{
+    *count = 0;
+    int fd = open(path, O_RDONLY | O_DIRECTORY);
+    io_count_syscalls(2); // open, close
+    if (fd == -1)
+        return NULL;
+
+    char *buf = hvm_malloc(DIR_BUF_SIZE, HVM_MEM_IO);
+    int capacity = 64;
+    char **paths = hvm_malloc(capacity * sizeof(char*), HVM_MEM_OTHER);
+    size_t path_len = strlen(path);
+    size_t ext_len = strlen(extension);
+
+    // "dir/" and "dir" both give "dir/name"
+    while (path_len > 1 && path[path_len - 1] == '/')
+        path_len--;
+
+    while (1) {
+        long n = syscall(SYS_getdents64, fd, buf, DIR_BUF_SIZE);
+        io_count_syscalls(1);
+        if (n < 0) {
+            for (int i = 0; i < *count; i++)
+                hvm_free(paths[i]);
+            hvm_free(paths);
+            hvm_free(buf);
+            close(fd);
+            *count = 0;
+            return NULL;
+        }
+        if (n == 0)
+            break;
+
+        for (long pos = 0; pos < n;) {
+            struct linux_dirent64 *d = (struct linux_dirent64*) (buf + pos);
+            pos += d->d_reclen;
+
+            size_t name_len = strlen(d->d_name);
+            if (name_len <= ext_len
+                || strcmp(d->d_name + name_len - ext_len, extension) != 0)
+                continue;
+
+            if (d->d_type != DT_REG) {
+                struct stat st;
+                if (d->d_type != DT_UNKNOWN && d->d_type != DT_LNK)
+                    continue;
+                io_count_syscalls(1);
+                if (fstatat(fd, d->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode))
+                    continue;
+            }
+
+            if (*count == capacity) {
+                capacity *= 2;
+                paths = hvm_realloc(paths, capacity * sizeof(char*),
+                    HVM_MEM_OTHER);
+            }
+            char *p = hvm_malloc(path_len + 1 + name_len + 1, HVM_MEM_OTHER);
+            memcpy(p, path, path_len);
+            p[path_len] = '/';
+            memcpy(p + path_len + 1, d->d_name, name_len + 1);
+            paths[(*count)++] = p;
+        }
+    }
+
+    hvm_free(buf);
+    close(fd);
+
+    // Directory order depends on the file system, sort for stable output
+    qsort(paths, *count, sizeof(char*), compare_paths);
+    return paths;
+}
+
+char *dir_name(char *path)
+{
+    char *full = realpath(path, NULL);
+    if (!full)
+        return NULL;
+
+    char *last_slash = strrchr(full, '/');
+    char *name = strcpy(hvm_malloc(strlen(last_slash + 1) + 1, HVM_MEM_OTHER),
+        last_slash + 1);
+    free(full); // From realpath, not counted
+    return name;
+}
+
+void prefetch_file(char *path)
+{
+    int fd = open(path, O_RDONLY);
+    io_count_syscalls(fd == -1 ? 1 : 3);
+    if (fd == -1)
+        return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+}
@@ -1,7 +1,55 @@
 #ifndef FILE_H
 #define FILE_H
 
-char *load_file(char* file_path, size_t* size);
+#include <stddef.h>
+#include <sys/uio.h>
+
+typedef struct {
+    char *buf; // File contents, always followed by a '\0' sentinel
+    size_t size; // Excluding the sentinel
+    size_t map_size; // Length of the mapping, 0 if buf was malloc'd
+} Loaded_File;
+
+Loaded_File load_file(char* file_path);
+void unload_file(Loaded_File *f);
 int write_file(char* buf, char *path, size_t size);
+int write_file_vec(struct iovec *iov, int iov_count, char *path);
+
+// Adds to the number of file system calls made, which the functions here
+// and in uring.c keep track of for --stats
+void io_count_syscalls(long n);
+long io_syscall_count(void);
+
+// Opens 'path' for reading, or for writing if 'write' is set. "-" is stdin
+// or stdout. Returns a descriptor or -1.
+int open_stream(char *path, int write);
+
+// Closes a descriptor from open_stream, leaving stdin and stdout open.
+// Returns 1 if pending writes failed.
+int close_stream(int fd);
+
+// Reads up to 'size' bytes from the descriptor at 'fd'. Returns how many,
+// 0 at the end, or -1 on error. Fits Hvm_Source.
+long read_stream(void *fd, char *buf, size_t size);
+
+// Writes all 'size' bytes to the descriptor at 'fd'. Returns 0 on success.
+// Fits Hvm_Sink.
+int write_stream(void *fd, char *buf, size_t size);
+
+// Returns 1 if 'path' is a directory
+int is_dir(char *path);
+
+// Lists the regular files in directory 'path' whose names end in
+// 'extension', as "path/name", sorted by name. Sets 'count'. Returns NULL
+// if the directory can't be read. hvm_free each path and the array.
+char **list_dir(char *path, char *extension, int *count);
+
+// Name of the directory 'path' itself, resolving "." and "..". Returns an
+// hvm_malloc'd string, or NULL.
+char *dir_name(char *path);
+
+// Asks the kernel to start reading 'path' into the page cache in the
+// background, so a later load_file doesn't wait on the disk
+void prefetch_file(char *path);
 
 #endif // FILE_H
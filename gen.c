@@ -0,0 +1,545 @@
+/*
+ hvm_gen - generates valid VM programs for benchmarking
+
+ Usage: hvm_gen dir [--size 64M] [--files 64] [--seed n]
+                    [--mix push=40,pop=15,arithmetic=25,...]
+                    [--segments constant=35,local=20,...]
+                    [--function-size 60] [--comments 0.1]
+
+ Writes 'files' files named G0.vm, G1.vm... into 'dir' (created if
+ needed), 'size' bytes in all. Sizes take a K, M or G suffix.
+
+ --mix weighs how often each kind of instruction is picked: push, pop,
+ arithmetic, label, goto, if-goto and call. --segments weighs the
+ segments of push and pop: argument, local, static, constant, this, that,
+ pointer and temp. Weights left out keep their defaults, 0 turns a kind
+ off. Functions average 'function-size' instructions and end in a return.
+ 'comments' is the share of lines that carry a comment, from 0 to 1.
+
+ The output is deterministic for a given seed. Jumps only go to labels of
+ their own function, calls only to functions already generated, and every
+ index is in range for its segment, below the function's argument and
+ local counts for those. The code is shaped like compiled Jack: nothing
+ pops what wasn't pushed, the stack is empty at labels and gotos and holds
+ just the condition at if-gotos, calls pass as many arguments as their
+ callee takes, and the label after a goto is always jumped to from
+ earlier, so no code is dead.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#define GEN_WRITE_BUFFER_SIZE              (1024 * 1024)
+#define GEN_MAX_LABELS                     64
+#define GEN_MAX_DEPTH                      8 // Working stack, within a function
+#define GEN_MAX_ARGUMENTS                  4
+#define GEN_MAX_LOCALS                     5
+
+enum GEN_KIND {
+    GEN_PUSH = 0,
+    GEN_POP,
+    GEN_ARITHMETIC,
+    GEN_LABEL,
+    GEN_GOTO,
+    GEN_IF_GOTO,
+    GEN_CALL,
+    GEN_KIND_COUNT
+};
+
+enum GEN_SEGMENT {
+    GEN_ARGUMENT = 0,
+    GEN_LOCAL,
+    GEN_STATIC,
+    GEN_CONSTANT,
+    GEN_THIS,
+    GEN_THAT,
+    GEN_POINTER,
+    GEN_TEMP,
+    GEN_SEGMENT_COUNT
+};
+
+static char *KIND_NAMES[GEN_KIND_COUNT] = {
+    "push", "pop", "arithmetic", "label", "goto", "if-goto", "call"
+};
+
+static char *SEGMENT_NAMES[GEN_SEGMENT_COUNT] = {
+    "argument", "local", "static", "constant", "this", "that", "pointer",
+    "temp"
+};
+
+// Largest index + 1 generated for each segment
+static unsigned SEGMENT_LIMITS[GEN_SEGMENT_COUNT] = {
+    8, 16, 64, 32768, 8, 8, 2, 8
+};
+
+static char *ARITHMETIC[] = {
+    "add", "sub", "neg", "eq", "gt", "lt", "and", "or", "not"
+};
+
+static char *UNARY[] = { "neg", "not" };
+
+static char *COMMENTS[] = {
+    "// let x = x + 1", "// if (i < n)", "// while loop", "// return value",
+    "// do Output.printInt(sum)", "// field access"
+};
+
+typedef struct {
+    char *dir;
+    unsigned long long size;
+    int files;
+    unsigned long long seed;
+    unsigned kind_weights[GEN_KIND_COUNT];
+    unsigned segment_weights[GEN_SEGMENT_COUNT];
+    unsigned function_size;
+    double comments;
+} Gen_Options;
+
+// State of the generator across files
+typedef struct {
+    unsigned long long rng;
+    unsigned long long bytes;
+    unsigned long long instructions;
+    unsigned long long functions;
+    unsigned long long *first_functions; // Id of the first in each file
+    unsigned char *arguments; // Arguments each function takes, by id
+    unsigned long long arguments_size;
+} Gen_State;
+
+// State of the function being generated
+typedef struct {
+    unsigned arguments;
+    unsigned locals;
+    unsigned depth; // Values on the working stack
+    unsigned labels; // Labels named so far, L0 up
+    unsigned declared[GEN_MAX_LABELS];
+    unsigned declared_count;
+    unsigned pending[GEN_MAX_LABELS]; // Jumped to but not declared yet
+    unsigned pending_count;
+} Gen_Function;
+
+// xorshift64*
+static unsigned long long next_random(Gen_State *g)
+{
+    g->rng ^= g->rng >> 12;
+    g->rng ^= g->rng << 25;
+    g->rng ^= g->rng >> 27;
+    return g->rng * 2685821657736338717ULL;
+}
+
+static unsigned random_below(Gen_State *g, unsigned n)
+{
+    return (unsigned) ((next_random(g) >> 32) % n);
+}
+
+static int pick_weighted(Gen_State *g, unsigned *weights, int count)
+{
+    unsigned total = 0;
+    for (int k = 0; k < count; k++)
+        total += weights[k];
+    unsigned r = random_below(g, total);
+    for (int k = 0; k < count; k++) {
+        if (r < weights[k])
+            return k;
+        r -= weights[k];
+    }
+    return count - 1;
+}
+
+// Parses "123", "64K", "2M" or "1G". Returns 0 if invalid.
+static unsigned long long parse_size(char *s)
+{
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(s, &end, 10);
+    if (errno || end == s)
+        return 0;
+    if (*end == 'K' || *end == 'k')
+        n <<= 10;
+    else if (*end == 'M' || *end == 'm')
+        n <<= 20;
+    else if (*end == 'G' || *end == 'g')
+        n <<= 30;
+    else if (*end != '\0')
+        return 0;
+    return (*end && end[1]) ? 0 : n;
+}
+
+// Parses "name=weight,..." into 'weights', indexed like 'names'.
+// Returns 1 on an unknown name or bad weight.
+static int parse_weights(char *s, char **names, int count, unsigned *weights)
+{
+    while (*s) {
+        char *eq = strchr(s, '=');
+        if (!eq)
+            return 1;
+
+        int k = 0;
+        while (k < count && (strlen(names[k]) != (size_t) (eq - s)
+            || strncmp(names[k], s, eq - s) != 0))
+            k++;
+        if (k == count)
+            return 1;
+
+        char *end;
+        long w = strtol(eq + 1, &end, 10);
+        if (end == eq + 1 || w < 0 || (*end != ',' && *end != '\0'))
+            return 1;
+        weights[k] = (unsigned) w;
+        s = *end ? end + 1 : end;
+    }
+    return 0;
+}
+
+// Writes an instruction, with a comment now and then
+static void emit_comment(Gen_State *g, Gen_Options *o, FILE *f, char *line)
+{
+    if (o->comments > 0 && random_below(g, 1000000) < o->comments * 1000000)
+        g->bytes += fprintf(f, "%s %s\n", line,
+            COMMENTS[random_below(g, sizeof(COMMENTS) / sizeof(*COMMENTS))]);
+    else
+        g->bytes += fprintf(f, "%s\n", line);
+    g->instructions++;
+}
+
+// A push or pop of a segment the function has, or push constant and pop
+// temp when the weights leave none
+static void emit_push_pop(Gen_State *g, Gen_Options *o, FILE *f,
+    Gen_Function *fn, int kind)
+{
+    unsigned weights[GEN_SEGMENT_COUNT];
+    unsigned total = 0;
+    for (int k = 0; k < GEN_SEGMENT_COUNT; k++) {
+        weights[k] = o->segment_weights[k];
+        if ((k == GEN_CONSTANT && kind == GEN_POP)
+            || (k == GEN_ARGUMENT && fn->arguments == 0)
+            || (k == GEN_LOCAL && fn->locals == 0))
+            weights[k] = 0;
+        total += weights[k];
+    }
+
+    int segment = kind == GEN_POP ? GEN_TEMP : GEN_CONSTANT;
+    if (total > 0)
+        segment = pick_weighted(g, weights, GEN_SEGMENT_COUNT);
+    unsigned limit = segment == GEN_ARGUMENT ? fn->arguments
+        : segment == GEN_LOCAL ? fn->locals : SEGMENT_LIMITS[segment];
+
+    char line[128];
+    snprintf(line, sizeof(line), "    %s %s %u", KIND_NAMES[kind],
+        SEGMENT_NAMES[segment], random_below(g, limit));
+    emit_comment(g, o, f, line);
+    fn->depth += kind == GEN_PUSH ? 1 : -1;
+}
+
+// Unary operators need one value, the others two
+static void emit_arithmetic(Gen_State *g, Gen_Options *o, FILE *f,
+    Gen_Function *fn)
+{
+    char *op = ARITHMETIC[random_below(g, 9)];
+    if (fn->depth < 2)
+        op = UNARY[random_below(g, 2)];
+
+    char line[128];
+    snprintf(line, sizeof(line), "    %s", op);
+    emit_comment(g, o, f, line);
+    if (strcmp(op, "neg") != 0 && strcmp(op, "not") != 0)
+        fn->depth--;
+}
+
+static void emit_label(Gen_State *g, Gen_Options *o, FILE *f,
+    Gen_Function *fn, unsigned label)
+{
+    char line[128];
+    snprintf(line, sizeof(line), "label L%u", label);
+    emit_comment(g, o, f, line);
+    fn->declared[fn->declared_count++] = label;
+}
+
+// Picks a label to jump to: one declared earlier, one jumped to but not
+// declared yet, or a new one declared later. Returns 0 if there's none.
+static int pick_target(Gen_State *g, Gen_Function *fn, unsigned *label)
+{
+    unsigned room = fn->labels < GEN_MAX_LABELS;
+    unsigned choices = fn->declared_count + fn->pending_count + room;
+    if (choices == 0)
+        return 0;
+
+    unsigned k = random_below(g, choices);
+    if (k < fn->declared_count) {
+        *label = fn->declared[k];
+    } else if (k < fn->declared_count + fn->pending_count) {
+        *label = fn->pending[k - fn->declared_count];
+    } else {
+        *label = fn->labels++;
+        fn->pending[fn->pending_count++] = *label;
+    }
+    return 1;
+}
+
+// A call to a recent function of this file, or to the first of an earlier
+// one, with the arguments it takes already on the stack. Pushes another
+// argument instead while there are too few.
+static void emit_call(Gen_State *g, Gen_Options *o, FILE *f,
+    Gen_Function *fn, unsigned long long id, int file)
+{
+    int callee_file = file;
+    unsigned long long callee = g->first_functions[file];
+    if (file > 0 && random_below(g, 4) == 0) {
+        callee_file = (int) random_below(g, (unsigned) file);
+        callee = g->first_functions[callee_file];
+    } else if (id > callee) {
+        unsigned long long recent = id - callee < 16 ? id - callee : 16;
+        callee = id - random_below(g, (unsigned) recent + 1);
+    }
+
+    unsigned arguments = g->arguments[callee];
+    if (fn->depth < arguments) {
+        emit_push_pop(g, o, f, fn, GEN_PUSH);
+        return;
+    }
+
+    char line[128];
+    snprintf(line, sizeof(line), "    call G%i.f%llu %u", callee_file,
+        callee, arguments);
+    emit_comment(g, o, f, line);
+    fn->depth = fn->depth - arguments + 1;
+}
+
+// Writes one function of about 'function-size' instructions. Kinds that
+// don't fit the stack as it is emit an instruction that brings it closer
+// instead. Returns 1 if out of memory.
+static int emit_function(Gen_State *g, Gen_Options *o, FILE *f, int file)
+{
+    char line[128];
+    unsigned long long id = g->functions++;
+    if (id >= g->arguments_size) {
+        unsigned long long size = g->arguments_size ? 2 * g->arguments_size
+            : 1024;
+        unsigned char *arguments = realloc(g->arguments, size);
+        if (!arguments)
+            return 1;
+        g->arguments = arguments;
+        g->arguments_size = size;
+    }
+
+    Gen_Function fn = {
+        .arguments = random_below(g, GEN_MAX_ARGUMENTS),
+        .locals = random_below(g, GEN_MAX_LOCALS),
+        .depth = 0,
+        .labels = 0,
+        .declared_count = 0,
+        .pending_count = 0
+    };
+    g->arguments[id] = (unsigned char) fn.arguments;
+    snprintf(line, sizeof(line), "function G%i.f%llu %u", file, id,
+        fn.locals);
+    emit_comment(g, o, f, line);
+
+    unsigned length = o->function_size / 2
+        + random_below(g, o->function_size + 1);
+    for (unsigned k = 0; k < length; k++) {
+        int kind = pick_weighted(g, o->kind_weights, GEN_KIND_COUNT);
+
+        // Statements end with an empty stack, conditions leave one value
+        int settled = kind == GEN_LABEL || kind == GEN_GOTO;
+        if ((settled && fn.depth > 0) || (kind == GEN_IF_GOTO && fn.depth > 1))
+            kind = GEN_POP;
+        else if (kind == GEN_IF_GOTO && fn.depth == 0)
+            kind = GEN_PUSH;
+        if (kind == GEN_PUSH && fn.depth == GEN_MAX_DEPTH)
+            kind = GEN_ARITHMETIC;
+        if ((kind == GEN_POP || kind == GEN_ARITHMETIC) && fn.depth == 0)
+            kind = GEN_PUSH;
+
+        // The label after a goto must be one jumped to already
+        if (kind == GEN_GOTO && fn.pending_count == 0)
+            kind = GEN_LABEL;
+
+        unsigned label;
+        switch (kind) {
+        case GEN_PUSH:
+        case GEN_POP:
+            emit_push_pop(g, o, f, &fn, kind);
+            break;
+        case GEN_ARITHMETIC:
+            emit_arithmetic(g, o, f, &fn);
+            break;
+        case GEN_LABEL:
+            if (fn.pending_count > 0)
+                emit_label(g, o, f, &fn, fn.pending[--fn.pending_count]);
+            else if (fn.labels < GEN_MAX_LABELS)
+                emit_label(g, o, f, &fn, fn.labels++);
+            else
+                emit_push_pop(g, o, f, &fn, GEN_PUSH);
+            break;
+        case GEN_GOTO: {
+            unsigned next = fn.pending[--fn.pending_count];
+            if (pick_target(g, &fn, &label)) {
+                snprintf(line, sizeof(line), "    goto L%u", label);
+                emit_comment(g, o, f, line);
+            }
+            emit_label(g, o, f, &fn, next);
+            break;
+        }
+        case GEN_IF_GOTO:
+            if (pick_target(g, &fn, &label)) {
+                snprintf(line, sizeof(line), "    if-goto L%u", label);
+                emit_comment(g, o, f, line);
+                fn.depth--;
+            } else {
+                emit_arithmetic(g, o, f, &fn);
+            }
+            break;
+        default:
+            emit_call(g, o, f, &fn, id, file);
+            break;
+        }
+    }
+
+    // Labels still to come end statements too
+    while (fn.depth > 0)
+        emit_push_pop(g, o, f, &fn, GEN_POP);
+    while (fn.pending_count > 0)
+        emit_label(g, o, f, &fn, fn.pending[--fn.pending_count]);
+    g->bytes += fprintf(f, "    push constant 0\n    return\n\n");
+    g->instructions += 2;
+    return 0;
+}
+
+static int generate(Gen_Options *o)
+{
+    if (mkdir(o->dir, 0755) != 0 && errno != EEXIST) {
+        printf("Couldn't create directory '%s'\n", o->dir);
+        return 1;
+    }
+
+    Gen_State g = {
+        .rng = o->seed ? o->seed : 1,
+        .bytes = 0,
+        .instructions = 0,
+        .functions = 0,
+        .first_functions = malloc(o->files * sizeof(unsigned long long)),
+        .arguments = NULL,
+        .arguments_size = 0
+    };
+    if (!g.first_functions) {
+        printf("Out of memory\n");
+        return 1;
+    }
+
+    char *buffer = malloc(GEN_WRITE_BUFFER_SIZE);
+    char path[4096];
+    int status = 0;
+    for (int file = 0; file < o->files && status == 0; file++) {
+        snprintf(path, sizeof(path), "%s/G%i.vm", o->dir, file);
+        FILE *f = fopen(path, "w");
+        if (!f) {
+            printf("Couldn't open file '%s' for writing\n", path);
+            status = 1;
+            break;
+        }
+        if (buffer)
+            setvbuf(f, buffer, _IOFBF, GEN_WRITE_BUFFER_SIZE);
+
+        g.first_functions[file] = g.functions;
+
+        // Spread the remainder over the first files
+        unsigned long long end = g.bytes + o->size / o->files
+            + (file < (int) (o->size % o->files));
+        do {
+            if (emit_function(&g, o, f, file) != 0) {
+                printf("Out of memory\n");
+                status = 1;
+                break;
+            }
+        } while (g.bytes < end);
+
+        if (fclose(f) != 0 && status == 0) {
+            printf("Error when writing to '%s'\n", path);
+            status = 1;
+        }
+    }
+    free(buffer);
+    free(g.first_functions);
+    free(g.arguments);
+
+    if (status == 0)
+        printf("%i files, %llu bytes, %llu instructions, %llu functions\n",
+            o->files, g.bytes, g.instructions, g.functions);
+    return status;
+}
+
+int main(int argc, char *argv[])
+{
+    Gen_Options o = {
+        .dir = NULL,
+        .size = 64ULL << 20,
+        .files = 64,
+        .seed = 1,
+        .kind_weights = { 40, 15, 25, 4, 3, 4, 9 },
+        .segment_weights = { 12, 20, 8, 35, 8, 8, 3, 6 },
+        .function_size = 60,
+        .comments = 0.1
+    };
+
+    for (int i = 1; i < argc; i++) {
+        char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        int bad = 0;
+        if (argv[i][0] != '-') {
+            o.dir = argv[i];
+            continue;
+        } else if (!value) {
+            bad = 1;
+        } else if (strcmp(argv[i], "--size") == 0) {
+            o.size = parse_size(value);
+            bad = o.size == 0;
+        } else if (strcmp(argv[i], "--files") == 0) {
+            o.files = atoi(value);
+            bad = o.files < 1;
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            o.seed = strtoull(value, NULL, 10);
+        } else if (strcmp(argv[i], "--mix") == 0) {
+            bad = parse_weights(value, KIND_NAMES, GEN_KIND_COUNT,
+                o.kind_weights);
+        } else if (strcmp(argv[i], "--segments") == 0) {
+            bad = parse_weights(value, SEGMENT_NAMES, GEN_SEGMENT_COUNT,
+                o.segment_weights);
+        } else if (strcmp(argv[i], "--function-size") == 0) {
+            o.function_size = (unsigned) atoi(value);
+            bad = o.function_size < 1;
+        } else if (strcmp(argv[i], "--comments") == 0) {
+            o.comments = atof(value);
+            bad = o.comments < 0 || o.comments > 1;
+        } else {
+            bad = 1;
+        }
+
+        if (bad) {
+            printf("Bad argument '%s'\n", argv[i]);
+            return 1;
+        }
+        i++;
+    }
+
+    if (!o.dir) {
+        printf("Usage: hvm_gen dir [--size 64M] [--files 64] [--seed n] "
+            "[--mix ...] [--segments ...] [--function-size n] "
+            "[--comments share]\n");
+        return 1;
+    }
+
+    // Pops need a segment other than constant, and something must be picked
+    unsigned kinds = 0, pop_segments = 0;
+    for (int k = 0; k < GEN_KIND_COUNT; k++)
+        kinds += o.kind_weights[k];
+    for (int k = 0; k < GEN_SEGMENT_COUNT; k++)
+        pop_segments += k == GEN_CONSTANT ? 0 : o.segment_weights[k];
+    if (kinds == 0 || pop_segments == 0) {
+        printf("Weights leave nothing to generate\n");
+        return 1;
+    }
+
+    return generate(&o);
+}
@@ -0,0 +1,30 @@
+#include <string.h>
+#include "hash.h"
+
+#define HASH_MUL                           0xff51afd7ed558ccdull
+
+static uint64_t mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= HASH_MUL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Hashes 8 bytes per step, the tail is zero padded
+uint64_t hvm_hash_bytes(uint64_t h, void *data, size_t size)
+{
+    char *buf = data;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t w;
+        memcpy(&w, buf + i, 8);
+        h = (h ^ w) * HASH_MUL;
+        h ^= h >> 29;
+    }
+
+    uint64_t tail = 0;
+    memcpy(&tail, buf + i, size - i);
+    h = (h ^ tail ^ size) * HASH_MUL;
+    return mix(h);
+}
@@ -0,0 +1,10 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Continues 64-bit hash 'h' (0 to start) over 'size' bytes of 'buf'
+uint64_t hvm_hash_bytes(uint64_t h, void *buf, size_t size);
+
+#endif // HASH_H
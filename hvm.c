@@ -1,15 +1,81 @@
 /*
  hvm - hack virtual machine
 
- Usage: hvm infile1 [infile2...] [-o outfile]
+ Usage: hvm infile1 [infile2...] [-o outfile] [-j threads] [--cache dir]
+                                   [--incremental] [--watch] [--io-uring]
+                                   [--stats[=json|mem]] [-c]
+                                   [-O0|-O1|-O2|-Os] [-fno-<pass>]
         hvm src/*.vm
         hvm src/{Main,Sys}.vm -o out.asm
+        hvm src
 
  Translates Hack virtual machine instructions into Hack assembly.
  Can take multiple input files and globs.
 
+ A directory given as the only input stands for all .vm files in it, in
+ name order, translated into a single 'dir/Dir.asm' unless -o is given.
+
+ Inputs ending in .vmo are object files made with -c. They translate into
+ the same code as the .vm files they came from, without parsing text.
+
  Options:
      -o outfile      Specify a single output file
+     -c              Write a binary object file 'X.vmo' for each input
+                     'X.vm' instead of assembly. With -o, only one input
+                     may be given.
+     -               As the only input, read VM code from stdin. Output
+                     goes to stdout unless -o is given, and -o - writes to
+                     stdout. Either way the file is streamed through in
+                     constant memory, which skips the passes that look at
+                     whole functions.
+     -j threads      Translate up to this many files at once (default 1).
+                     Files of 4MB or more are instead split across all
+                     threads. Output is identical to a serial run.
+     --cache dir     Reuse translations of unchanged files from 'dir' and
+                     store new ones there.
+     -O0             Translate each instruction on its own (default).
+     -O1             Also run the passes that look at a few instructions
+                     at a time: fold, jumps and stack.
+     -O2             Also run the passes that look at whole functions:
+                     unreachable. Not run on '-', which is translated a
+                     chunk at a time.
+     -Os             Alias for -O2 for now, every pass so far makes code
+                     both smaller and faster.
+     -fno-<pass>     Don't run a pass the -O level turns on. Passes:
+                     fold        fold constants, drop pairs of instructions
+                                 that cancel out
+                     unreachable drop code no path in its function reaches
+                     jumps       drop gotos to the label right after them
+                     stack       turn a push straight into a pop into a
+                                 move, in the generated code
+                     --stats shows the time each pass took and the
+                     instructions it removed and added, VM instructions
+                     for IR passes and Hack instructions for stack.
+     --incremental   With --cache, also cache each function on its own and
+                     only translate functions that changed. Generated
+                     labels are numbered per function instead of per file.
+     --watch         Keep running, retranslating inputs whenever they are
+                     saved and rewriting the affected outputs.
+     --io-uring      Open, read and write files through io_uring, a batch
+                     of files per system call, when the kernel supports it.
+     --stats         Print the time spent loading, parsing, generating code
+                     and writing each file and all of them, bytes in and
+                     out, VM instructions by opcode and segment, Hack
+                     instructions emitted and MB/s of input. Also the I/O
+                     backend and the system calls made for inputs and
+                     outputs.
+     --stats=json    Same, as one JSON object on stderr.
+     --stats=mem     Print the most memory in use at once, allocations and
+                     bytes by subsystem, peak memory per VM instruction and
+                     the process's peak resident size.
+
+ Server:
+     hvm --serve socket
+                     Listen on a Unix socket and translate for clients from
+                     one warm process, keeping recent outputs in memory.
+                     When HVM_SOCKET names a live server's socket, hvm sends
+                     its command line there instead of translating itself,
+                     unless an input or output is '-'.
 
      When no options given, generates a hack asm file for each input file.
 */
@@ -18,1012 +84,1078 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <sys/stat.h>
 #include "file.h"
+#include "text.h"
+#include "pool.h"
+#include "cache.h"
+#include "watch.h"
+#include "timer.h"
+#include "serve.h"
+#include "uring.h"
+#include "stats.h"
+#include "libhvm.h"
 
 #define MIN_ARGC                           2
 #define ERR_TEXT_SIZE                      200
 #define FILE_PATH_SIZE                     200
+#define MAX_THREADS                        1024
+#define PARALLEL_PARSE_MIN_SIZE            (4 * 1024 * 1024)
+#define STDIN_MODULE_NAME                  "Stdin.vm"
+#define PREFETCH_BATCH_SIZE                128
+#define URING_ENTRIES                      (2 * PREFETCH_BATCH_SIZE)
 
-#define INST_ARRAY_INITIAL_CAPACITY        1024
-#define INST_ARRAY_CAPACITY_GROWTH_RATE    1024
-#define GENERATE_HEADER_COMMENTS           1
-#define INITIAL_HACK_CODE_SIZE_PER_INST    8
+#define SERVE_MEMORY_CACHE_SIZE            (256 * 1024 * 1024)
 
-#include "hvm.h"
+typedef struct {
+    int input_file_count;
+    int output_file_count;
+    char **input_files; // input_files[k] is compiled into output_files[k]
+    char **output_files; // if output_file_count == 1, all input_files compile into one
+    int thread_count;
+    char *cache_dir; // NULL if not caching
+    int incremental;
+    int watch;
+    int io_uring;
+    enum STATS_FORMAT stats;
+    int memory_stats; // --stats=mem
+    int compile; // -c, outputs are objects
+    int stream; // Single input or output is "-", see run_stream
+    unsigned passes; // From -O and -fno-<pass>
+    char *input_dir; // Directory the input files were listed from, or NULL
+    char *error;
+} Argparse_Result;
 
-void print_instruction(Instruction *i)
+// Returns 1 if 'path' ends in 'extension'
+int has_extension(char *path, char *extension)
 {
-    switch (i->type) {
-    case INST_ARITHLOGIC:
-        printf("Arithlogic_Instruction { .action=%s }",
-            ARITHLOGIC_ACTION_STRINGS[i->inst.arithlogic.action]);
-        break;
-    case INST_STACK:
-        printf("Stack_Instruction { .action=%s, segment=%s, number=%i }",
-            STACK_ACTION_STRINGS[i->inst.stack.action],
-            SEGMENT_STRINGS[i->inst.stack.segment],
-            i->inst.stack.number);
-        break;
-    case INST_FLOW:
-        printf("Flow_Instruction { .action=%s, .label_name=%s }",
-            FLOW_ACTION_STRINGS[i->inst.flow.action],
-            i->inst.flow.label_name);
-        break;
-    case INST_FUNC:
-        printf("Func_Instruction { .action=%s, .func_name=%s, .number=%i }",
-            FUNC_ACTION_STRINGS[i->inst.func.action],
-            i->inst.func.func_name ? i->inst.func.func_name : "NULL",
-            i->inst.func.number);
-        break;
-    default:
-        printf("print_instruction: Invalid instruction type");
-    }
+    size_t len = strlen(path);
+    size_t ext_len = strlen(extension);
+    return len > ext_len && strcmp(path + len - ext_len, extension) == 0;
 }
 
-int snprintf_instruction_comment(char *str, size_t size, Instruction *i)
+// Parses CLI arguments
+Argparse_Result parse_arguments(int argc, char *argv[])
 {
-    switch (i->type) {
-    case INST_ARITHLOGIC:
-        return snprintf(str, size,
-            "// Arithlogic_Instruction { .action=%s }",
-            ARITHLOGIC_ACTION_STRINGS[i->inst.arithlogic.action]);
-     case INST_STACK:
-        return snprintf(str, size,
-            "// Stack_Instruction { .action=%s, .segment=%s, .number=%i }",
-            STACK_ACTION_STRINGS[i->inst.stack.action],
-            SEGMENT_STRINGS[i->inst.stack.segment],
-            i->inst.stack.number);
-     case INST_FLOW:
-        return snprintf(str, size,
-            "// Flow_Instruction { .action=%s, .label_name='%s' }",
-            FLOW_ACTION_STRINGS[i->inst.flow.action],
-            i->inst.flow.label_name);
-    case INST_FUNC:
-        return snprintf(str, size,
-            "// Func_Instruction { .action=%s, .func_name='%s', .number=%i }",
-            FUNC_ACTION_STRINGS[i->inst.func.action],
-            i->inst.func.func_name ? i->inst.func.func_name : "NULL",
-            i->inst.func.number);
-    default:
-        return snprintf(str, size,
-            "// print_instruction: Invalid instruction type");
+    Argparse_Result r = {
+        .input_file_count = 0,
+        .output_file_count = 0,
+        .input_files = NULL,
+        .output_files = NULL,
+        .thread_count = 1,
+        .cache_dir = NULL,
+        .incremental = 0,
+        .watch = 0,
+        .io_uring = 0,
+        .stats = STATS_NONE,
+        .memory_stats = 0,
+        .compile = 0,
+        .stream = 0,
+        .passes = 0,
+        .input_dir = NULL,
+        .error = NULL
+    };
+
+    if (argc < MIN_ARGC) {
+        r.error = "Expected input file\n";
+        return r;
     }
-}
 
-// String, but defined by a range in memory (inclusive)
-// Doesn't have to be null-terminated
-typedef struct {
-    char *start; // inclusive
-    char *end; // inclusive
-} Slice;
+    int output_switch = 0;
+    int thread_switch = 0;
+    int level = HVM_O0;
+    unsigned disabled_passes = 0;
+    for (int i = 1; i < argc; i++) {
+        // Handle -o switch
+        if (hvm_str_begins_with(argv[i], "-o")) {
+            if (output_switch) {
+                r.error = "Multiple -o switches not allowed\n";
+                return r;
+            }
 
-void print_str_range(char *start, char *end)
-{
-    if (start == NULL)
-        printf("print_str_range: start is null\n");
+            if (argv[i][2] != 0) {
+                r.error = "Unrecognized argument following -o\n";
+                return r;
+            }
 
-    if (end == NULL)
-        printf("print_str_range: end is null\n");
+            // Grab next arg as single output file
+            if (i + 1 >= argc) {
+                r.error = "Expected output file after '-o'\n";
+                return r;
+            }
 
-    if (start == NULL || end == NULL)
-        return;
+            i++;
+            // Add output file
+            r.output_files = hvm_malloc(sizeof(char**), HVM_MEM_OTHER);
+            size_t len = strlen(argv[i]);
+            r.output_files[r.output_file_count++] = strcpy(
+                hvm_malloc((len + 1) * sizeof(char), HVM_MEM_OTHER), argv[i]);
 
-    while (start != end) {
-        putchar(*start);
-        start++;
-    }
+            output_switch = 1;
+            continue;
+        }
 
-    putchar(*end);
-    putchar('\n');
-}
+        // Handle -j switch, as "-j N" or "-jN"
+        if (hvm_str_begins_with(argv[i], "-j")) {
+            char *n = argv[i] + 2;
+            if (*n == '\0') {
+                if (i + 1 >= argc) {
+                    r.error = "Expected thread count after '-j'\n";
+                    return r;
+                }
+                n = argv[++i];
+            }
 
-inline int is_number(char c)
-{
-    return c >= '0' && c <= '9';
-}
+            char *n_end;
+            long thread_count = strtol(n, &n_end, 10);
+            if (*n_end != '\0' || thread_count < 1 || thread_count > MAX_THREADS) {
+                r.error = "Invalid thread count after '-j'\n";
+                return r;
+            }
 
-inline int is_alpha(char c)
-{
-    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
-}
+            r.thread_count = (int) thread_count;
+            thread_switch = 1;
+            continue;
+        }
 
-// Checks if char is allowed to be the first char of a symbol
-int is_valid_symbol_head(char c)
-{
-    return is_alpha(c) || c == '_' || c == '.' || c == '$' || c  == ':';
-}
+        // Handle -O switch. -fno-<pass> wins wherever it is.
+        if (argv[i][0] == '-' && argv[i][1] == 'O') {
+            char *levels[HVM_LEVEL_COUNT] = { "0", "1", "2", "s" };
+            level = -1;
+            for (int k = 0; k < HVM_LEVEL_COUNT; k++)
+                if (strcmp(argv[i] + 2, levels[k]) == 0)
+                    level = k;
+            if (level == -1) {
+                r.error = "Unknown optimization level, expected -O0, -O1, "
+                    "-O2 or -Os\n";
+                return r;
+            }
+            continue;
+        }
 
-// Checks if char is allowed in a symbol as a non-first char
-int is_valid_symbol_tail(char c)
-{
-    return is_valid_symbol_head(c) || is_number(c);
-}
+        // Handle -fno-<pass> switch
+        if (hvm_str_begins_with(argv[i], "-fno-")) {
+            int pass = hvm_find_pass(argv[i] + strlen("-fno-"));
+            if (pass == -1) {
+                r.error = "Unknown pass after '-fno-'\n";
+                return r;
+            }
+            disabled_passes |= HVM_PASS_BIT(pass);
+            continue;
+        }
 
-// Returns a^b
-// 'b' must be non-negative (given the return type of the function)
-int power(int a, int b)
-{
-    if (a == 0)
-        return 0;
+        // Handle --cache switch
+        if (strcmp(argv[i], "--cache") == 0) {
+            if (i + 1 >= argc) {
+                r.error = "Expected directory after '--cache'\n";
+                return r;
+            }
 
-    int ans = 1;
-    while (b-- > 0)
-        ans *= a;
+            hvm_free(r.cache_dir);
+            i++;
+            r.cache_dir = strcpy(hvm_malloc(strlen(argv[i]) + 1, HVM_MEM_OTHER),
+                argv[i]);
+            continue;
+        }
 
-    return ans;
-}
+        // Handle --watch switch
+        if (strcmp(argv[i], "--watch") == 0) {
+            r.watch = 1;
+            continue;
+        }
 
-// Parses and returns first int from 'buf' to 'end' inclusive.
-// NOTE: The given range MUST ONLY contain digits or a leading minus,
-//  otherwise, undefined behavior
-int parse_next_int(char *buf, char *end)
-{
-    int num = 0;
-    int negative = 0;
+        // Handle -c switch
+        if (strcmp(argv[i], "-c") == 0) {
+            r.compile = 1;
+            continue;
+        }
 
-    // Check if negative
-    if (*buf == '-') {
-        negative = 1;
-        buf++;
-    }
+        // Handle --io-uring switch
+        if (strcmp(argv[i], "--io-uring") == 0) {
+            r.io_uring = 1;
+            continue;
+        }
 
-    // Skip leading zeros
-    if (*buf == '0') {
-        while (*(buf + 1) == '0') {
-            buf++;
+        // Handle --stats switch, as "--stats" or "--stats=format"
+        if (hvm_str_begins_with(argv[i], "--stats")) {
+            char *format = argv[i] + strlen("--stats");
+            if (*format == '\0' || strcmp(format, "=text") == 0) {
+                r.stats = STATS_TEXT;
+            } else if (strcmp(format, "=json") == 0) {
+                r.stats = STATS_JSON;
+            } else if (strcmp(format, "=mem") == 0) {
+                r.memory_stats = 1;
+            } else {
+                r.error = "Unknown '--stats' format\n";
+                return r;
+            }
+            continue;
+        }
+
+        // Handle --incremental switch
+        if (strcmp(argv[i], "--incremental") == 0) {
+            r.incremental = 1;
+            continue;
         }
+
+        // Add every .vm file in a directory
+        if (is_dir(argv[i])) {
+            if (r.input_dir || r.input_file_count > 0) {
+                r.error = "A directory must be the only input\n";
+                return r;
+            }
+
+            r.input_files = list_dir(argv[i], ".vm", &r.input_file_count);
+            if (!r.input_files) {
+                r.error = "Couldn't read input directory\n";
+                return r;
+            }
+            if (r.input_file_count == 0) {
+                r.error = "No .vm files in input directory\n";
+                return r;
+            }
+
+            r.input_dir = strcpy(hvm_malloc(strlen(argv[i]) + 1, HVM_MEM_OTHER),
+                argv[i]);
+            continue;
+        }
+
+        if (r.input_dir) {
+            r.error = "A directory must be the only input\n";
+            return r;
+        }
+
+        // Add input file
+        r.input_files = hvm_realloc(r.input_files,
+            sizeof(char**) * (++r.input_file_count), HVM_MEM_OTHER);
+        size_t len = strlen(argv[i]);
+        r.input_files[r.input_file_count-1] = strcpy(
+            hvm_malloc((len + 1) * sizeof(char), HVM_MEM_OTHER), argv[i]);
     }
+    r.passes = hvm_level_passes(level) & ~disabled_passes;
 
-    // Build num up backwards
-    char *p = end;
-    size_t rpos = 0; // Position of current digit from right
-    while (p >= buf) {
-        int n = *p - '0';
-        num += n * power(10, rpos);
-        p--;
-        rpos++;
+    if (r.input_file_count == 0) {
+        r.error = "No input file given\n";
+        return r;
     }
 
-    if (negative)
-        return -num;
+    if (r.incremental && !r.cache_dir) {
+        r.error = "'--incremental' needs '--cache'\n";
+        return r;
+    }
 
-    return num;
-}
+    // "-" is stdin, which can only be streamed on its own
+    for (int i = 0; i < r.input_file_count; i++) {
+        if (strcmp(r.input_files[i], "-") == 0 && r.input_file_count > 1) {
+            r.error = "'-' must be the only input file\n";
+            return r;
+        }
+    }
 
-// Return pointer to first occurrence of 'pat' in 'str'
-// Checks from 'str' to 'end' inclusive
-// Return NULL if not found
-char *strstr_range(char *str, char *end, char *pat)
-{
-    char *pat_start = pat;
-    while (*str && (str <= end)) {
-        while (*str++ == *pat++) {
-            if (*pat == '\0') {
-                // Pattern end reached
-                size_t pat_len = pat - pat_start;
-                return str - pat_len;
-            }
+    // Stdin goes to stdout unless told otherwise
+    if (!output_switch && strcmp(r.input_files[0], "-") == 0) {
+        r.output_files = hvm_malloc(sizeof(char**), HVM_MEM_OTHER);
+        r.output_files[r.output_file_count++] = strcpy(hvm_malloc(2, HVM_MEM_OTHER), "-");
+        output_switch = 1;
+    }
+
+    for (int i = 0; i < r.input_file_count && r.compile; i++) {
+        if (has_extension(r.input_files[i], ".vmo")) {
+            r.error = "'-c' takes .vm files, not objects\n";
+            return r;
         }
-        pat = pat_start; // Reset pat
     }
 
-    return NULL;
-}
+    if (r.compile && r.cache_dir) {
+        r.error = "'-c' can't be used with '--cache'\n";
+        return r;
+    }
 
-// Find next occurence of any char from 'chars' or '\0' in 'str' and
-// return pointer to it.
-// Both 'chars' and 'str' must be null-terminated, so it doesn't halt
-char *find_next_any(char *str, char *chars)
-{
-    char *chars_start = chars;
-    for (; *str != '\0'; str++) {
-        for (; *chars != '\0'; chars++) {
-            if (*str == *chars)
-                return str;
+    if (r.compile && output_switch && r.input_file_count > 1) {
+        r.error = "'-c' with '-o' takes a single input file\n";
+        return r;
+    }
+
+    // A directory compiles into one file named after it, inside it
+    if (!output_switch && r.input_dir && !r.compile) {
+        char *name = dir_name(r.input_dir);
+        if (!name || *name == '\0') {
+            hvm_free(name);
+            r.error = "Couldn't name output for input directory\n";
+            return r;
         }
-        chars = chars_start;
+
+        size_t dir_len = strlen(r.input_dir);
+        while (dir_len > 1 && r.input_dir[dir_len - 1] == '/')
+            dir_len--;
+        size_t len = dir_len + 1 + strlen(name) + strlen(".asm");
+        char *path = hvm_malloc(len + 1, HVM_MEM_OTHER);
+        snprintf(path, len + 1, "%.*s/%s.asm", (int) dir_len, r.input_dir, name);
+        hvm_free(name);
+
+        r.output_files = hvm_malloc(sizeof(char**), HVM_MEM_OTHER);
+        r.output_files[r.output_file_count++] = path;
+        output_switch = 1;
     }
 
-    return str;
-}
+    r.stream = r.input_file_count == 1 && output_switch
+        && (strcmp(r.input_files[0], "-") == 0
+            || strcmp(r.output_files[0], "-") == 0);
 
-// Find next index of any char from 'c' or '\0' after 'str[i]'
-// Return last index (length - 1) if not found
-// Both 'c' and 'str' must be null-terminated, so it doesn't halt
-inline size_t find_next_any_index(char *str, size_t i, char *c)
-{
-    return find_next_any(str + i, c) - str;
-}
+    if (r.stream && (r.compile || has_extension(r.input_files[0], ".vmo"))) {
+        r.error = "'-' can't be used with object files\n";
+        return r;
+    }
 
-// Return 1 if str begins with pat (only stopping when pat reaches '\0')
-// Return 0 otherwise, or if str ends before pat
-int str_begins_with(char *str, char *pat)
-{
-    while (*pat != '\0') {
-        if (*str != *pat)
-            return 0;
-        pat++;
-        if (*pat == '\0')
-            return 1;
-        str++;
+    if (r.stream && r.watch) {
+        r.error = "'--watch' can't be used with '-'\n";
+        return r;
     }
-    return 1;
-}
 
-// Return index of first occurrence of t in s
-// Return -1 if t not found in s
-int strindex(char *s, char *t)
-{
-    char *s_start = s;
-    char *t_start = t;
-    while (*s) {
-        while (*s++ == *t++) {
-            if (*t == 0) // Return index
-                return s - s_start - (t - t_start);
-        }
-        t = t_start; // Reset t
+    // A stream is one input translated serially as it's read
+    if (r.stream && (r.cache_dir || r.incremental || thread_switch
+        || r.io_uring)) {
+        r.error = "'--cache', '--incremental', '-j' and '--io-uring' can't "
+            "be used with '-'\n";
+        return r;
     }
-    return -1;
-}
 
-// Return index of last occurrence of t in s
-// Return -1 if t not found in s
-int strindex_last(char *s, char *t)
-{
-    size_t s_len = strlen(s);
-    size_t t_len = strlen(t);
-
-    char *s_start = s;
-    char *s_end = s + s_len - 1;
-    s = s_end;
-    char *t_start = t;
-    char *t_end = t + t_len - 1;
-    t = t_end;
-
-    while (s != s_start) {
-        while (*s-- == *t--) {
-            if ((t == t_start && *s == *t) || t_end == t_start) // Return index
-                return s - s_start + ((t_end == t_start) ? 1 : 0);
+    // Output switch not given, we have as many output files as input files
+    char *output_extension = r.compile ? ".vmo" : ".asm";
+    if (!output_switch) {
+        // Copy input files to output files, replacing extensions
+        r.output_file_count = r.input_file_count;
+        r.output_files = hvm_realloc(r.output_files,
+            sizeof(char**) * r.output_file_count, HVM_MEM_OTHER);
+        for (int i = 0; i < r.input_file_count; i++) {
+            // Copy string
+            size_t in_len = strlen(r.input_files[i]);
+            size_t len = in_len + strlen(output_extension);
+            r.output_files[i] = strcpy(hvm_malloc((len + 1) * sizeof(char),
+                HVM_MEM_OTHER), r.input_files[i]);
+
+            // Replace extension, or add one if the input has neither
+            if (has_extension(r.output_files[i], ".vm"))
+                r.output_files[i][in_len - strlen(".vm")] = '\0';
+            else if (has_extension(r.output_files[i], ".vmo"))
+                r.output_files[i][in_len - strlen(".vmo")] = '\0';
+            strcat(r.output_files[i], output_extension);
         }
-        t = t_end; // Reset t
     }
-    return -1;
+
+    return r;
 }
 
-// Replaces last occurrence of sub in str with rep
-// Returns 0 on success
-// Returns 1 on failure
-// str must be large enough to fit rep
-int str_replace_last(char *str, char *sub, char *rep)
+void free_arguments(Argparse_Result *r)
 {
-    int index = strindex_last(str, sub);
-    if (index == -1) {
-        return 1;
-    }
+    for (int i = 0; i < r->input_file_count; i++)
+        hvm_free(r->input_files[i]);
+    for (int i = 0; i < r->output_file_count; i++)
+        hvm_free(r->output_files[i]);
+    hvm_free(r->input_files);
+    hvm_free(r->output_files);
+    hvm_free(r->cache_dir);
+    hvm_free(r->input_dir);
+}
 
-    while (*rep)
-        str[index++] = *rep++;
+// Fragment cache backed by a --cache directory
+char *dir_fragment_lookup(void *arg, uint64_t key, size_t *size)
+{
+    return cache_lookup(arg, key, size);
+}
 
-    return 0;
+void dir_fragment_store(void *arg, uint64_t key, char *buf, size_t size)
+{
+    cache_store(arg, key, buf, size);
 }
 
-// Returned by parse_*_instruction_* functions
+// Translation of one input file, run by the pool
 typedef struct {
-    size_t token_length;
-    char *error;
-} Parse_Result;
-
-// Expects first token to already be parsed into i.
-// Parses the rest of the instruction and returns its length.
-Parse_Result parse_stack_instruction_tail(char *str, Instruction *i)
+    char *path;
+    char *basename;
+    Hvm_Options options;
+    int compile; // Output an object instead of assembly
+    int object; // Input is an object
+    int large; // Translated on its own after the other files
+    int skip; // Left as it is by translate_jobs
+    char *cache_dir; // NULL if not caching
+    Memory_Cache *memory; // NULL if not serving
+    Hvm_Fragment_Cache fragment_cache; // Used with --incremental
+    int preloaded; // 'file' was already loaded by the io_uring backend
+    Loaded_File file;
+    int cache_hit;
+    int load_failed;
+    File_Stats stats; // Filled in if options.stats points into it
+    Hvm_Result tr;
+} Input_Job;
+
+void translate_input(void *arg, size_t index)
 {
-    size_t len = 0;
-
-    // Skip whitespace
-    while (str[len] == ' ' || str[len] == '\t')
-        len++;
-
-    int segment_found = 0;
-    for (size_t k = 0; k < sizeof(SEGMENT_STRINGS) / sizeof(char*); k++) {
-        if (str_begins_with(str + len, SEGMENT_STRINGS[k])) {
-            segment_found = 1;
-            i->inst.stack.segment = k;
-            len += strlen(SEGMENT_STRINGS[k]);
-            break;
-        }
+    Input_Job *job = (Input_Job*) arg + index;
+    if (job->skip || (job->large && job->options.thread_count <= 1))
+        return;
+
+    double start = job->options.stats ? hvm_now_ms() : 0;
+    Loaded_File f = job->preloaded ? job->file : load_file(job->path);
+    job->preloaded = 0;
+    if (!f.buf) {
+        job->load_failed = 1;
+        return;
+    }
+    if (job->options.stats) {
+        job->stats.load_ms += hvm_now_ms() - start;
+        job->stats.bytes_in = f.size;
     }
 
-    if (!segment_found) {
-        return (Parse_Result) {
-            .token_length = len,
-            .error = "Expected segment in stack instruction\n"
-        };
+    uint64_t key = 0;
+    if (job->cache_dir || job->memory) {
+        key = cache_key(f.buf, f.size, job->basename, hvm_options_key(&job->options));
+
+        // A server keeps recent outputs in memory, in front of the disk
+        size_t size;
+        char *cached = job->memory ? memory_cache_lookup(job->memory, key, &size)
+            : NULL;
+        if (!cached && job->cache_dir) {
+            cached = cache_lookup(job->cache_dir, key, &size);
+            if (cached && job->memory)
+                memory_cache_store(job->memory, key, cached, size);
+        }
+
+        if (cached) {
+            unload_file(&f);
+            job->cache_hit = 1;
+            job->stats.cached = 1;
+            job->stats.bytes_out = size;
+            job->tr.output = cached;
+            job->tr.output_size = size;
+            return;
+        }
     }
 
-    // Skip whitespace
-    while (str[len] == ' ' || str[len] == '\t')
-        len++;
+    // Parse straight from the loaded (usually mapped) bytes, which always
+    // end in a '\0'
+    job->options.terminated_input = 1;
+    if (job->compile)
+        job->tr = hvm_compile_object(f.buf, f.size, &job->options);
+    else if (job->object)
+        job->tr = hvm_translate_object(f.buf, f.size, job->basename,
+            &job->options);
+    else
+        job->tr = hvm_translate(f.buf, f.size, job->basename, &job->options);
+    unload_file(&f);
+    job->stats.bytes_out = job->tr.output_size;
+
+    // A failed store only costs a miss next time
+    if (job->tr.error)
+        return;
+    if (job->cache_dir)
+        cache_store(job->cache_dir, key, job->tr.output, job->tr.output_size);
+    if (job->memory)
+        memory_cache_store(job->memory, key, job->tr.output,
+            job->tr.output_size);
+}
 
-    // Parse number
-    if (is_number(str[len])) {
-        // Find end of number token
-        char *num_end = str + len + 1;
-        while (is_number(*num_end))
-            num_end++;
-        num_end--; // Stand on last digit of number
+// Starts reading the inputs of jobs [from, to) in the background
+void prefetch_inputs(Input_Job *jobs, int from, int to)
+{
+    for (int i = from; i < to; i++)
+        if (!jobs[i].skip)
+            prefetch_file(jobs[i].path);
+}
 
-        // Parse the number and add to instruction
-        i->inst.stack.number = parse_next_int(str + len, num_end);
+// Lists the inputs of jobs [from, to) for the io_uring backend to load.
+// Large files are left to load_file, which maps them. Returns how many.
+int collect_loads(Input_Job *jobs, int from, int to, Uring_Load *loads)
+{
+    int count = 0;
+    for (int i = from; i < to; i++) {
+        if (jobs[i].skip || jobs[i].large)
+            continue;
+        loads[count].path = jobs[i].path;
+        loads[count].tag = i;
+        count++;
+    }
+    return count;
+}
 
-        size_t num_len = (num_end + 1) - (str + len);
-        len += num_len;
-    } else {
-        return (Parse_Result) {
-            .token_length = len,
-            .error = "Expected number in stack instruction\n"
+// Hands loaded files to their jobs. Files that failed to load are loaded
+// again by translate_input, which reports why. The 'ms' the batch took is
+// shared evenly between its files.
+void take_loads(Input_Job *jobs, Uring_Load *loads, int count, double ms)
+{
+    for (int i = 0; i < count; i++) {
+        if (!loads[i].buf)
+            continue;
+        Input_Job *job = jobs + loads[i].tag;
+        job->stats.load_ms += ms / count;
+        job->preloaded = 1;
+        job->file = (Loaded_File) {
+            .buf = loads[i].buf,
+            .size = loads[i].size,
+            .map_size = 0
         };
     }
-
-    return (Parse_Result) { .token_length = len, .error = NULL };
 }
 
-// Parses label name, returns its length or error
-Parse_Result parse_label_name(char *str)
+// Translates every job not marked 'skip'. Small files run on the pool one
+// per thread, in batches so the next batch is read from disk while the
+// current one translates. Large ones run after that with all threads each.
+// With 'ring', each batch is loaded through it, otherwise by every job
+// for itself after a prefetch hint.
+void translate_jobs(Input_Job *jobs, int count, int thread_count, Uring *ring)
 {
-    // Return error if invalid char found
-    if (!is_valid_symbol_head(*str)) {
-        return (Parse_Result) {
-            .token_length = 0,
-            .error = "Expected label name, got invalid character\n"
-        };
+    Uring_Load *loads[2] = { NULL, NULL };
+    int load_count = 0;
+    if (ring) {
+        loads[0] = hvm_malloc(PREFETCH_BATCH_SIZE * sizeof(Uring_Load),
+            HVM_MEM_OTHER);
+        loads[1] = hvm_malloc(PREFETCH_BATCH_SIZE * sizeof(Uring_Load),
+            HVM_MEM_OTHER);
+        load_count = collect_loads(jobs, 0,
+            count < PREFETCH_BATCH_SIZE ? count : PREFETCH_BATCH_SIZE, loads[0]);
+        uring_load_start(ring, loads[0], load_count);
+    } else if (count > PREFETCH_BATCH_SIZE) {
+        prefetch_inputs(jobs, 0, PREFETCH_BATCH_SIZE);
     }
 
-    // Find end of label name
-    char *label_name_end = str + 1;
-    while (is_valid_symbol_tail(*label_name_end)) {
-        label_name_end++;
+    for (int from = 0, k = 0; from < count; from += PREFETCH_BATCH_SIZE, k ^= 1) {
+        int to = from + PREFETCH_BATCH_SIZE < count ? from + PREFETCH_BATCH_SIZE
+            : count;
+        int next_to = to + PREFETCH_BATCH_SIZE < count ? to + PREFETCH_BATCH_SIZE
+            : count;
+        if (ring) {
+            double start = hvm_now_ms();
+            uring_load_finish(ring, loads[k], load_count);
+            take_loads(jobs, loads[k], load_count, hvm_now_ms() - start);
+            load_count = collect_loads(jobs, to, next_to, loads[k ^ 1]);
+            uring_load_start(ring, loads[k ^ 1], load_count);
+        } else {
+            prefetch_inputs(jobs, to, next_to);
+        }
+        hvm_pool_run(thread_count, to - from, translate_input, jobs + from);
     }
 
-    return (Parse_Result) { .token_length = label_name_end - str, .error = NULL };
+    hvm_free(loads[0]);
+    hvm_free(loads[1]);
+
+    for (int i = 0; i < count; i++) {
+        if (jobs[i].large && !jobs[i].skip) {
+            jobs[i].options.thread_count = thread_count;
+            translate_input(jobs, i);
+            jobs[i].options.thread_count = 1;
+        }
+    }
 }
 
-// Expects first token to already be parsed into i.
-// Parses the rest of the instruction and returns its length.
-Parse_Result parse_flow_instruction_tail(char *str, Instruction *i)
+// Prints load and parse errors, returns the number of failed jobs
+int report_errors(Input_Job *jobs, int count)
 {
-    size_t len = 0;
-
-    // Skip whitespace
-    while (str[len] == ' ' || str[len] == '\t')
-        len++;
-
-    // Parse label name
-    Parse_Result res = parse_label_name(str + len);
-    if (res.error) {
-        return (Parse_Result) {
-            .token_length = len + res.token_length,
-            .error = res.error
-        };
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        if (jobs[i].skip)
+            continue;
+        if (jobs[i].load_failed) {
+            failed++;
+        } else if (jobs[i].tr.error && jobs[i].tr.error_line == 0) {
+            printf("Error in '%s': %s", jobs[i].path, jobs[i].tr.error);
+            failed++;
+        } else if (jobs[i].tr.error) {
+            printf("Parse error in '%s' on line %zu: %s", jobs[i].path,
+                jobs[i].tr.error_line, jobs[i].tr.error);
+            failed++;
+        }
     }
+    return failed;
+}
 
-    // Copy label name
-    size_t label_len = res.token_length;
-    i->inst.flow.label_name = strncpy(malloc(sizeof(char) * label_len),
-        str + len, label_len);
-
-    len += label_len;
-    return (Parse_Result) { .token_length = len, .error = NULL };
+void report_cache(Argparse_Result *r, Input_Job *jobs)
+{
+    int translated = 0, hits = 0, fragment_hits = 0, fragment_misses = 0;
+    for (int i = 0; i < r->input_file_count; i++) {
+        if (jobs[i].skip)
+            continue;
+        translated++;
+        hits += jobs[i].cache_hit;
+        fragment_hits += jobs[i].tr.fragment_hits;
+        fragment_misses += jobs[i].tr.fragment_misses;
+    }
+    printf("Cache: %i hits, %i misses\n", hits, translated - hits);
+    if (r->incremental)
+        printf("Function cache: %i hits, %i misses\n", fragment_hits,
+            fragment_misses);
 }
 
-// Expects first token to already be parsed into i.
-// Parses the rest of the instruction and returns its length.
-Parse_Result parse_func_instruction_tail(char *str, Instruction *i)
+// Writes the outputs of all jobs not marked 'skip'. A single output file is
+// rewritten whole whenever any job changed. Returns 0 on success.
+int write_outputs(Argparse_Result *r, Input_Job *jobs, Uring *ring)
 {
-    size_t len = 0;
+    if (r->output_file_count == 1) {
+        // Single output file, gather every translation into it in order
+        struct iovec *iov = hvm_malloc(r->input_file_count
+            * sizeof(struct iovec), HVM_MEM_OTHER);
+        for (int i = 0; i < r->input_file_count; i++) {
+            iov[i].iov_base = jobs[i].tr.output;
+            iov[i].iov_len = jobs[i].tr.output_size;
+        }
+
+        // The write's time is shared evenly between the files in it
+        double start = hvm_now_ms();
+        int error = write_file_vec(iov, r->input_file_count, r->output_files[0]);
+        double ms = hvm_now_ms() - start;
+        for (int i = 0; i < r->input_file_count; i++)
+            jobs[i].stats.write_ms += ms / r->input_file_count;
+        hvm_free(iov);
+        if (error) {
+            printf("Error when writing to '%s'\n", r->output_files[0]);
+            return 1;
+        }
+    } else {
+        // Batch the writes, then retry any that failed the usual way so
+        // errors are reported as usual
+        Uring_Write *writes = NULL;
+        if (ring) {
+            writes = hvm_malloc(r->output_file_count * sizeof(Uring_Write),
+                HVM_MEM_OTHER);
+            int count = 0;
+            for (int i = 0; i < r->output_file_count; i++) {
+                if (jobs[i].skip)
+                    continue;
+                writes[count++] = (Uring_Write) {
+                    .path = r->output_files[i],
+                    .buf = jobs[i].tr.output,
+                    .size = jobs[i].tr.output_size
+                };
+            }
 
-    // Skip whitespace
-    while (str[len] == ' ' || str[len] == '\t')
-        len++;
+            // The batch's time is shared evenly between its files
+            double start = hvm_now_ms();
+            uring_write_files(ring, writes, count);
+            double ms = hvm_now_ms() - start;
+            for (int i = 0; i < r->output_file_count; i++)
+                if (!jobs[i].skip)
+                    jobs[i].stats.write_ms += ms / count;
+        }
 
-    if (i->inst.func.action == RETURN) {
-        // Nothing else to parse
-        return (Parse_Result) { .token_length = len, .error = NULL };
+        for (int i = 0, k = 0; i < r->output_file_count; i++) {
+            if (jobs[i].skip)
+                continue;
+            if (writes && !writes[k++].error)
+                continue;
+            double start = hvm_now_ms();
+            int error = write_file(jobs[i].tr.output, r->output_files[i],
+                jobs[i].tr.output_size);
+            jobs[i].stats.write_ms += hvm_now_ms() - start;
+            if (error) {
+                printf("Error when writing to '%s'\n", r->output_files[i]);
+                hvm_free(writes);
+                return 1;
+            }
+        }
+        hvm_free(writes);
     }
 
-    // Parse function name
-    Parse_Result res = parse_label_name(str + len);
-    if (res.error) {
-        return (Parse_Result) {
-            .token_length = len + res.token_length,
-            .error = res.error
-        };
-    }
+    return 0;
+}
+
+// Clears the result of a job before translating it again
+void reset_job(Input_Job *job)
+{
+    hvm_free_result(&job->tr);
+    job->tr.error = NULL;
+    job->tr.error_line = 0;
+    job->tr.fragment_hits = 0;
+    job->tr.fragment_misses = 0;
+    job->cache_hit = 0;
+    job->load_failed = 0;
+}
 
-    // Copy function name
-    size_t func_len = res.token_length;
-    i->inst.func.func_name = strncpy(malloc(sizeof(char) * func_len),
-        str + len, func_len);
+// Retranslates and rewrites the outputs of changed inputs until killed.
+// Outputs of inputs that fail to translate are left alone. Returns 1 if
+// the files can't be watched.
+int watch(Argparse_Result *r, Input_Job *jobs, Uring *ring)
+{
+    Watcher w;
+    if (watcher_init(&w, r->input_files, r->input_file_count) != 0)
+        return 1;
 
-    len += func_len;
+    int *changed = hvm_malloc(r->input_file_count * sizeof(int), HVM_MEM_OTHER);
+    printf("Watching %i files\n", r->input_file_count);
+    fflush(stdout);
 
-    // Skip whitespace
-    while (str[len] == ' ' || str[len] == '\t')
-        len++;
+    int changed_count;
+    while ((changed_count = watcher_wait(&w, changed)) > 0) {
+        double start = hvm_now_ms();
 
-    // Parse number
-    if (is_number(str[len])) {
-        // Find end of number token
-        char *num_end = str + len + 1;
-        while (is_number(*num_end))
-            num_end++;
-        num_end--; // Stand on last digit of number
+        for (int i = 0; i < r->input_file_count; i++) {
+            jobs[i].skip = !changed[i];
+            if (changed[i])
+                reset_job(jobs + i);
+        }
 
-        // Parse the number and add to instruction
-        i->inst.func.number = parse_next_int(str + len, num_end);
+        translate_jobs(jobs, r->input_file_count, r->thread_count, ring);
+        int failed = report_errors(jobs, r->input_file_count);
+        if (r->cache_dir)
+            report_cache(r, jobs);
+
+        // A single output needs every input to be translated
+        int failed_any = 0;
+        for (int i = 0; i < r->input_file_count; i++) {
+            failed_any |= jobs[i].load_failed || jobs[i].tr.error;
+            if (jobs[i].load_failed || jobs[i].tr.error)
+                jobs[i].skip = 1;
+        }
+        if (!(r->output_file_count == 1 && failed_any))
+            write_outputs(r, jobs, ring);
 
-        size_t num_len = (num_end + 1) - (str + len);
-        len += num_len;
-    } else {
-        return (Parse_Result) {
-            .token_length = len,
-            .error = "Expected number in func instruction\n"
-        };
+        printf("Retranslated %i of %i files (%i failed) in %.2f ms\n",
+            changed_count, r->input_file_count, failed, hvm_now_ms() - start);
+        fflush(stdout);
     }
-    
-    return (Parse_Result) { .token_length = len, .error = NULL };    
+
+    printf("Stopped watching files\n");
+    hvm_free(changed);
+    watcher_free(&w);
+    return 1;
 }
 
+// A stream descriptor that keeps count of what went through it, for --stats
 typedef struct {
-    int input_file_count;
-    int output_file_count;
-    char **input_files; // input_files[k] is compiled into output_files[k]
-    char **output_files; // if output_file_count == 1, all input_files compile into one
-    char *error;
-} Argparse_Result;
+    int fd;
+    size_t bytes;
+    long calls;
+    double ms;
+} Counted_Stream;
 
-// Parses CLI arguments
-Argparse_Result parse_arguments(int argc, char *argv[])
+static long read_counted(void *stream, char *buf, size_t size)
 {
-    printf("args are:\n");
-    for (int i = 0; i < argc; i++) {
-        printf("%s\n", argv[i]);
-    }
-    printf("\n");
+    Counted_Stream *s = stream;
+    double start = hvm_now_ms();
+    long n = read_stream(&s->fd, buf, size);
+    s->ms += hvm_now_ms() - start;
+    s->calls++;
+    if (n > 0)
+        s->bytes += (size_t) n;
+    return n;
+}
 
-    Argparse_Result r = {
-        .input_file_count = 0,
-        .output_file_count = 0,
-        .input_files = NULL,
-        .output_files = NULL,
-        .error = NULL
-    };
+static int write_counted(void *stream, char *buf, size_t size)
+{
+    Counted_Stream *s = stream;
+    double start = hvm_now_ms();
+    int failed = write_stream(&s->fd, buf, size);
+    s->ms += hvm_now_ms() - start;
+    s->calls++;
+    if (!failed)
+        s->bytes += size;
+    return failed;
+}
 
-    if (argc < MIN_ARGC) {
-        r.error = "Expected input file\n";
-        return r;
+// Translates the single input to the single output as it's read, in
+// constant memory. "-" stands for stdin or stdout. Messages go to stderr
+// when stdout carries the output. Sets 'instruction_count' to the VM
+// instructions translated.
+int run_stream(Argparse_Result *r, size_t *instruction_count)
+{
+    char *in_path = r->input_files[0];
+    char *out_path = r->output_files[0];
+    int to_stdout = strcmp(out_path, "-") == 0;
+    FILE *log = to_stdout ? stderr : stdout;
+
+    char *module = STDIN_MODULE_NAME;
+    if (strcmp(in_path, "-") != 0) {
+        char *last_slash = strrchr(in_path, '/');
+        module = last_slash ? last_slash + 1 : in_path;
     }
 
-    int output_switch = 0;
-    for (int i = 1; i < argc; i++) {
-        // Handle -o switch
-        if (str_begins_with(argv[i], "-o")) {
-            if (output_switch) {
-                r.error = "Multiple -o switches not allowed\n";
-                return r;
-            }
-
-            if (argv[i][2] != 0) {
-                r.error = "Unrecognized argument following -o\n";
-                return r;
-            }
-
-            // Grab next arg as single output file
-            if (i + 1 >= argc) {
-                r.error = "Expected output file after '-o'\n";
-                return r;
-            }
-
-            i++;
-            // Add output file
-            r.output_files = malloc(sizeof(char**));
-            size_t len = strlen(argv[i]);
-            r.output_files[r.output_file_count++] = strcpy(malloc(len * sizeof(char)), argv[i]);
-
-            output_switch = 1;
-            continue;
-        }
+    // Chunks never hold a whole function for these to look at
+    for (int k = 0; k < HVM_PASS_COUNT; k++)
+        if ((r->passes & HVM_PASS_BIT(k)) && hvm_pass_needs_functions(k))
+            fprintf(stderr, "Warning: '%s' is skipped on '-', it needs "
+                "whole functions\n", hvm_pass_name(k));
 
-        // Add input file
-        r.input_files = realloc(r.input_files, sizeof(char**) * (++r.input_file_count));
-        size_t len = strlen(argv[i]);
-        r.input_files[r.input_file_count-1] = strcpy(malloc(len * sizeof(char)), argv[i]);
+    int in = open_stream(in_path, 0);
+    if (in == -1) {
+        fprintf(log, "Couldn't open %s\n", in_path);
+        return 1;
     }
-
-    if (r.input_file_count == 0) {
-        r.error = "No input file given\n";
-        return r;
+    int out = open_stream(out_path, 1);
+    if (out == -1) {
+        fprintf(log, "Couldn't open file '%s' for writing\n", out_path);
+        close_stream(in);
+        return 1;
     }
 
-    // Output switch not given, we have as many output files as input files
-    if (!output_switch) {
-        // Copy input files to output files, replacing extensions
-        r.output_file_count = r.input_file_count;
-        r.output_files = realloc(r.output_files, sizeof(char**) * r.output_file_count);
-        for (int i = 0; i < r.input_file_count; i++) {
-            // Copy string
-            size_t in_len = strlen(r.input_files[i]);
-            size_t len = in_len - strlen(".vm") + strlen(".asm");
-            if (len < in_len) len = in_len; // Make it's big enough to fit
-            r.output_files[i] = strcpy(malloc(len * sizeof(char)), r.input_files[i]);
-
-            // Replace extension
-            int err = str_replace_last(r.output_files[i], ".vm", ".asm");
-            if (err != 0) {
-                // Input file doesn't end with ".vm"
-                strcat(r.output_files[i], ".asm");
-            }
-        }
+    Hvm_Result tr;
+    File_Stats stats;
+    Counted_Stream counted_in = {in, 0, 0, 0}, counted_out = {out, 0, 0, 0};
+    double start = hvm_now_ms();
+    if (r->stats) {
+        memset(&stats, 0, sizeof(stats));
+        Hvm_Options options = HVM_OPTIONS_DEFAULT;
+        options.stats = &stats.translation;
+        options.passes = r->passes;
+        tr = hvm_translate_stream(read_counted, &counted_in, module, &options,
+            write_counted, &counted_out);
+    } else {
+        Hvm_Options options = HVM_OPTIONS_DEFAULT;
+        options.passes = r->passes;
+        tr = hvm_translate_stream(read_stream, &in, module, &options,
+            write_stream, &out);
     }
+    *instruction_count = tr.instruction_count;
 
-    return r;
-}
+    int status = 0;
+    if (tr.error) {
+        fprintf(log, "Parse error in '%s' on line %zu: %s", in_path,
+            tr.error_line, tr.error);
+        status = 1;
+    }
 
-typedef struct {
-    size_t instruction_count;
-    char *output_buf;
-    size_t output_buf_size;
-} Trans_Result;
+    close_stream(in);
+    if (close_stream(out) != 0 && status == 0) {
+        fprintf(log, "Error when writing to '%s'\n", out_path);
+        status = 1;
+    }
 
-Trans_Result translate(char *input_buf)
-{
-    return (Trans_Result) { .instruction_count = 0 };
+    // Reads happen between chunks, but writes happen during codegen
+    if (r->stats && status == 0) {
+        stats.path = in_path;
+        stats.load_ms = counted_in.ms;
+        stats.write_ms = counted_out.ms;
+        stats.bytes_in = counted_in.bytes;
+        stats.bytes_out = counted_out.bytes;
+        stats.translation.codegen_ms -= counted_out.ms;
+        Run_Stats run = {
+            .wall_ms = hvm_now_ms() - start,
+            .write_ms = counted_out.ms,
+            .io_backend = "stream",
+            .syscalls = counted_in.calls + counted_out.calls
+        };
+        if (r->stats == STATS_JSON)
+            print_stats_json(stderr, &stats, 1, &run);
+        else
+            print_stats_text(log, &stats, 1, &run);
+    }
+    return status;
 }
 
-int main(int argc, char* argv[])
+// Runs the command line. 'memory' keeps outputs between runs of a server,
+// or is NULL.
+int run(int argc, char* argv[], Memory_Cache *memory)
 {
+    long syscalls_start = io_syscall_count();
+    hvm_reset_memory_stats();
     Argparse_Result r = parse_arguments(argc, argv);
+
     if (r.error) {
         printf("Error parsing arguments: %s", r.error);
+        free_arguments(&r);
         return 1;
     }
 
-    printf("input_files: (%i)\n", r.input_file_count);
-    for (int i = 0; i < r.input_file_count; i++)
-        printf("\t%s\n", r.input_files[i]);
+    if (r.stream) {
+        size_t instruction_count = 0;
+        int status = run_stream(&r, &instruction_count);
+        int memory_stats = r.memory_stats;
+        FILE *log = strcmp(r.output_files[0], "-") == 0 ? stderr : stdout;
+        free_arguments(&r);
+        if (memory_stats)
+            print_memory_stats(log, instruction_count);
+        return status;
+    }
+
+    if (memory && r.watch) {
+        printf("Error parsing arguments: '--watch' can't be used through a server\n");
+        free_arguments(&r);
+        return 1;
+    }
 
-    printf("output_files: (%i)\n", r.output_file_count);
-    for (int i = 0; i < r.output_file_count; i++)
-        printf("\t%s\n", r.output_files[i]);
+    if (r.cache_dir && cache_open(r.cache_dir) != 0) {
+        free_arguments(&r);
+        return 1;
+    }
 
     // Determine input file basenames TODO move into translate func
-    char **input_file_basenames = malloc(sizeof(char**) * r.input_file_count);
+    char **input_file_basenames = hvm_malloc(sizeof(char**)
+        * r.input_file_count, HVM_MEM_OTHER);
     for (int k = 0; k < r.input_file_count; k++) {
-        int last_slash_i = strindex_last(r.input_files[k], "/");
-        int basename_len = strlen(r.input_files[k] - last_slash_i);
-        input_file_basenames[k] = malloc(basename_len * sizeof(char));
-
-        // Copy from last_slash_i + 1 to the end
-        for (int i = 0, j = last_slash_i + 1; r.input_files[k][j-1] != '\0'; i++, j++)
-            input_file_basenames[k][i] = r.input_files[k][j];
+        char *last_slash = strrchr(r.input_files[k], '/');
+        char *basename = last_slash ? last_slash + 1 : r.input_files[k];
+        input_file_basenames[k] = strcpy(hvm_malloc((strlen(basename) + 1)
+            * sizeof(char), HVM_MEM_OTHER), basename);
+
+        // An object translates under the name of the file it came from
+        if (has_extension(basename, ".vmo"))
+            input_file_basenames[k][strlen(basename) - 1] = '\0';
     }
 
-    // Translate all files
-    size_t *input_buf_sizes = malloc(r.input_file_count * sizeof(size_t));
-    char **input_bufs = malloc(r.input_file_count * sizeof(char**));
-    char **output_bufs = malloc(r.output_file_count * sizeof(char**));
-    Trans_Result *trs = malloc(r.input_file_count * sizeof(Trans_Result));
+    // Translate all files. Each one is independent, results are kept in
+    // input order so output doesn't depend on the thread count.
+    Input_Job *jobs = hvm_calloc(r.input_file_count, sizeof(Input_Job),
+        HVM_MEM_OTHER);
     for (int i = 0; i < r.input_file_count; i++) {
-        input_bufs[i] = load_file(r.input_files[i], &input_buf_sizes[i]);
-        trs[i] = translate(input_bufs[i]);
-    }
-
-    // Concatenate into one file if single output file
-    if (r.output_file_count == 1) {
-        // Get total output size
-        size_t output_buf_size = 0;
-        for (int i = 0; i < r.input_file_count; i++) {
-            output_buf_size += (trs[i].output_buf_size - 1); // Exclude nullterms
-        }
-        output_buf_size += 1; // nullterm
-
-        // Concatenate them all
-        output_bufs[0] = malloc(output_buf_size * sizeof(char*));
-        size_t curr_len = 0;
-        for (int i = 0; i < r.input_file_count; i++) {
-            strcat(output_bufs[0] + curr_len, trs[i].output_buf);
-            curr_len += output_buf_size - 1; // Overwrite nullterm
+        jobs[i].path = r.input_files[i];
+        jobs[i].basename = input_file_basenames[i];
+        jobs[i].options = HVM_OPTIONS_DEFAULT;
+        jobs[i].options.passes = r.passes;
+        jobs[i].compile = r.compile;
+        jobs[i].stats.path = r.input_files[i];
+        if (r.stats)
+            jobs[i].options.stats = &jobs[i].stats.translation;
+        jobs[i].object = has_extension(r.input_files[i], ".vmo");
+        jobs[i].cache_dir = r.cache_dir;
+        jobs[i].memory = r.compile ? NULL : memory; // Keyed by assembly output
+        if (r.incremental) {
+            jobs[i].fragment_cache = (Hvm_Fragment_Cache) {
+                .lookup = dir_fragment_lookup,
+                .store = dir_fragment_store,
+                .arg = r.cache_dir
+            };
+            jobs[i].options.fragment_cache = &jobs[i].fragment_cache;
         }
 
-        // Update size inside translate result object
-        trs[0].output_buf_size = output_buf_size;
+        // Large files are split across all threads instead of taking one
+        struct stat st;
+        if (r.thread_count > 1)
+            io_count_syscalls(1);
+        jobs[i].large = r.thread_count > 1 && stat(jobs[i].path, &st) == 0
+            && st.st_size >= PARALLEL_PARSE_MIN_SIZE;
     }
 
-    // Write out all files
-    for (int i = 0; i < r.output_file_count; i++) {
-        int error = write_file(output_bufs[i], r.output_files[i], trs[i].output_buf_size - 1);
-        if (error) {
-            printf("Error when writing to '%s'\n", r.output_files[i]);
-            return 1;
-        }
+    Uring ring;
+    Uring *ring_used = NULL;
+    if (r.io_uring) {
+        if (uring_init(&ring, URING_ENTRIES) == 0)
+            ring_used = &ring;
+        else
+            printf("io_uring unavailable, using plain file I/O\n");
     }
 
-    // Free memory TODO lmao
-
-    return 0;
-}
+    double translate_start = hvm_now_ms();
+    translate_jobs(jobs, r.input_file_count, r.thread_count, ring_used);
+    double translate_ms = hvm_now_ms() - translate_start;
 
-/*    size_t instructions_capacity = INST_ARRAY_INITIAL_CAPACITY;
-    Instruction *instructions = malloc(sizeof(Instruction) *
-        instructions_capacity);
-
-    // Completely read file into a buffer
-    size_t input_file_size;
-    char *input_buf = load_file(input_file_path, &input_file_size);
-
-    // Parse all instructions into instructions array
-    size_t inst_count = 0;
-    size_t src_line_count = 1; // for pointing out errors
-    for (size_t i = 0; input_buf[i] != '\0';) {
-        // Skip whitespace
-        switch (input_buf[i]) {
-        case ' ':
-        case '\t':
-        case '\r':
-            i++;
-            continue;
-        case '\n':
-            i++;
-            src_line_count++;
-            continue;
-        }
+    int status = 0;
+    if (report_errors(jobs, r.input_file_count) && !r.watch)
+        status = 1;
 
-        // Handle line starting with comment
-        if (input_buf[i] == '/' && input_buf[i+1] == '/') {
-            // Skip rest of line
-            i = find_next_any_index(input_buf, i, "\r\n") + 1;
-            continue;
-        }
-*/
-        /* Parse one of the following to determine instruction type:
-            add/sub/neg/eq/gt/lt/and/or/not - arithlogic
-            push/pop - stack
-            label/goto/if-goto - flow
-            function/call/return - func */
-
-/*        Parse_Result res = { .token_length = 0, .error = NULL };
-
-        // Arithlogic instruction
-        for (size_t k = 0; k < sizeof(ARITHLOGIC_ACTION_STRINGS) / sizeof(char*); k++) {
-            if (str_begins_with(input_buf + i, ARITHLOGIC_ACTION_STRINGS[k])) {
-                i += strlen(ARITHLOGIC_ACTION_STRINGS[k]);
-                instructions[inst_count].type = INST_ARITHLOGIC;
-                instructions[inst_count].inst.arithlogic.action = k;
-                // Arithlogic instruction only has one token, which we parsed above
-                res.token_length = 0;
-                res.error = NULL;
-                goto instruction_parsed;
-            }
-        }
+    if (status == 0 && r.cache_dir)
+        report_cache(&r, jobs);
 
-        // Stack instruction (pop/push)
-        for (size_t k = 0; k < sizeof(STACK_ACTION_STRINGS) / sizeof(char*); k++) {
-            if (str_begins_with(input_buf + i, STACK_ACTION_STRINGS[k])) {
-                i += strlen(STACK_ACTION_STRINGS[k]);
-                instructions[inst_count].type = INST_STACK;
-                instructions[inst_count].inst.stack.action = k;
-                res = parse_stack_instruction_tail(input_buf + i, instructions + inst_count);
-                goto instruction_parsed;
-            }
-        }
-
-        // Flow instruction
-        for (size_t k = 0; k < sizeof(FLOW_ACTION_STRINGS) / sizeof(char*); k++) {
-            if (str_begins_with(input_buf + i, FLOW_ACTION_STRINGS[k])) {
-                i += strlen(FLOW_ACTION_STRINGS[k]);
-                instructions[inst_count].type = INST_FLOW;
-                instructions[inst_count].inst.flow.action = k;
-                res = parse_flow_instruction_tail(input_buf + i, instructions + inst_count);
-                goto instruction_parsed;
-            }
-        }
+    // Write out all files
+    double write_start = hvm_now_ms();
+    if (status == 0 && !r.watch && write_outputs(&r, jobs, ring_used) != 0)
+        status = 1;
+    double write_ms = hvm_now_ms() - write_start;
+
+    if (r.stats && !r.watch) {
+        File_Stats *files = hvm_malloc(r.input_file_count
+            * sizeof(File_Stats), HVM_MEM_OTHER);
+        for (int i = 0; i < r.input_file_count; i++)
+            files[i] = jobs[i].stats;
+        Run_Stats run = {
+            .wall_ms = translate_ms + write_ms,
+            .write_ms = write_ms,
+            .io_backend = ring_used ? "io_uring" : "sync",
+            .syscalls = io_syscall_count() - syscalls_start
+        };
+        if (r.stats == STATS_JSON)
+            print_stats_json(stderr, files, r.input_file_count, &run);
+        else
+            print_stats_text(stdout, files, r.input_file_count, &run);
+        hvm_free(files);
+    }
 
-        // Func instruction
-        for (size_t k = 0; k < sizeof(FUNC_ACTION_STRINGS) / sizeof(char*); k++) { 
-            if (str_begins_with(input_buf + i, FUNC_ACTION_STRINGS[k])) {
-                i += strlen(FUNC_ACTION_STRINGS[k]);
-                instructions[inst_count].type = INST_FUNC;
-                instructions[inst_count].inst.func.action = k;
-                res = parse_func_instruction_tail(input_buf + i, instructions + inst_count);
-                goto instruction_parsed;
-            }
+    if (r.watch) {
+        // Initial outputs follow the same rules as later changes
+        int failed_any = 0;
+        for (int i = 0; i < r.input_file_count; i++) {
+            jobs[i].skip = jobs[i].load_failed || jobs[i].tr.error;
+            failed_any |= jobs[i].skip;
         }
+        if (!(r.output_file_count == 1 && failed_any))
+            write_outputs(&r, jobs, ring_used);
 
-        // Invalid token
-        printf("Invalid first token on line %li\n", src_line_count);
-        return 1;
-
-instruction_parsed:
-        // Check for parse error
-        if (res.error) {
-            printf("Parse error on line %li: ", src_line_count);
-            printf("%s", res.error);
-            return 1;
-        }
+        status = watch(&r, jobs, ring_used);
+    }
 
-        // Move to next char after token
-        i += res.token_length;
+    if (ring_used)
+        uring_free(ring_used);
 
-        // Skip whitespace
-        while (input_buf[i] == ' ' || input_buf[i] == '\t')
-            i++;
+    // Free memory
+    size_t instruction_count = 0;
+    for (int i = 0; i < r.input_file_count; i++) {
+        instruction_count += jobs[i].tr.instruction_count;
+        hvm_free_result(&jobs[i].tr);
+        hvm_free(input_file_basenames[i]);
+    }
+    hvm_free(jobs);
+    hvm_free(input_file_basenames);
+    int memory_stats = r.memory_stats;
+    free_arguments(&r);
 
-        // Check for invalid chars
-        char *line_end = find_next_any(input_buf + i, "\r\n");
-        char *comment_start = strstr_range(input_buf + i, line_end, "//");
-        char *check_until = comment_start == NULL ? line_end : comment_start;
-        while (input_buf + i < check_until) {
-            // Anything other than whitespace is invalid
-            if (input_buf[i] != ' ' && input_buf[i] != '\t') {
-                printf("Invalid char '%c' on line %li\n", input_buf[i], src_line_count);
-                return 1;
-            }
-            i++;
-        }
+    // Last, so anything not freed shows
+    if (memory_stats)
+        print_memory_stats(stdout, instruction_count);
 
-        // Move i to the end of the line
-        i = line_end - input_buf + 1;        
-        
-        inst_count++;
-    }
+    return status;
+}
 
-    size_t out_buf_size = INITIAL_HACK_CODE_SIZE_PER_INST * inst_count * sizeof(char);
-    char *out_buf = malloc(out_buf_size);
-
-    size_t out_i = 0; // index of last written char in out_buf
-    // Generate code for each instruction
-    for (size_t i = 0; i < inst_count; i++) {
-        int line_size = 0;
-
-#if GENERATE_HEADER_COMMENTS == 1
-        // Keep resizing out_buf until new line of comment fits
-        while(1) {
-            line_size = snprintf_instruction_comment(out_buf + out_i, out_buf_size - out_i,
-                instructions + i);
-            // If out_buf is full, reallocate and restart loop
-            if (line_size >= out_buf_size - out_i) {
-                out_buf_size *= 2;
-                out_buf = realloc(out_buf, out_buf_size);
-                continue;
-            }
-            out_i += line_size;
-            break;
-        }
-        out_buf[out_i++] = '\n';
-#endif
-
-        int append_size = 0;
-        // Keep resizing out_buf until new instructions fit
-        while (1) {
-            switch (instructions[i].segment) {
-            case SEGMENT_ARGUMENT:
-            case SEGMENT_LOCAL:
-            case SEGMENT_THIS:
-            case SEGMENT_THAT:
-            case SEGMENT_TEMP:
-                if (instructions[i].action == ACTION_POP) {
-                    append_size = snprintf(out_buf + out_i, out_buf_size - out_i,
-                        "@%i\n"
-                        "D=A\n"
-                        "@%s\n"
-                        "D=D+%s\n"
-                        "@__loc\n"
-                        "M=D\n"
-                        "@SP\n"
-                        "M=M-1\n"
-                        "A=M\n"
-                        "D=M\n"
-                        "@__loc\n"
-                        "A=M\n"
-                        "M=D\n",
-                        instructions[i].number,
-                        SEGMENT_TO_REGISTER_NAME[instructions[i].segment],
-                        instructions[i].segment == SEGMENT_TEMP ? "A" : "M");
-                } else if (instructions[i].action == ACTION_PUSH) {
-                    append_size = snprintf(out_buf + out_i, out_buf_size - out_i,
-                        "@%i\n"
-                        "D=A\n"
-                        "@%s\n"
-                        "A=D+%s\n"
-                        "D=M\n"
-                        "@SP\n"
-                        "A=M\n"
-                        "M=D\n"
-                        "@SP\n"
-                        "M=M+1\n",
-                        instructions[i].number,
-                        SEGMENT_TO_REGISTER_NAME[instructions[i].segment],
-                        instructions[i].segment == SEGMENT_TEMP ? "A" : "M");
-                } else {
-                    printf("Invalid action-segment pair. Can only push/pop when segment specified.\n");
-                    return 1;
-                }
-            break;
-
-            case SEGMENT_CONSTANT:
-                if (instructions[i].action == ACTION_PUSH) {
-                    append_size = snprintf(out_buf + out_i, out_buf_size - out_i,
-                        "@%i\n"
-                        "D=A\n"
-                        "@SP\n"
-                        "A=M\n"
-                        "M=D\n"
-                        "@SP\n"
-                        "M=M+1\n",
-                        instructions[i].number);
-                } else {
-                    printf("Invalid action. Can only 'push' from '%s' memory segment.\n",
-                        INST_SEGMENT_STRINGS[SEGMENT_CONSTANT]);
-                    return 1;
-                }
-            break;
-
-            case SEGMENT_POINTER:
-                // Exit if invalid number given
-                if (instructions[i].number != 0 && instructions[i].number != 1) {
-                    printf("Invalid number '%i' with memory segment '%s'\n",
-                        instructions[i].number,
-                        INST_SEGMENT_STRINGS[SEGMENT_POINTER]);
-                    return 1;
-                }
+int serve_run(int argc, char **argv, void *arg)
+{
+    return run(argc, argv, arg);
+}
 
-                if (instructions[i].action == ACTION_PUSH) {
-                    append_size = snprintf(out_buf + out_i, out_buf_size - out_i,
-                        "@%s\n"
-                        "D=M\n"
-                        "@SP\n"
-                        "A=M\n"
-                        "M=D\n"
-                        "@SP\n"
-                        "M=M+1\n",
-                        instructions[i].number == 0 ?
-                            SEGMENT_TO_REGISTER_NAME[SEGMENT_THIS] : SEGMENT_TO_REGISTER_NAME[SEGMENT_THAT]);
-                } else if (instructions[i].action == ACTION_POP) {
-                    append_size = snprintf(out_buf + out_i, out_buf_size - out_i,
-                        "@SP\n"
-                        "M=M-1\n"
-                        "A=M\n"
-                        "D=M\n"
-                        "@%s\n"
-                        "M=D\n",
-                        instructions[i].number == 0 ?
-                            SEGMENT_TO_REGISTER_NAME[SEGMENT_THIS] : SEGMENT_TO_REGISTER_NAME[SEGMENT_THAT]);
-                }
-            break;
-
-            case SEGMENT_STATIC:
-                if (instructions[i].action == ACTION_PUSH) {
-                    append_size = snprintf(out_buf + out_i, out_buf_size - out_i,
-                        "@%s.%i\n"
-                        "D=M\n"
-                        "@SP\n"
-                        "A=M\n"
-                        "M=D\n"
-                        "@SP\n"
-                        "M=M+1\n",
-                        input_file_name, instructions[i].number);
-                } else if (instructions[i].action == ACTION_POP) {
-                    append_size = snprintf(out_buf + out_i, out_buf_size - out_i,
-                        "@SP\n"
-                        "M=M-1\n"
-                        "A=M\n"
-                        "D=M\n"
-                        "@%s.%i\n"
-                        "M=D\n",
-                        input_file_name, instructions[i].number);
-                }
-            break;
-
-            case SEGMENT_NONE:
-                switch (instructions[i].action) {
-                    case ACTION_NEG:
-                    case ACTION_NOT:
-                        append_size = snprintf(out_buf + out_i, out_buf_size - out_i,
-                            "@SP\n"
-                            "A=M-1\n"
-                            "M=%sM\n",
-                            instructions[i].action == ACTION_NEG ?
-                                ARITHLOGIC_ACTION_TABLE[ACTION_NEG]
-                                : ARITHLOGIC_ACTION_TABLE[ACTION_NOT]);
-                    break;
-
-                    case ACTION_ADD:
-                    case ACTION_SUB:
-                    case ACTION_AND:
-                    case ACTION_OR:
-                        append_size = snprintf(out_buf + out_i, out_buf_size - out_i,
-                            "@SP\n"
-                            "M=M-1\n"
-                            "A=M\n"
-                            "D=M\n"
-                            "A=A-1\n"
-                            "M=M%sD\n",
-                            ARITHLOGIC_ACTION_TABLE[instructions[i].action]);
-                    break;
-
-                    case ACTION_EQ:
-                    case ACTION_LT:
-                    case ACTION_GT: {
-                        char *action_str = INST_ACTION_STRINGS[instructions[i].action];
-                        char *comp_str = ARITHLOGIC_ACTION_TABLE[instructions[i].action];
-                        append_size = snprintf(out_buf + out_i, out_buf_size - out_i,
-                            "@SP\n"
-                            "M=M-1\n"
-                            "A=M\n"
-                            "D=M\n"
-                            "A=A-1\n"
-                            "D=M-D\n"
-                            "@__%s.%s.%li.T\n"
-                            "D;%s\n"
-                            "@__%s.%s.%li.F\n"
-                            "0;JMP\n"
-                            "(__%s.%s.%li.T)\n"
-                            "@SP\n"
-                            "A=M-1\n"
-                            "M=-1\n"
-                            "@__%s.%s.%li.END\n"
-                            "0;JMP\n"
-                            "(__%s.%s.%li.F)\n"
-                            "@SP\n"
-                            "A=M-1\n"
-                            "M=0\n"
-                            "(__%s.%s.%li.END)\n",
-                            input_file_name, action_str, i,
-                            comp_str,
-                            input_file_name, action_str, i,
-                            input_file_name, action_str, i,
-                            input_file_name, action_str, i,
-                            input_file_name, action_str, i,
-                            input_file_name, action_str, i);
-                    }
-                    break;
-
-                    default: {
-                        printf("Fatal error, action is '%s'\n", INST_ACTION_STRINGS[instructions[i].action]);
-                        return 1;
-                    }
-                }
-                
-                break;
+// Translates an inline buffer for a server client, with default options
+int serve_translate(char *buf, size_t size, char *module, char **output,
+    size_t *output_size, void *arg)
+{
+    Memory_Cache *memory = arg;
+    Hvm_Options options = HVM_OPTIONS_DEFAULT;
+    options.terminated_input = 1;
+    uint64_t key = cache_key(buf, size, module, hvm_options_key(&options));
 
-            default:
-                printf("Unhandled memory segment specified\n");
-                append_size = 0;
-                break;
-            }
+    *output = memory_cache_lookup(memory, key, output_size);
+    if (*output)
+        return 0;
 
-            // If out_buf is full, reallocate and restart loop
-            if (append_size >= out_buf_size - out_i) {
-                out_buf_size *= 2;
-                out_buf = realloc(out_buf, out_buf_size);
-                continue;
-            }
-            out_i += append_size;
-            break;
-        }
+    Hvm_Result tr = hvm_translate(buf, size, module, &options);
+    if (tr.error) {
+        *output = hvm_malloc(ERR_TEXT_SIZE, HVM_MEM_OUTPUT);
+        snprintf(*output, ERR_TEXT_SIZE, "Parse error in '%s' on line %zu: %s",
+            module, tr.error_line, tr.error);
+        *output_size = strlen(*output);
+        return 1;
     }
 
-    out_buf[++out_i] = '\0';
+    memory_cache_store(memory, key, tr.output, tr.output_size);
+    *output = tr.output;
+    *output_size = tr.output_size;
+    return 0;
+}
 
-    // Write file (size - 1 to exclude null terminator)
-    int error = write_file(out_buf, output_file_path, out_i - 1);
-    if (error) {
-        printf("Error when writing to '%s'\n", output_file_path);
+int main(int argc, char* argv[])
+{
+    // Stay up and translate for clients
+    if (argc == 3 && strcmp(argv[1], "--serve") == 0) {
+        Memory_Cache memory;
+        memory_cache_init(&memory, SERVE_MEMORY_CACHE_SIZE);
+        int status = serve(argv[2], serve_run, serve_translate, &memory);
+        memory_cache_free(&memory);
+        return status;
     }
 
-    // Free all memory
-    free(input_buf);
-    free(instructions);
-    free(out_buf);
-    return 0;
+    // Hand the command line to a running server, if there is one. Streams
+    // run here, the server can't read this process's stdin or write its
+    // stdout.
+    int stream = 0;
+    for (int i = 1; i < argc; i++)
+        stream |= strcmp(argv[i], "-") == 0;
+    char *socket_path = getenv("HVM_SOCKET");
+    int status;
+    if (socket_path && !stream
+        && serve_client(socket_path, argc, argv, &status) == 0)
+        return status;
+
+    return run(argc, argv, NULL);
 }
-    */
\ No newline at end of file
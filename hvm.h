@@ -1,6 +1,10 @@
 #ifndef HVM_H
 #define HVM_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include "emit.h"
+
 enum INST_TYPE {
     INST_ARITHLOGIC = 0,
     INST_STACK,
@@ -16,14 +20,14 @@ enum ARITHLOGIC_ACTION {
     //ARITHLOGIC_ACTION_PARSE_ERROR,
 };
 
-char *ARITHLOGIC_ACTION_STRINGS[] = {
+static char *const ARITHLOGIC_ACTION_STRINGS[] = {
     [ADD] = "add",
     [SUB] = "sub", [NEG] = "neg",
     [EQ]  = "eq",  [GT]  = "gt",  [LT]  = "lt",
     [AND] = "and", [OR]  = "or",  [NOT] = "not",
 };
 
-char *ARITHLOGIC_ACTION_TABLE[] = {
+static char *const ARITHLOGIC_ACTION_TABLE[] = {
     [ADD] = "+",
     [SUB] = "-",   [NEG] = "-",
     [EQ]  = "JEQ", [GT]  = "JGT", [LT]  = "JLT",
@@ -35,7 +39,7 @@ enum STACK_ACTION {
     //STACK_ACTION_PARSE_ERROR,
 };
 
-char *STACK_ACTION_STRINGS[] = {
+static char *const STACK_ACTION_STRINGS[] = {
     [POP] = "pop", [PUSH] = "push",
 };
 
@@ -46,9 +50,10 @@ enum SEGMENT {
     SEG_THIS,     SEG_THAT,
     SEG_POINTER,  SEG_TEMP,
     //SEG_PARSE_ERROR,
+    SEGMENT_COUNT,
 };
 
-char *SEGMENT_STRINGS[] = {
+static char *const SEGMENT_STRINGS[] = {
     [SEG_NONE]     = "NONE",
     [SEG_ARGUMENT] = "argument",  [SEG_LOCAL]    = "local",
     [SEG_STATIC]   = "static",    [SEG_CONSTANT] = "constant",
@@ -56,7 +61,7 @@ char *SEGMENT_STRINGS[] = {
     [SEG_POINTER]  = "pointer",   [SEG_TEMP]     = "temp",
 };
 
-char *SEGMENT_TO_REGISTER_NAME[] = {
+static char *const SEGMENT_TO_REGISTER_NAME[] = {
     [SEG_NONE]     = "NONE",
     [SEG_ARGUMENT] = "ARG",     [SEG_LOCAL]    = "LCL",
     [SEG_STATIC]   = "NONE",    [SEG_CONSTANT] = "NONE",
@@ -69,7 +74,7 @@ enum FLOW_ACTION {
     GOTO, IF_GOTO
 };
 
-char *FLOW_ACTION_STRINGS[] = {
+static char *const FLOW_ACTION_STRINGS[] = {
     [DECLARE_LABEL] = "label",
     [GOTO]          = "goto",
     [IF_GOTO]       = "if-goto",
@@ -80,41 +85,206 @@ enum FUNC_ACTION {
     CALL, RETURN
 };
 
-char *FUNC_ACTION_STRINGS[] = {
+static char *const FUNC_ACTION_STRINGS[] = {
     [DECLARE_FUNC] = "function",
     [CALL]         = "call",
     [RETURN]       = "return",
 };
 
-typedef struct {
-    enum ARITHLOGIC_ACTION action;
-} Arithlogic_Instruction;
+// Flat numbering of every (type, action) pair. Opcodes of one type are
+// contiguous and in the same order as that type's action enum, so
+// action = opcode - OPCODE_BASE[type].
+enum OPCODE {
+    OP_ADD = 0,
+    OP_SUB,      OP_NEG,
+    OP_EQ,       OP_GT,   OP_LT,
+    OP_AND,      OP_OR,   OP_NOT,
+    OP_POP,      OP_PUSH,
+    OP_LABEL,    OP_GOTO, OP_IF_GOTO,
+    OP_FUNCTION, OP_CALL, OP_RETURN,
+    OPCODE_COUNT,
+};
 
-typedef struct {
-    enum STACK_ACTION action;
-    enum SEGMENT segment;
-    int number;
-} Stack_Instruction;
+static const unsigned char OPCODE_TYPE[] = {
+    [OP_ADD]      = INST_ARITHLOGIC,
+    [OP_SUB]      = INST_ARITHLOGIC, [OP_NEG]     = INST_ARITHLOGIC,
+    [OP_EQ]       = INST_ARITHLOGIC, [OP_GT]      = INST_ARITHLOGIC,
+    [OP_LT]       = INST_ARITHLOGIC, [OP_AND]     = INST_ARITHLOGIC,
+    [OP_OR]       = INST_ARITHLOGIC, [OP_NOT]     = INST_ARITHLOGIC,
+    [OP_POP]      = INST_STACK,      [OP_PUSH]    = INST_STACK,
+    [OP_LABEL]    = INST_FLOW,       [OP_GOTO]    = INST_FLOW,
+    [OP_IF_GOTO]  = INST_FLOW,
+    [OP_FUNCTION] = INST_FUNC,       [OP_CALL]    = INST_FUNC,
+    [OP_RETURN]   = INST_FUNC,
+};
+
+static const unsigned char OPCODE_BASE[] = {
+    [INST_ARITHLOGIC] = OP_ADD,
+    [INST_STACK]      = OP_POP,
+    [INST_FLOW]       = OP_LABEL,
+    [INST_FUNC]       = OP_FUNCTION,
+};
+
+// Keyword recognizer used by the lexer. Every opcode keyword lands in its
+// own slot of OPCODE_KEYWORDS and every segment keyword in its own slot of
+// SEGMENT_KEYWORDS, so classifying a token is one hash plus one compare.
+// The multipliers were found by brute-force search over small constants;
+// adding a keyword means re-running the search and re-checking collisions.
+// All keywords are at least 2 chars long.
+#define KEYWORD_HASH(s, len) \
+    ((unsigned char) (s)[0] * 2 + (unsigned char) (s)[1] * 5 \
+        + (unsigned char) (s)[(len) - 1] * 22)
+#define OPCODE_KEYWORDS_SIZE               32
+#define SEGMENT_KEYWORDS_SIZE              16
 
 typedef struct {
-    enum FLOW_ACTION action; // DECLARE, GOTO, IF_GOTO
-    char *label_name; // can not be null
-} Flow_Instruction;
+    char *str; // NULL for empty slots
+    unsigned char len;
+    unsigned char opcode; // enum OPCODE
+} Opcode_Keyword;
+
+static const Opcode_Keyword OPCODE_KEYWORDS[OPCODE_KEYWORDS_SIZE] = {
+    [14] = { "add",      3, OP_ADD },
+    [27] = { "sub",      3, OP_SUB },
+    [15] = { "neg",      3, OP_NEG },
+    [21] = { "eq",       2, OP_EQ },
+    [10] = { "gt",       2, OP_GT },
+    [20] = { "lt",       2, OP_LT },
+    [0]  = { "and",      3, OP_AND },
+    [4]  = { "or",       2, OP_OR },
+    [31] = { "not",      3, OP_NOT },
+    [11] = { "pop",      3, OP_POP },
+    [25] = { "push",     4, OP_PUSH },
+    [5]  = { "label",    5, OP_LABEL },
+    [3]  = { "goto",     4, OP_GOTO },
+    [26] = { "if-goto",  7, OP_IF_GOTO },
+    [9]  = { "function", 8, OP_FUNCTION },
+    [19] = { "call",     4, OP_CALL },
+    [17] = { "return",   6, OP_RETURN },
+};
 
 typedef struct {
-    enum FUNC_ACTION action; // DECLARE, CALL, RETURN
-    char *func_name; // can be null
-    int number; // when declaring, n local vars; when calling, n args passed;
-} Func_Instruction;
+    char *str; // NULL for empty slots
+    unsigned char len;
+    unsigned char segment; // enum SEGMENT
+} Segment_Keyword;
+
+static const Segment_Keyword SEGMENT_KEYWORDS[SEGMENT_KEYWORDS_SIZE] = {
+    [4]  = { "argument", 8, SEG_ARGUMENT },
+    [11] = { "local",    5, SEG_LOCAL },
+    [12] = { "static",   6, SEG_STATIC },
+    [9]  = { "constant", 8, SEG_CONSTANT },
+    [2]  = { "this",     4, SEG_THIS },
+    [8]  = { "that",     4, SEG_THAT },
+    [7]  = { "pointer",  7, SEG_POINTER },
+    [1]  = { "temp",     4, SEG_TEMP },
+};
+
+// Hack code templates. Operands are written between the pieces by the code
+// generator in hvm.c, so no format strings are parsed while emitting.
+#define HACK_PUSH_D "@SP\nA=M\nM=D\n@SP\nM=M+1\n"
+#define HACK_POP_D  "@SP\nM=M-1\nA=M\nD=M\n"
+#define HACK_POP_TO_LOC "@__loc\nM=D\n" HACK_POP_D "@__loc\nA=M\nM=D\n"
+
+// push <segment> n: "@" n, then the tail
+static const Template PUSH_TAIL_TEMPLATES[] = {
+    [SEG_ARGUMENT] = TEMPLATE("\nD=A\n@ARG\nA=D+M\nD=M\n" HACK_PUSH_D),
+    [SEG_LOCAL]    = TEMPLATE("\nD=A\n@LCL\nA=D+M\nD=M\n" HACK_PUSH_D),
+    [SEG_THIS]     = TEMPLATE("\nD=A\n@THIS\nA=D+M\nD=M\n" HACK_PUSH_D),
+    [SEG_THAT]     = TEMPLATE("\nD=A\n@THAT\nA=D+M\nD=M\n" HACK_PUSH_D),
+    [SEG_TEMP]     = TEMPLATE("\nD=A\n@5\nA=D+A\nD=M\n" HACK_PUSH_D),
+    [SEG_CONSTANT] = TEMPLATE("\nD=A\n" HACK_PUSH_D),
+};
+
+// pop <segment> n: "@" n, then the tail
+static const Template POP_TAIL_TEMPLATES[] = {
+    [SEG_ARGUMENT] = TEMPLATE("\nD=A\n@ARG\nD=D+M\n" HACK_POP_TO_LOC),
+    [SEG_LOCAL]    = TEMPLATE("\nD=A\n@LCL\nD=D+M\n" HACK_POP_TO_LOC),
+    [SEG_THIS]     = TEMPLATE("\nD=A\n@THIS\nD=D+M\n" HACK_POP_TO_LOC),
+    [SEG_THAT]     = TEMPLATE("\nD=A\n@THAT\nD=D+M\n" HACK_POP_TO_LOC),
+    [SEG_TEMP]     = TEMPLATE("\nD=A\n@5\nD=D+A\n" HACK_POP_TO_LOC),
+};
+
+// push/pop pointer 0 (THIS) or 1 (THAT)
+static const Template PUSH_POINTER_TEMPLATES[] = {
+    TEMPLATE("@THIS\nD=M\n" HACK_PUSH_D),
+    TEMPLATE("@THAT\nD=M\n" HACK_PUSH_D),
+};
+
+static const Template POP_POINTER_TEMPLATES[] = {
+    TEMPLATE(HACK_POP_D "@THIS\nM=D\n"),
+    TEMPLATE(HACK_POP_D "@THAT\nM=D\n"),
+};
+
+// push static n: "@" module "." n, then this
+static const Template PUSH_STATIC_TAIL_TEMPLATE = TEMPLATE("\nD=M\n" HACK_PUSH_D);
+
+// pop static n: this, then module "." n "\nM=D\n"
+static const Template POP_STATIC_HEAD_TEMPLATE = TEMPLATE(HACK_POP_D "@");
+
+static const Template ARITHLOGIC_TEMPLATES[] = {
+    [ADD] = TEMPLATE(HACK_POP_D "A=A-1\nM=M+D\n"),
+    [SUB] = TEMPLATE(HACK_POP_D "A=A-1\nM=M-D\n"),
+    [AND] = TEMPLATE(HACK_POP_D "A=A-1\nM=M&D\n"),
+    [OR]  = TEMPLATE(HACK_POP_D "A=A-1\nM=M|D\n"),
+    [NEG] = TEMPLATE("@SP\nA=M-1\nM=-M\n"),
+    [NOT] = TEMPLATE("@SP\nA=M-1\nM=!M\n"),
+    // Comparisons are split around their labels, see COMPARISON_TEMPLATES
+};
+
+// eq/gt/lt: each piece but the last is followed by a label named
+// __<module>.<action>.<index>.<suffix> with the suffix at the same position
+// in COMPARISON_LABEL_SUFFIXES, or by the jump from ARITHLOGIC_ACTION_TABLE
+// where the suffix is NULL
+static const Template COMPARISON_TEMPLATES[] = {
+    TEMPLATE(HACK_POP_D "A=A-1\nD=M-D\n@"),
+    TEMPLATE("\nD;"),
+    TEMPLATE("\n@"),
+    TEMPLATE("\n0;JMP\n("),
+    TEMPLATE(")\n@SP\nA=M-1\nM=-1\n@"),
+    TEMPLATE("\n0;JMP\n("),
+    TEMPLATE(")\n@SP\nA=M-1\nM=0\n("),
+    TEMPLATE(")\n"),
+};
+
+static char *const COMPARISON_LABEL_SUFFIXES[] = { "T", NULL, "F", "T", "END", "F", "END" };
 
+// function f k: "(" f ")\n", then if k > 0 the head, k times the body and
+// the tail
+static const Template FUNCTION_LOCALS_HEAD_TEMPLATE = TEMPLATE("@SP\nA=M\n");
+static const Template FUNCTION_LOCALS_BODY_TEMPLATE = TEMPLATE("M=0\nA=A+1\n");
+static const Template FUNCTION_LOCALS_TAIL_TEMPLATE = TEMPLATE("D=A\n@SP\nM=D\n");
+
+// call f n: "@" return label, this, "@" n + 5, the tail, "@" f,
+// "\n0;JMP\n(" return label ")\n"
+#define HACK_PUSH_REGISTER(r) "@" r "\nD=M\n" HACK_PUSH_D
+static const Template CALL_SAVE_TEMPLATE = TEMPLATE("\nD=A\n" HACK_PUSH_D
+    HACK_PUSH_REGISTER("LCL") HACK_PUSH_REGISTER("ARG")
+    HACK_PUSH_REGISTER("THIS") HACK_PUSH_REGISTER("THAT")
+    "@SP\nD=M\n");
+static const Template CALL_REPOSITION_TEMPLATE = TEMPLATE("\nD=D-A\n@ARG\nM=D\n"
+    "@SP\nD=M\n@LCL\nM=D\n");
+
+#define HACK_RESTORE_REGISTER(r) "@__frame\nAM=M-1\nD=M\n@" r "\nM=D\n"
+static const Template RETURN_TEMPLATE = TEMPLATE(
+    "@LCL\nD=M\n@__frame\nM=D\n"
+    "@5\nA=D-A\nD=M\n@__ret\nM=D\n"
+    "@SP\nAM=M-1\nD=M\n@ARG\nA=M\nM=D\n"
+    "@ARG\nD=M+1\n@SP\nM=D\n"
+    HACK_RESTORE_REGISTER("THAT") HACK_RESTORE_REGISTER("THIS")
+    HACK_RESTORE_REGISTER("ARG") HACK_RESTORE_REGISTER("LCL")
+    "@__ret\nA=M\n0;JMP\n");
+
+// One VM instruction in 8 bytes. Use the inst_* accessors in hvm.c to read
+// the type and per-type action.
 typedef struct {
-    enum INST_TYPE type;
-    union {
-        Arithlogic_Instruction arithlogic;
-        Stack_Instruction stack;
-        Flow_Instruction flow;
-        Func_Instruction func;
-    } inst;
+    uint8_t opcode; // enum OPCODE
+    uint8_t segment; // enum SEGMENT, SEG_NONE unless push/pop
+    uint16_t number; // push/pop index; n locals when declaring, n args when calling
+    uint32_t symbol; // label or function name id, NO_SYMBOL if none
 } Instruction;
 
+// Fails to compile if Instruction isn't packed into 8 bytes
+typedef char instruction_size_check[sizeof(Instruction) == 8 ? 1 : -1];
+
 #endif // HVM_H
\ No newline at end of file
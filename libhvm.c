@@ -0,0 +1,2023 @@
+/*
+ libhvm - Hack virtual machine translator library
+
+ Parses VM code and generates Hack assembly from memory buffers. See
+ libhvm.h for the API.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "scan.h"
+#include "symbol.h"
+#include "emit.h"
+#include "pool.h"
+#include "hash.h"
+#include "text.h"
+#include "object.h"
+#include "timer.h"
+#include "pass.h"
+#include "libhvm.h"
+
+#define INST_ARRAY_INITIAL_CAPACITY        1024
+#define INST_ARRAY_CAPACITY_GROWTH_RATE    1024
+#define GENERATE_HEADER_COMMENTS           1
+#define PARALLEL_PARSE_MIN_SIZE            (4 * 1024 * 1024)
+#define CHUNKS_PER_THREAD                  4
+#define OUTPUT_FORMAT_VERSION              1 // Bump when output changes
+#define SINK_BLOCK_SIZE                    4096
+#define STREAM_CHUNK_SIZE                  (1024 * 1024)
+#define STREAM_HELD_MAX                    4096 // Instructions
+
+#include "hvm.h"
+
+static enum INST_TYPE inst_type(Instruction *i)
+{
+    return OPCODE_TYPE[i->opcode];
+}
+
+// Returns the action enum of the instruction's type (ARITHLOGIC_ACTION,
+// STACK_ACTION, FLOW_ACTION or FUNC_ACTION)
+static int inst_action(Instruction *i)
+{
+    return i->opcode - OPCODE_BASE[OPCODE_TYPE[i->opcode]];
+}
+
+static enum SEGMENT inst_segment(Instruction *i)
+{
+    return i->segment;
+}
+
+static int inst_number(Instruction *i)
+{
+    return i->number;
+}
+
+// Returned by parse_*_instruction_* functions
+typedef struct {
+    size_t token_length;
+    char *error;
+} Parse_Result;
+
+// Checks if char is allowed inside an opcode or segment keyword
+static int is_keyword_char(char c)
+{
+    return (c >= 'a' && c <= 'z') || c == '-';
+}
+
+// Checks if char may directly follow a keyword
+static int is_keyword_end(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\0'
+        || c == '/';
+}
+
+// Returns the length of the keyword-shaped token at 'str', or 0 if the
+// token is followed by something that can't end a keyword
+static size_t keyword_token_length(char *str)
+{
+    size_t len = 0;
+    while (is_keyword_char(str[len]))
+        len++;
+
+    if (!is_keyword_end(str[len]))
+        return 0;
+
+    return len;
+}
+
+// Returns opcode keyword spelled by exactly 'len' chars at 'str', or NULL
+static const Opcode_Keyword *lookup_opcode_keyword(char *str, size_t len)
+{
+    if (len < 2)
+        return NULL;
+
+    const Opcode_Keyword *k = OPCODE_KEYWORDS
+        + (KEYWORD_HASH(str, len) & (OPCODE_KEYWORDS_SIZE - 1));
+    if (k->len != len || memcmp(k->str, str, len) != 0)
+        return NULL;
+
+    return k;
+}
+
+// Returns segment keyword spelled by exactly 'len' chars at 'str', or NULL
+static const Segment_Keyword *lookup_segment_keyword(char *str, size_t len)
+{
+    if (len < 2)
+        return NULL;
+
+    const Segment_Keyword *k = SEGMENT_KEYWORDS
+        + (KEYWORD_HASH(str, len) & (SEGMENT_KEYWORDS_SIZE - 1));
+    if (k->len != len || memcmp(k->str, str, len) != 0)
+        return NULL;
+
+    return k;
+}
+
+// Expects first token to already be parsed into i.
+// Parses the rest of the instruction and returns its length.
+static Parse_Result parse_stack_instruction_tail(char *str, Instruction *i)
+{
+    size_t len = 0;
+
+    // Skip whitespace
+    while (str[len] == ' ' || str[len] == '\t')
+        len++;
+
+    size_t segment_len = keyword_token_length(str + len);
+    const Segment_Keyword *k = lookup_segment_keyword(str + len, segment_len);
+    if (!k) {
+        return (Parse_Result) {
+            .token_length = len,
+            .error = "Expected segment in stack instruction\n"
+        };
+    }
+
+    i->segment = k->segment;
+    len += segment_len;
+
+    // Skip whitespace
+    while (str[len] == ' ' || str[len] == '\t')
+        len++;
+
+    // Parse number
+    if (is_number(str[len])) {
+        // Find end of number token
+        char *num_end = str + len + 1;
+        while (is_number(*num_end))
+            num_end++;
+        num_end--; // Stand on last digit of number
+
+        // Operands are stored in 16 bits. Leading zeros don't count
+        // towards the digits that could overflow the int.
+        char *digits = str + len;
+        while (digits < num_end && *digits == '0')
+            digits++;
+        if (num_end - digits >= 5
+            || hvm_parse_next_int(digits, num_end) > UINT16_MAX) {
+            return (Parse_Result) {
+                .token_length = len,
+                .error = "Number too large in stack instruction\n"
+            };
+        }
+
+        // Parse the number and add to instruction
+        i->number = hvm_parse_next_int(str + len, num_end);
+
+        size_t num_len = (num_end + 1) - (str + len);
+        len += num_len;
+    } else {
+        return (Parse_Result) {
+            .token_length = len,
+            .error = "Expected number in stack instruction\n"
+        };
+    }
+
+    if (i->segment == SEG_CONSTANT && i->opcode == OP_POP) {
+        return (Parse_Result) {
+            .token_length = len,
+            .error = "Can only push from constant segment\n"
+        };
+    }
+
+    if (i->segment == SEG_POINTER && i->number > 1) {
+        return (Parse_Result) {
+            .token_length = len,
+            .error = "Pointer segment only has indices 0 and 1\n"
+        };
+    }
+
+    return (Parse_Result) { .token_length = len, .error = NULL };
+}
+
+// Parses label name, returns its length or error
+static Parse_Result parse_label_name(char *str)
+{
+    // Return error if invalid char found
+    if (!hvm_is_valid_symbol_head(*str)) {
+        return (Parse_Result) {
+            .token_length = 0,
+            .error = "Expected label name, got invalid character\n"
+        };
+    }
+
+    // Find end of label name
+    char *label_name_end = str + 1;
+    while (hvm_is_valid_symbol_tail(*label_name_end)) {
+        label_name_end++;
+    }
+
+    return (Parse_Result) { .token_length = label_name_end - str, .error = NULL };
+}
+
+// Expects first token to already be parsed into i.
+// Parses the rest of the instruction and returns its length.
+static Parse_Result parse_flow_instruction_tail(char *str, Instruction *i,
+    Symbol_Table *st)
+{
+    size_t len = 0;
+
+    // Skip whitespace
+    while (str[len] == ' ' || str[len] == '\t')
+        len++;
+
+    // Parse label name
+    Parse_Result res = parse_label_name(str + len);
+    if (res.error) {
+        return (Parse_Result) {
+            .token_length = len + res.token_length,
+            .error = res.error
+        };
+    }
+
+    // Intern label name
+    size_t label_len = res.token_length;
+    i->symbol = hvm_intern_symbol(st, str + len, label_len);
+    if (i->symbol == NO_SYMBOL) {
+        return (Parse_Result) {
+            .token_length = len,
+            .error = "Out of memory\n"
+        };
+    }
+
+    len += label_len;
+    return (Parse_Result) { .token_length = len, .error = NULL };
+}
+
+// Expects first token to already be parsed into i.
+// Parses the rest of the instruction and returns its length.
+static Parse_Result parse_func_instruction_tail(char *str, Instruction *i,
+    Symbol_Table *st)
+{
+    size_t len = 0;
+
+    // Skip whitespace
+    while (str[len] == ' ' || str[len] == '\t')
+        len++;
+
+    if (i->opcode == OP_RETURN) {
+        // Nothing else to parse
+        return (Parse_Result) { .token_length = len, .error = NULL };
+    }
+
+    // Parse function name
+    Parse_Result res = parse_label_name(str + len);
+    if (res.error) {
+        return (Parse_Result) {
+            .token_length = len + res.token_length,
+            .error = res.error
+        };
+    }
+
+    // Intern function name
+    size_t func_len = res.token_length;
+    i->symbol = hvm_intern_symbol(st, str + len, func_len);
+    if (i->symbol == NO_SYMBOL) {
+        return (Parse_Result) {
+            .token_length = len,
+            .error = "Out of memory\n"
+        };
+    }
+
+    len += func_len;
+
+    // Skip whitespace
+    while (str[len] == ' ' || str[len] == '\t')
+        len++;
+
+    // Parse number
+    if (is_number(str[len])) {
+        // Find end of number token
+        char *num_end = str + len + 1;
+        while (is_number(*num_end))
+            num_end++;
+        num_end--; // Stand on last digit of number
+
+        // Operands are stored in 16 bits. Leading zeros don't count
+        // towards the digits that could overflow the int.
+        char *digits = str + len;
+        while (digits < num_end && *digits == '0')
+            digits++;
+        if (num_end - digits >= 5
+            || hvm_parse_next_int(digits, num_end) > UINT16_MAX) {
+            return (Parse_Result) {
+                .token_length = len,
+                .error = "Number too large in func instruction\n"
+            };
+        }
+
+        // Parse the number and add to instruction
+        i->number = hvm_parse_next_int(str + len, num_end);
+
+        size_t num_len = (num_end + 1) - (str + len);
+        len += num_len;
+    } else {
+        return (Parse_Result) {
+            .token_length = len,
+            .error = "Expected number in func instruction\n"
+        };
+    }
+    
+    return (Parse_Result) { .token_length = len, .error = NULL };    
+}
+
+// Parses a whole instruction into i, classifying it by its first token.
+// Returns the length of the instruction, excluding trailing whitespace
+// and comments.
+static Parse_Result parse_instruction(char *str, Instruction *i,
+    Symbol_Table *st)
+{
+    size_t len = keyword_token_length(str);
+    const Opcode_Keyword *k = lookup_opcode_keyword(str, len);
+    if (!k) {
+        return (Parse_Result) {
+            .token_length = 0,
+            .error = "Invalid first token\n"
+        };
+    }
+
+    Parse_Result res = { .token_length = 0, .error = NULL };
+    i->opcode = k->opcode;
+    i->segment = SEG_NONE;
+    i->number = 0;
+    i->symbol = NO_SYMBOL;
+    switch (inst_type(i)) {
+    case INST_ARITHLOGIC:
+        // Arithlogic instruction only has one token
+        break;
+    case INST_STACK:
+        res = parse_stack_instruction_tail(str + len, i);
+        break;
+    case INST_FLOW:
+        res = parse_flow_instruction_tail(str + len, i, st);
+        break;
+    case INST_FUNC:
+        res = parse_func_instruction_tail(str + len, i, st);
+        break;
+    }
+
+    res.token_length += len;
+    return res;
+}
+
+typedef struct {
+    Instruction *instructions;
+    size_t instruction_count;
+    char *error;
+    size_t error_line;
+} Parse_Output;
+
+// Parses lines [first_line, end_line) of 'input_buf' as indexed by 'li'.
+// Label and function names are interned into 'st'.
+static Parse_Output parse_lines(char *input_buf, Line_Index *li,
+    size_t first_line, size_t end_line, Symbol_Table *st)
+{
+    Parse_Output out = {
+        .instructions = NULL,
+        .instruction_count = 0,
+        .error = NULL,
+        .error_line = 0
+    };
+
+    size_t instructions_capacity = INST_ARRAY_INITIAL_CAPACITY;
+    Instruction *instructions = hvm_malloc(sizeof(Instruction) *
+        instructions_capacity, HVM_MEM_INSTRUCTIONS);
+
+    size_t inst_count = 0;
+    for (size_t line = first_line; line < end_line; line++) {
+        char *p = input_buf + li->starts[line];
+        char *code_end = input_buf + li->code_ends[line];
+
+        // Skip whitespace
+        while (p < code_end && (*p == ' ' || *p == '\t' || *p == '\r'))
+            p++;
+
+        // Empty or comment-only line
+        if (p == code_end)
+            continue;
+
+        // Grow instructions array if full
+        if (inst_count == instructions_capacity) {
+            instructions_capacity += INST_ARRAY_CAPACITY_GROWTH_RATE;
+            instructions = hvm_realloc(instructions, sizeof(Instruction) *
+                instructions_capacity, HVM_MEM_INSTRUCTIONS);
+        }
+
+        Parse_Result res = parse_instruction(p, instructions + inst_count, st);
+        if (res.error) {
+            out.error = res.error;
+            out.error_line = line + 1;
+            break;
+        }
+
+        // Anything other than whitespace until comment or line end is invalid
+        for (p += res.token_length; p < code_end; p++) {
+            if (*p != ' ' && *p != '\t' && *p != '\r') {
+                out.error = "Invalid character after instruction\n";
+                out.error_line = line + 1;
+                break;
+            }
+        }
+        if (out.error)
+            break;
+
+        inst_count++;
+    }
+
+    if (out.error) {
+        hvm_free(instructions);
+        return out;
+    }
+
+    out.instructions = instructions;
+    out.instruction_count = inst_count;
+    return out;
+}
+
+// Parses all instructions in 'input_buf', which must be followed by a '\0'.
+// Label and function names are interned into 'st'.
+static Parse_Output parse_instructions(char *input_buf, size_t input_size,
+    Symbol_Table *st)
+{
+    // Find all line ends and comments up front
+    Line_Index li;
+    if (hvm_build_line_index(input_buf, input_size, &li) != 0) {
+        return (Parse_Output) {
+            .instructions = NULL,
+            .instruction_count = 0,
+            .error = "Out of memory\n",
+            .error_line = 0
+        };
+    }
+
+    Parse_Output out = parse_lines(input_buf, &li, 0, li.count, st);
+    hvm_free_line_index(&li);
+    return out;
+}
+
+// A run of lines parsed by one pool task, with its own symbol table
+typedef struct {
+    char *input_buf;
+    Line_Index *li;
+    size_t first_line;
+    size_t end_line;
+    Symbol_Table st;
+    Parse_Output out;
+    size_t first_instruction; // Position in the merged array
+    Instruction *merged;
+    uint32_t *symbol_map; // Chunk symbol id to merged symbol id
+} Parse_Chunk;
+
+static void parse_chunk(void *arg, size_t index)
+{
+    Parse_Chunk *c = (Parse_Chunk*) arg + index;
+    hvm_symbol_table_init(&c->st);
+    c->out = parse_lines(c->input_buf, c->li, c->first_line, c->end_line, &c->st);
+}
+
+// Copies a chunk's instructions into the merged array with merged symbol ids
+static void merge_chunk(void *arg, size_t index)
+{
+    Parse_Chunk *c = (Parse_Chunk*) arg + index;
+    Instruction *dst = c->merged + c->first_instruction;
+    for (size_t k = 0; k < c->out.instruction_count; k++) {
+        dst[k] = c->out.instructions[k];
+        if (dst[k].symbol != NO_SYMBOL)
+            dst[k].symbol = c->symbol_map[dst[k].symbol];
+    }
+    hvm_free(c->out.instructions);
+}
+
+// Same result as parse_instructions, but splits the input at line
+// boundaries and parses the pieces on up to 'thread_count' threads.
+// Chunk symbols are merged into 'st' in chunk order, which interns them in
+// order of first appearance just like a serial parse. Generated label
+// names come from positions in the merged array, so they need no fixup.
+static Parse_Output parse_instructions_parallel(char *input_buf,
+    size_t input_size, Symbol_Table *st, int thread_count)
+{
+    Parse_Output out = {
+        .instructions = NULL,
+        .instruction_count = 0,
+        .error = NULL,
+        .error_line = 0
+    };
+
+    Line_Index li;
+    if (hvm_build_line_index(input_buf, input_size, &li) != 0) {
+        out.error = "Out of memory\n";
+        return out;
+    }
+
+    size_t chunk_count = (size_t) thread_count * CHUNKS_PER_THREAD;
+    if (chunk_count > li.count)
+        chunk_count = li.count ? li.count : 1;
+
+    Parse_Chunk *chunks = hvm_calloc(chunk_count, sizeof(Parse_Chunk),
+        HVM_MEM_OTHER);
+    for (size_t c = 0; c < chunk_count; c++) {
+        chunks[c].input_buf = input_buf;
+        chunks[c].li = &li;
+        chunks[c].first_line = li.count * c / chunk_count;
+        chunks[c].end_line = li.count * (c + 1) / chunk_count;
+    }
+
+    hvm_pool_run(thread_count, chunk_count, parse_chunk, chunks);
+
+    // The earliest failing chunk holds the error a serial parse would report
+    size_t total = 0;
+    for (size_t c = 0; c < chunk_count; c++) {
+        if (chunks[c].out.error && !out.error) {
+            out.error = chunks[c].out.error;
+            out.error_line = chunks[c].out.error_line;
+        }
+        chunks[c].first_instruction = total;
+        total += chunks[c].out.instruction_count;
+    }
+
+    Instruction *merged = out.error ? NULL
+        : hvm_malloc(total * sizeof(Instruction), HVM_MEM_INSTRUCTIONS);
+    if (!out.error && !merged)
+        out.error = "Out of memory\n";
+
+    // Merge symbol tables in chunk order
+    for (size_t c = 0; c < chunk_count && !out.error; c++) {
+        Symbol_Table *cst = &chunks[c].st;
+        chunks[c].merged = merged;
+        chunks[c].symbol_map = hvm_malloc(cst->count * sizeof(uint32_t),
+            HVM_MEM_SYMBOLS);
+        if (!chunks[c].symbol_map) {
+            out.error = "Out of memory\n";
+            break;
+        }
+        for (uint32_t id = 0; id < cst->count; id++) {
+            chunks[c].symbol_map[id] = hvm_intern_symbol(st,
+                symbol_name(cst, id), symbol_length(cst, id));
+            if (chunks[c].symbol_map[id] == NO_SYMBOL)
+                out.error = "Out of memory\n";
+        }
+    }
+
+    if (!out.error) {
+        hvm_pool_run(thread_count, chunk_count, merge_chunk, chunks);
+        out.instructions = merged;
+        out.instruction_count = total;
+    } else {
+        hvm_free(merged);
+        for (size_t c = 0; c < chunk_count; c++)
+            hvm_free(chunks[c].out.instructions);
+    }
+
+    for (size_t c = 0; c < chunk_count; c++) {
+        hvm_free(chunks[c].symbol_map);
+        hvm_symbol_table_free(&chunks[c].st);
+    }
+    hvm_free(chunks);
+    hvm_free_line_index(&li);
+    return out;
+}
+
+// State of the code generator while emitting one translation
+typedef struct {
+    Emitter *e;
+    Symbol_Table *st;
+    char *module; // prefixes static variables and generated labels
+    size_t module_len;
+    uint32_t function; // enclosing function, NO_SYMBOL before the first one
+    size_t function_start; // index of its declaration
+    int function_labels; // number generated labels from function_start
+    unsigned passes; // Hack passes run on code before it goes to a sink
+    size_t held; // Bytes at the start of the emitter held back from the sink
+} Codegen;
+
+static void emit_str(Emitter *e, char *s)
+{
+    emit_bytes(e, s, strlen(s));
+}
+
+static void emit_symbol(Codegen *g, uint32_t id)
+{
+    emit_bytes(g->e, symbol_name(g->st, id), symbol_length(g->st, id));
+}
+
+// Writes __<module>.<action>.<index>.<suffix>, unique within the output.
+// With function labels, writes __<module>.<function>.<action>.<index>...
+// with 'index' counted from the function declaration instead.
+static void emit_generated_label(Codegen *g, char *action, size_t index,
+    char *suffix)
+{
+    emit_literal(g->e, "__");
+    emit_bytes(g->e, g->module, g->module_len);
+    emit_char(g->e, '.');
+    if (g->function_labels && g->function != NO_SYMBOL) {
+        emit_symbol(g, g->function);
+        emit_char(g->e, '.');
+        index -= g->function_start;
+    }
+    emit_str(g->e, action);
+    emit_char(g->e, '.');
+    hvm_emit_uint(g->e, index);
+    emit_char(g->e, '.');
+    emit_str(g->e, suffix);
+}
+
+// Writes <function>$<label>, or just <label> outside of functions
+static void emit_flow_label(Codegen *g, uint32_t label)
+{
+    if (g->function != NO_SYMBOL) {
+        emit_symbol(g, g->function);
+        emit_char(g->e, '$');
+    }
+    emit_symbol(g, label);
+}
+
+// Writes the instruction as a comment line, such as
+// '// Arithlogic_Instruction { .action=add }'
+static void emit_instruction_comment(Codegen *g, Instruction *i)
+{
+    Emitter *e = g->e;
+    switch (inst_type(i)) {
+    case INST_ARITHLOGIC:
+        emit_literal(e, "// Arithlogic_Instruction { .action=");
+        emit_str(e, ARITHLOGIC_ACTION_STRINGS[inst_action(i)]);
+        emit_literal(e, " }\n");
+        break;
+    case INST_STACK:
+        emit_literal(e, "// Stack_Instruction { .action=");
+        emit_str(e, STACK_ACTION_STRINGS[inst_action(i)]);
+        emit_literal(e, ", .segment=");
+        emit_str(e, SEGMENT_STRINGS[inst_segment(i)]);
+        emit_literal(e, ", .number=");
+        hvm_emit_uint(e, inst_number(i));
+        emit_literal(e, " }\n");
+        break;
+    case INST_FLOW:
+        emit_literal(e, "// Flow_Instruction { .action=");
+        emit_str(e, FLOW_ACTION_STRINGS[inst_action(i)]);
+        emit_literal(e, ", .label_name='");
+        emit_symbol(g, i->symbol);
+        emit_literal(e, "' }\n");
+        break;
+    case INST_FUNC:
+        emit_literal(e, "// Func_Instruction { .action=");
+        emit_str(e, FUNC_ACTION_STRINGS[inst_action(i)]);
+        emit_literal(e, ", .func_name='");
+        if (i->symbol != NO_SYMBOL)
+            emit_symbol(g, i->symbol);
+        else
+            emit_literal(e, "NULL");
+        emit_literal(e, "', .number=");
+        hvm_emit_uint(e, inst_number(i));
+        emit_literal(e, " }\n");
+        break;
+    }
+}
+
+#define LITERAL_LEN(s) (sizeof(s) - 1)
+
+// Size of what emit_generated_label writes
+static size_t generated_label_size(Codegen *g, char *action, size_t index,
+    char *suffix)
+{
+    size_t size = 0;
+    if (g->function_labels && g->function != NO_SYMBOL) {
+        size += symbol_length(g->st, g->function) + 1;
+        index -= g->function_start;
+    }
+    return size + LITERAL_LEN("__") + g->module_len + 1 + strlen(action) + 1
+        + hvm_uint_digits(index) + 1 + strlen(suffix);
+}
+
+// Size of what emit_flow_label writes
+static size_t flow_label_size(Codegen *g, uint32_t label)
+{
+    size_t size = symbol_length(g->st, label);
+    if (g->function != NO_SYMBOL)
+        size += symbol_length(g->st, g->function) + 1;
+    return size;
+}
+
+// Size of what emit_instruction_comment writes
+static size_t instruction_comment_size(Codegen *g, Instruction *i)
+{
+    switch (inst_type(i)) {
+    case INST_ARITHLOGIC:
+        return LITERAL_LEN("// Arithlogic_Instruction { .action=")
+            + strlen(ARITHLOGIC_ACTION_STRINGS[inst_action(i)])
+            + LITERAL_LEN(" }\n");
+    case INST_STACK:
+        return LITERAL_LEN("// Stack_Instruction { .action=")
+            + strlen(STACK_ACTION_STRINGS[inst_action(i)])
+            + LITERAL_LEN(", .segment=")
+            + strlen(SEGMENT_STRINGS[inst_segment(i)])
+            + LITERAL_LEN(", .number=")
+            + hvm_uint_digits(inst_number(i))
+            + LITERAL_LEN(" }\n");
+    case INST_FLOW:
+        return LITERAL_LEN("// Flow_Instruction { .action=")
+            + strlen(FLOW_ACTION_STRINGS[inst_action(i)])
+            + LITERAL_LEN(", .label_name='")
+            + symbol_length(g->st, i->symbol)
+            + LITERAL_LEN("' }\n");
+    case INST_FUNC:
+        return LITERAL_LEN("// Func_Instruction { .action=")
+            + strlen(FUNC_ACTION_STRINGS[inst_action(i)])
+            + LITERAL_LEN(", .func_name='")
+            + (i->symbol != NO_SYMBOL ? symbol_length(g->st, i->symbol)
+                : LITERAL_LEN("NULL"))
+            + LITERAL_LEN("', .number=")
+            + hvm_uint_digits(inst_number(i))
+            + LITERAL_LEN(" }\n");
+    }
+    return 0;
+}
+
+// Size of what emit_stack writes
+static size_t stack_size(Codegen *g, Instruction *i)
+{
+    switch (inst_segment(i)) {
+    case SEG_POINTER:
+        return i->opcode == OP_PUSH ?
+            PUSH_POINTER_TEMPLATES[i->number].len : POP_POINTER_TEMPLATES[i->number].len;
+    case SEG_STATIC:
+        return (i->opcode == OP_POP ? POP_STATIC_HEAD_TEMPLATE.len : 1)
+            + g->module_len + 1 + hvm_uint_digits(i->number)
+            + (i->opcode == OP_POP ? LITERAL_LEN("\nM=D\n")
+                : PUSH_STATIC_TAIL_TEMPLATE.len);
+    default:
+        return 1 + hvm_uint_digits(i->number) + (i->opcode == OP_PUSH ?
+            PUSH_TAIL_TEMPLATES[i->segment].len : POP_TAIL_TEMPLATES[i->segment].len);
+    }
+}
+
+// Exact number of bytes emit_instruction writes for instruction number
+// 'index'. Tracks the enclosing function the same way emit_instruction does.
+static size_t instruction_size(Codegen *g, Instruction *i, size_t index)
+{
+    switch (i->opcode) {
+    case OP_EQ:
+    case OP_GT:
+    case OP_LT: {
+        int action = inst_action(i);
+        size_t size = strlen(ARITHLOGIC_ACTION_TABLE[action]);
+        size_t piece_count = sizeof(COMPARISON_LABEL_SUFFIXES) / sizeof(char*);
+        for (size_t k = 0; k < piece_count; k++) {
+            size += COMPARISON_TEMPLATES[k].len;
+            if (COMPARISON_LABEL_SUFFIXES[k])
+                size += generated_label_size(g, ARITHLOGIC_ACTION_STRINGS[action],
+                    index, COMPARISON_LABEL_SUFFIXES[k]);
+        }
+        return size + COMPARISON_TEMPLATES[piece_count].len;
+    }
+    case OP_ADD:
+    case OP_SUB:
+    case OP_NEG:
+    case OP_AND:
+    case OP_OR:
+    case OP_NOT:
+        return ARITHLOGIC_TEMPLATES[inst_action(i)].len;
+    case OP_PUSH:
+    case OP_POP:
+        return stack_size(g, i);
+    case OP_LABEL:
+        return 1 + flow_label_size(g, i->symbol) + LITERAL_LEN(")\n");
+    case OP_GOTO:
+        return 1 + flow_label_size(g, i->symbol) + LITERAL_LEN("\n0;JMP\n");
+    case OP_IF_GOTO:
+        return LITERAL_LEN(HACK_POP_D "@") + flow_label_size(g, i->symbol)
+            + LITERAL_LEN("\nD;JNE\n");
+    case OP_FUNCTION: {
+        g->function = i->symbol;
+        g->function_start = index;
+        size_t size = 1 + symbol_length(g->st, i->symbol) + LITERAL_LEN(")\n");
+        if (i->number > 0)
+            size += FUNCTION_LOCALS_HEAD_TEMPLATE.len
+                + i->number * FUNCTION_LOCALS_BODY_TEMPLATE.len
+                + FUNCTION_LOCALS_TAIL_TEMPLATE.len;
+        return size;
+    }
+    case OP_CALL:
+        return 1 + generated_label_size(g, "call", index, "RET")
+            + CALL_SAVE_TEMPLATE.len
+            + 1 + hvm_uint_digits(i->number + 5) + CALL_REPOSITION_TEMPLATE.len
+            + 1 + symbol_length(g->st, i->symbol)
+            + LITERAL_LEN("\n0;JMP\n(")
+            + generated_label_size(g, "call", index, "RET")
+            + LITERAL_LEN(")\n");
+    case OP_RETURN:
+        return RETURN_TEMPLATE.len;
+    }
+    return 0;
+}
+
+static void emit_comparison(Codegen *g, Instruction *i, size_t index)
+{
+    int action = inst_action(i);
+    for (size_t k = 0; k < sizeof(COMPARISON_LABEL_SUFFIXES) / sizeof(char*); k++) {
+        emit_template(g->e, COMPARISON_TEMPLATES[k]);
+        if (COMPARISON_LABEL_SUFFIXES[k])
+            emit_generated_label(g, ARITHLOGIC_ACTION_STRINGS[action], index,
+                COMPARISON_LABEL_SUFFIXES[k]);
+        else
+            emit_str(g->e, ARITHLOGIC_ACTION_TABLE[action]);
+    }
+    emit_template(g->e, COMPARISON_TEMPLATES[sizeof(COMPARISON_LABEL_SUFFIXES)
+        / sizeof(char*)]);
+}
+
+static void emit_stack(Codegen *g, Instruction *i)
+{
+    Emitter *e = g->e;
+    switch (inst_segment(i)) {
+    case SEG_POINTER:
+        emit_template(e, i->opcode == OP_PUSH ?
+            PUSH_POINTER_TEMPLATES[i->number] : POP_POINTER_TEMPLATES[i->number]);
+        break;
+    case SEG_STATIC:
+        if (i->opcode == OP_POP)
+            emit_template(e, POP_STATIC_HEAD_TEMPLATE);
+        else
+            emit_char(e, '@');
+        emit_bytes(e, g->module, g->module_len);
+        emit_char(e, '.');
+        hvm_emit_uint(e, i->number);
+        if (i->opcode == OP_POP)
+            emit_literal(e, "\nM=D\n");
+        else
+            emit_template(e, PUSH_STATIC_TAIL_TEMPLATE);
+        break;
+    default:
+        emit_char(e, '@');
+        hvm_emit_uint(e, i->number);
+        emit_template(e, i->opcode == OP_PUSH ?
+            PUSH_TAIL_TEMPLATES[i->segment] : POP_TAIL_TEMPLATES[i->segment]);
+        break;
+    }
+}
+
+// Emits Hack code for instruction number 'index' of the translation.
+// Space must already be reserved, see instruction_size.
+static void emit_instruction(Codegen *g, Instruction *i, size_t index)
+{
+    Emitter *e = g->e;
+    switch (i->opcode) {
+    case OP_EQ:
+    case OP_GT:
+    case OP_LT:
+        emit_comparison(g, i, index);
+        break;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_NEG:
+    case OP_AND:
+    case OP_OR:
+    case OP_NOT:
+        emit_template(e, ARITHLOGIC_TEMPLATES[inst_action(i)]);
+        break;
+    case OP_PUSH:
+    case OP_POP:
+        emit_stack(g, i);
+        break;
+    case OP_LABEL:
+        emit_char(e, '(');
+        emit_flow_label(g, i->symbol);
+        emit_literal(e, ")\n");
+        break;
+    case OP_GOTO:
+        emit_char(e, '@');
+        emit_flow_label(g, i->symbol);
+        emit_literal(e, "\n0;JMP\n");
+        break;
+    case OP_IF_GOTO:
+        emit_literal(e, HACK_POP_D "@");
+        emit_flow_label(g, i->symbol);
+        emit_literal(e, "\nD;JNE\n");
+        break;
+    case OP_FUNCTION:
+        g->function = i->symbol;
+        g->function_start = index;
+        emit_char(e, '(');
+        emit_symbol(g, i->symbol);
+        emit_literal(e, ")\n");
+        if (i->number > 0) {
+            emit_template(e, FUNCTION_LOCALS_HEAD_TEMPLATE);
+            for (int k = 0; k < i->number; k++)
+                emit_template(e, FUNCTION_LOCALS_BODY_TEMPLATE);
+            emit_template(e, FUNCTION_LOCALS_TAIL_TEMPLATE);
+        }
+        break;
+    case OP_CALL:
+        emit_char(e, '@');
+        emit_generated_label(g, "call", index, "RET");
+        emit_template(e, CALL_SAVE_TEMPLATE);
+        emit_char(e, '@');
+        hvm_emit_uint(e, i->number + 5);
+        emit_template(e, CALL_REPOSITION_TEMPLATE);
+        emit_char(e, '@');
+        emit_symbol(g, i->symbol);
+        emit_literal(e, "\n0;JMP\n(");
+        emit_generated_label(g, "call", index, "RET");
+        emit_literal(e, ")\n");
+        break;
+    case OP_RETURN:
+        emit_template(e, RETURN_TEMPLATE);
+        break;
+    }
+}
+
+// A run of instructions sized and emitted by one pool task
+typedef struct {
+    Instruction *instructions;
+    size_t first;
+    size_t end;
+    Symbol_Table *st;
+    char *module;
+    size_t module_len;
+    int function_labels;
+    uint32_t last_function; // Last function declared in the run, if any
+    size_t last_function_start;
+    uint32_t function; // Function enclosing the start of the run
+    size_t function_start;
+    size_t size;
+    size_t offset; // Where the run's output starts
+    char *output;
+} Codegen_Chunk;
+
+static void find_last_function(void *arg, size_t index)
+{
+    Codegen_Chunk *c = (Codegen_Chunk*) arg + index;
+    c->last_function = NO_SYMBOL;
+    for (size_t k = c->end; k > c->first; k--) {
+        if (c->instructions[k - 1].opcode == OP_FUNCTION) {
+            c->last_function = c->instructions[k - 1].symbol;
+            c->last_function_start = k - 1;
+            break;
+        }
+    }
+}
+
+static void size_codegen_chunk(void *arg, size_t index)
+{
+    Codegen_Chunk *c = (Codegen_Chunk*) arg + index;
+    Codegen g = {
+        .e = NULL,
+        .st = c->st,
+        .module = c->module,
+        .module_len = c->module_len,
+        .function = c->function,
+        .function_start = c->function_start,
+        .function_labels = c->function_labels
+    };
+
+    c->size = 0;
+    for (size_t k = c->first; k < c->end; k++) {
+        Instruction *i = c->instructions + k;
+#if GENERATE_HEADER_COMMENTS == 1
+        c->size += instruction_comment_size(&g, i);
+#endif
+        c->size += instruction_size(&g, i, k);
+    }
+}
+
+static void emit_codegen_chunk(void *arg, size_t index)
+{
+    Codegen_Chunk *c = (Codegen_Chunk*) arg + index;
+
+    // Exactly sized window into the shared output
+    Emitter e = {
+        .buf = c->output + c->offset,
+        .len = 0,
+        .capacity = c->size
+    };
+    Codegen g = {
+        .e = &e,
+        .st = c->st,
+        .module = c->module,
+        .module_len = c->module_len,
+        .function = c->function,
+        .function_start = c->function_start,
+        .function_labels = c->function_labels
+    };
+
+    for (size_t k = c->first; k < c->end; k++) {
+        Instruction *i = c->instructions + k;
+#if GENERATE_HEADER_COMMENTS == 1
+        emit_instruction_comment(&g, i);
+#endif
+        emit_instruction(&g, i, k);
+        // Sizing and emitting disagree, debug builds catch it at the first
+        // instruction that runs into the next chunk's window
+        assert(e.len <= c->size);
+    }
+    assert(e.len == c->size);
+}
+
+// Sizes the output of all instructions exactly, allocates it once and
+// emits it without further checks. With more than one thread, runs of
+// instructions are sized and emitted in parallel at precomputed offsets,
+// giving the same bytes as a serial run. Returns NULL if out of memory.
+static char *generate_code(Instruction *instructions, size_t count,
+    Symbol_Table *st, char *module_name, Hvm_Options *options,
+    size_t *output_size)
+{
+    int thread_count = options->thread_count;
+    size_t chunk_count = thread_count > 1 ?
+        (size_t) thread_count * CHUNKS_PER_THREAD : 1;
+    if (chunk_count > count)
+        chunk_count = count ? count : 1;
+
+    Codegen_Chunk *chunks = hvm_malloc(chunk_count * sizeof(Codegen_Chunk),
+        HVM_MEM_OTHER);
+    if (!chunks)
+        return NULL;
+
+    for (size_t c = 0; c < chunk_count; c++) {
+        chunks[c] = (Codegen_Chunk) {
+            .instructions = instructions,
+            .first = count * c / chunk_count,
+            .end = count * (c + 1) / chunk_count,
+            .st = st,
+            .module = module_name,
+            .module_len = strlen(module_name),
+            .function_labels = options->function_labels,
+            .function = NO_SYMBOL,
+            .function_start = 0
+        };
+    }
+
+    // Each run starts inside the last function declared before it
+    hvm_pool_run(thread_count, chunk_count, find_last_function, chunks);
+    for (size_t c = 1; c < chunk_count; c++) {
+        Codegen_Chunk *prev = chunks + c - 1;
+        if (prev->last_function != NO_SYMBOL) {
+            chunks[c].function = prev->last_function;
+            chunks[c].function_start = prev->last_function_start;
+        } else {
+            chunks[c].function = prev->function;
+            chunks[c].function_start = prev->function_start;
+        }
+    }
+
+    // Sizing pass, so the output is allocated once at its final size
+    hvm_pool_run(thread_count, chunk_count, size_codegen_chunk, chunks);
+    size_t size = 0;
+    for (size_t c = 0; c < chunk_count; c++) {
+        chunks[c].offset = size;
+        size += chunks[c].size;
+    }
+
+    char *output = hvm_malloc(size + 1, HVM_MEM_OUTPUT);
+    if (!output) {
+        hvm_free(chunks);
+        return NULL;
+    }
+
+    for (size_t c = 0; c < chunk_count; c++)
+        chunks[c].output = output;
+    hvm_pool_run(thread_count, chunk_count, emit_codegen_chunk, chunks);
+    output[size] = '\0';
+
+    hvm_free(chunks);
+    *output_size = size;
+    return output;
+}
+
+// Parses 'input_buf', splitting inputs of at least PARALLEL_PARSE_MIN_SIZE
+// bytes across threads. Returns the effective thread count.
+static int parse_input(char *input_buf, size_t input_size, Symbol_Table *st,
+    Hvm_Options *options, Parse_Output *p)
+{
+    int thread_count = input_size < PARALLEL_PARSE_MIN_SIZE ? 1
+        : options->thread_count;
+
+    *p = thread_count > 1 ?
+        parse_instructions_parallel(input_buf, input_size, st, thread_count)
+        : parse_instructions(input_buf, input_size, st);
+    return thread_count;
+}
+
+// Fails to compile if the public counts don't match the enums
+typedef char opcode_count_check[HVM_OPCODE_COUNT == OPCODE_COUNT ? 1 : -1];
+typedef char segment_count_check[HVM_SEGMENT_COUNT == SEGMENT_COUNT ? 1 : -1];
+
+char *hvm_opcode_name(int opcode)
+{
+    static char *const *const ACTION_STRINGS[] = {
+        [INST_ARITHLOGIC] = ARITHLOGIC_ACTION_STRINGS,
+        [INST_STACK] = STACK_ACTION_STRINGS,
+        [INST_FLOW] = FLOW_ACTION_STRINGS,
+        [INST_FUNC] = FUNC_ACTION_STRINGS,
+    };
+
+    if (opcode < 0 || opcode >= OPCODE_COUNT)
+        return NULL;
+    Instruction i = { .opcode = (uint8_t) opcode };
+    return ACTION_STRINGS[inst_type(&i)][inst_action(&i)];
+}
+
+char *hvm_segment_name(int segment)
+{
+    if (segment < 0 || segment >= SEGMENT_COUNT)
+        return NULL;
+    return segment == SEG_NONE ? "none" : SEGMENT_STRINGS[segment];
+}
+
+// Adds the milliseconds since '*start' to '*total' and restarts the clock
+static void lap(double *total, double *start)
+{
+    double now = hvm_now_ms();
+    *total += now - *start;
+    *start = now;
+}
+
+// Counts lines of Hack code that are instructions, not labels or comments
+static size_t count_hack_instructions(char *buf, size_t size)
+{
+    size_t count = 0;
+    char *end = buf + size;
+    while (buf < end) {
+        char *newline = memchr(buf, '\n', end - buf);
+        char *line_end = newline ? newline : end;
+        if (line_end > buf && *buf != '(' && *buf != '/')
+            count++;
+        buf = line_end + 1;
+    }
+    return count;
+}
+
+// Adds the instructions translated and the code emitted for them to 's'
+static void count_translation(Hvm_Stats *s, Instruction *insts, size_t count,
+    char *output, size_t output_size)
+{
+    for (size_t k = 0; k < count; k++) {
+        s->opcodes[insts[k].opcode]++;
+        if (insts[k].segment != SEG_NONE)
+            s->segments[insts[k].segment]++;
+    }
+    if (output)
+        s->hack_instructions += count_hack_instructions(output, output_size);
+}
+
+// Counts the parsed instructions into the stats, then runs the IR passes
+// over them, leaving '*count'. Restarts '*clock', so codegen time leaves
+// out both. Returns an error message or NULL.
+static char *optimize_instructions(Instruction *insts, size_t *count,
+    Symbol_Table *st, unsigned passes, int whole_functions, Hvm_Stats *stats,
+    double *clock)
+{
+    if (stats)
+        count_translation(stats, insts, *count, NULL, 0);
+    char *error = hvm_run_ir_passes(passes, insts, count, st, whole_functions,
+        stats);
+    if (stats)
+        *clock = hvm_now_ms();
+    return error;
+}
+
+// Runs the Hack passes over all of 'output', keeping it terminated, and
+// counts the code left into the stats. Returns the new size.
+static size_t optimize_output(char *output, size_t size, unsigned passes,
+    Hvm_Stats *stats)
+{
+    size = hvm_run_hack_passes(passes, output, size, stats);
+    output[size] = '\0';
+    if (stats)
+        stats->hack_instructions += count_hack_instructions(output, size);
+    return size;
+}
+
+// Adds what passes did in 'from' to 'to'. Returns the time they took.
+static double add_pass_stats(Hvm_Stats *to, Hvm_Stats *from)
+{
+    double ms = 0;
+    for (int k = 0; k < HVM_PASS_COUNT; k++) {
+        to->pass_runs[k] += from->pass_runs[k];
+        to->pass_ms[k] += from->pass_ms[k];
+        to->pass_removed[k] += from->pass_removed[k];
+        to->pass_added[k] += from->pass_added[k];
+        ms += from->pass_ms[k];
+    }
+    return ms;
+}
+
+#define EMPTY_RESULT ((Hvm_Result) { \
+    .output = NULL, \
+    .output_size = 0, \
+    .instruction_count = 0, \
+    .error = NULL, \
+    .error_line = 0, \
+    .fragment_hits = 0, \
+    .fragment_misses = 0 \
+})
+
+// Translates VM code in 'input_buf' (followed by a '\0') into Hack assembly.
+// 'module_name' prefixes static variables and generated labels.
+static Hvm_Result translate(char *input_buf, size_t input_size,
+    char *module_name, Hvm_Options *options)
+{
+    Hvm_Result tr = EMPTY_RESULT;
+
+    // All symbol names of this translation live in one arena
+    Symbol_Table st;
+    hvm_symbol_table_init(&st);
+
+    Hvm_Stats *stats = options->stats;
+    double clock = stats ? hvm_now_ms() : 0;
+
+    Parse_Output p;
+    Hvm_Options o = *options;
+    o.thread_count = parse_input(input_buf, input_size, &st, options, &p);
+    if (stats)
+        lap(&stats->parse_ms, &clock);
+    if (p.error) {
+        hvm_symbol_table_free(&st);
+        tr.error = p.error;
+        tr.error_line = p.error_line;
+        return tr;
+    }
+
+    size_t count = p.instruction_count;
+    tr.error = optimize_instructions(p.instructions, &count, &st,
+        options->passes, 1, stats, &clock);
+    if (tr.error) {
+        hvm_free(p.instructions);
+        hvm_symbol_table_free(&st);
+        return tr;
+    }
+
+    size_t output_size;
+    char *output = generate_code(p.instructions, count, &st, module_name, &o,
+        &output_size);
+    if (stats)
+        lap(&stats->codegen_ms, &clock);
+    hvm_free(p.instructions);
+    hvm_symbol_table_free(&st);
+    if (!output) {
+        tr.error = "Out of memory\n";
+        return tr;
+    }
+    output_size = optimize_output(output, output_size, options->passes,
+        stats);
+
+    tr.instruction_count = p.instruction_count;
+    tr.output = output;
+    tr.output_size = output_size;
+    return tr;
+}
+
+uint64_t hvm_options_key(Hvm_Options *options)
+{
+    int function_labels = options->function_labels || options->fragment_cache;
+    return (uint64_t) OUTPUT_FORMAT_VERSION << 32
+        | (uint64_t) options->passes << 8
+        | (uint64_t) function_labels << 1
+        | (uint64_t) GENERATE_HEADER_COMMENTS;
+}
+
+// Code of one function, or of the instructions before the first one.
+// With function labels its output doesn't depend on where it sits in the
+// file, so it can be cached on its own.
+typedef struct {
+    Instruction *instructions;
+    size_t count;
+    Symbol_Table *st;
+    char *module;
+    Hvm_Options *options;
+    char *output;
+    size_t size;
+    int hit;
+    char *error;
+    Hvm_Stats pass_stats; // Only the pass counts are used
+} Fragment;
+
+// Key of a fragment: its instructions with symbol names instead of ids
+static uint64_t fragment_key(Fragment *f, uint64_t options)
+{
+    uint64_t h = 0;
+    for (size_t k = 0; k < f->count; k++) {
+        Instruction *i = f->instructions + k;
+        uint32_t word = i->opcode | i->segment << 8 | (uint32_t) i->number << 16;
+        h = hvm_hash_bytes(h, &word, sizeof(word));
+        if (i->symbol != NO_SYMBOL)
+            h = hvm_hash_bytes(h, symbol_name(f->st, i->symbol),
+                symbol_length(f->st, i->symbol) + 1); // Name and its '\0'
+    }
+    h = hvm_hash_bytes(h, f->module, strlen(f->module));
+    return hvm_hash_bytes(h, &options, sizeof(options));
+}
+
+static void translate_fragment(void *arg, size_t index)
+{
+    Fragment *f = (Fragment*) arg + index;
+    Hvm_Fragment_Cache *cache = f->options->fragment_cache;
+    uint64_t key = fragment_key(f, hvm_options_key(f->options));
+
+    f->output = cache->lookup(cache->arg, key, &f->size);
+    if (f->output) {
+        f->hit = 1;
+        return;
+    }
+
+    // Passes only look inside functions, so a fragment optimizes alone
+    Hvm_Options o = *f->options;
+    o.thread_count = 1;
+    o.function_labels = 1;
+    Hvm_Stats *stats = o.stats ? &f->pass_stats : NULL;
+    size_t count = f->count;
+    f->error = hvm_run_ir_passes(o.passes, f->instructions, &count, f->st, 1,
+        stats);
+    if (f->error)
+        return;
+    f->output = generate_code(f->instructions, count, f->st, f->module, &o,
+        &f->size);
+    if (!f->output)
+        return;
+    f->size = hvm_run_hack_passes(o.passes, f->output, f->size, stats);
+    f->output[f->size] = '\0';
+    cache->store(cache->arg, key, f->output, f->size);
+}
+
+// Same output as translate with function labels, but splits the parsed
+// file at function declarations and only generates code for functions
+// not found in the options' fragment cache
+static Hvm_Result translate_incremental(char *input_buf, size_t input_size,
+    char *module_name, Hvm_Options *options)
+{
+    Hvm_Result tr = EMPTY_RESULT;
+
+    Symbol_Table st;
+    hvm_symbol_table_init(&st);
+
+    Hvm_Stats *stats = options->stats;
+    double clock = stats ? hvm_now_ms() : 0;
+
+    Parse_Output p;
+    parse_input(input_buf, input_size, &st, options, &p);
+    if (stats)
+        lap(&stats->parse_ms, &clock);
+    if (p.error) {
+        hvm_symbol_table_free(&st);
+        tr.error = p.error;
+        tr.error_line = p.error_line;
+        return tr;
+    }
+
+    if (stats)
+        count_translation(stats, p.instructions, p.instruction_count, NULL, 0);
+
+    // A new fragment starts at every function declaration
+    size_t fragment_count = 1;
+    for (size_t k = 1; k < p.instruction_count; k++)
+        fragment_count += p.instructions[k].opcode == OP_FUNCTION;
+
+    Fragment *fragments = hvm_calloc(fragment_count, sizeof(Fragment),
+        HVM_MEM_OTHER);
+    size_t f = 0;
+    for (size_t k = 0; k < p.instruction_count; k++) {
+        if (k > 0 && p.instructions[k].opcode == OP_FUNCTION)
+            f++;
+        if (fragments[f].count++ == 0)
+            fragments[f].instructions = p.instructions + k;
+    }
+    for (f = 0; f < fragment_count; f++) {
+        fragments[f].st = &st;
+        fragments[f].module = module_name;
+        fragments[f].options = options;
+    }
+
+    hvm_pool_run(options->thread_count, fragment_count, translate_fragment,
+        fragments);
+
+    // Splice fragments together
+    size_t size = 0;
+    for (f = 0; f < fragment_count; f++) {
+        if (!fragments[f].output && !tr.error)
+            tr.error = fragments[f].error ? fragments[f].error
+                : "Out of memory\n";
+        size += fragments[f].size;
+        tr.fragment_hits += fragments[f].hit;
+        tr.fragment_misses += !fragments[f].hit;
+    }
+
+    char *output = tr.error ? NULL : hvm_malloc(size + 1, HVM_MEM_OUTPUT);
+    if (output) {
+        size_t offset = 0;
+        for (f = 0; f < fragment_count; f++) {
+            memcpy(output + offset, fragments[f].output, fragments[f].size);
+            offset += fragments[f].size;
+        }
+        output[size] = '\0';
+
+        tr.instruction_count = p.instruction_count;
+        tr.output = output;
+        tr.output_size = size;
+        if (stats) {
+            lap(&stats->codegen_ms, &clock);
+            for (f = 0; f < fragment_count; f++)
+                stats->codegen_ms -= add_pass_stats(stats,
+                    &fragments[f].pass_stats);
+            stats->hack_instructions += count_hack_instructions(output, size);
+        }
+    } else if (!tr.error) {
+        tr.error = "Out of memory\n";
+    }
+
+    for (f = 0; f < fragment_count; f++)
+        hvm_free(fragments[f].output);
+    hvm_free(fragments);
+    hvm_free(p.instructions);
+    hvm_symbol_table_free(&st);
+    return tr;
+}
+
+// Inputs are parsed with a '\0' right after them. Returns 'buf' itself if
+// the caller guarantees one, else a terminated copy or NULL.
+static char *terminated_input(char *buf, size_t size, Hvm_Options *options)
+{
+    if (options->terminated_input)
+        return buf;
+
+    char *copy = hvm_malloc(size + 1, HVM_MEM_IO);
+    if (copy) {
+        memcpy(copy, buf, size);
+        copy[size] = '\0';
+    }
+    return copy;
+}
+
+Hvm_Result hvm_translate(char *buf, size_t size, char *module,
+    Hvm_Options *options)
+{
+    Hvm_Options defaults = HVM_OPTIONS_DEFAULT;
+    if (!options)
+        options = &defaults;
+
+    Hvm_Result r = EMPTY_RESULT;
+    char *input = terminated_input(buf, size, options);
+    if (!input) {
+        r.error = "Out of memory\n";
+        return r;
+    }
+
+    if (options->fragment_cache)
+        r = translate_incremental(input, size, module, options);
+    else
+        r = translate(input, size, module, options);
+
+    if (input != buf)
+        hvm_free(input);
+    return r;
+}
+
+// Emits code for 'count' instructions in runs of SINK_BLOCK_SIZE into one
+// reused buffer, so output never has to be held in full. Instruction k is
+// number 'first_index' + k of the translation. 'g' carries the enclosing
+// function, and code the Hack passes held back, from call to call; see
+// flush_sink. Emitted code is counted into 'stats' unless it's NULL.
+// Returns an error message or NULL.
+static char *emit_to_sink(Codegen *g, Instruction *instructions, size_t count,
+    size_t first_index, Hvm_Sink sink, void *sink_arg, size_t *output_size,
+    Hvm_Stats *stats)
+{
+    for (size_t first = 0; first < count; first += SINK_BLOCK_SIZE) {
+        size_t end = first + SINK_BLOCK_SIZE < count ? first + SINK_BLOCK_SIZE
+            : count;
+
+        // Size on a copy, the sizing pass tracks functions too
+        Codegen sizing = *g;
+        size_t size = 0;
+        for (size_t k = first; k < end; k++) {
+#if GENERATE_HEADER_COMMENTS == 1
+            size += instruction_comment_size(&sizing, instructions + k);
+#endif
+            size += instruction_size(&sizing, instructions + k, first_index + k);
+        }
+
+        g->e->len = g->held;
+        if (emit_reserve(g->e, size) != 0)
+            return "Out of memory\n";
+
+        for (size_t k = first; k < end; k++) {
+#if GENERATE_HEADER_COMMENTS == 1
+            emit_instruction_comment(g, instructions + k);
+#endif
+            emit_instruction(g, instructions + k, first_index + k);
+        }
+
+        // The caller's codegen time includes the passes, take them out
+        size_t len = g->e->len;
+        g->held = 0;
+        if (g->passes) {
+            double pass_ms = 0;
+            for (int k = 0; stats && k < HVM_PASS_COUNT; k++)
+                pass_ms -= stats->pass_ms[k];
+            len = hvm_run_hack_passes(g->passes, g->e->buf, len, stats);
+            g->held = hvm_hack_passes_held(g->passes, g->e->buf, len);
+            for (int k = 0; stats && k < HVM_PASS_COUNT; k++)
+                pass_ms += stats->pass_ms[k];
+            if (stats)
+                stats->codegen_ms -= pass_ms;
+        }
+
+        len -= g->held;
+        if (stats)
+            stats->hack_instructions += count_hack_instructions(g->e->buf, len);
+        if (sink(sink_arg, g->e->buf, len) != 0)
+            return "Output sink failed\n";
+        *output_size += len;
+        memmove(g->e->buf, g->e->buf + len, g->held);
+    }
+
+    return NULL;
+}
+
+// Sends code the Hack passes held back at the end of the output
+static char *flush_sink(Codegen *g, Hvm_Sink sink, void *sink_arg,
+    size_t *output_size, Hvm_Stats *stats)
+{
+    if (!g->held)
+        return NULL;
+    if (stats)
+        stats->hack_instructions += count_hack_instructions(g->e->buf,
+            g->held);
+    if (sink(sink_arg, g->e->buf, g->held) != 0)
+        return "Output sink failed\n";
+    *output_size += g->held;
+    g->held = 0;
+    return NULL;
+}
+
+static Hvm_Result translate_to_sink(char *input_buf, size_t input_size,
+    char *module_name, Hvm_Options *options, Hvm_Sink sink, void *sink_arg)
+{
+    Hvm_Result tr = EMPTY_RESULT;
+
+    Symbol_Table st;
+    hvm_symbol_table_init(&st);
+
+    Hvm_Stats *stats = options->stats;
+    double clock = stats ? hvm_now_ms() : 0;
+
+    Parse_Output p = parse_instructions(input_buf, input_size, &st);
+    if (stats)
+        lap(&stats->parse_ms, &clock);
+    if (p.error) {
+        hvm_symbol_table_free(&st);
+        tr.error = p.error;
+        tr.error_line = p.error_line;
+        return tr;
+    }
+
+    size_t count = p.instruction_count;
+    tr.error = optimize_instructions(p.instructions, &count, &st,
+        options->passes, 1, stats, &clock);
+    if (tr.error) {
+        hvm_free(p.instructions);
+        hvm_symbol_table_free(&st);
+        return tr;
+    }
+
+    Emitter e = EMITTER_INIT;
+    Codegen g = {
+        .e = &e,
+        .st = &st,
+        .module = module_name,
+        .module_len = strlen(module_name),
+        .function = NO_SYMBOL,
+        .function_start = 0,
+        .function_labels = options->function_labels,
+        .passes = options->passes,
+        .held = 0
+    };
+
+    tr.error = emit_to_sink(&g, p.instructions, count, 0, sink, sink_arg,
+        &tr.output_size, stats);
+    if (!tr.error)
+        tr.error = flush_sink(&g, sink, sink_arg, &tr.output_size, stats);
+    if (!tr.error)
+        tr.instruction_count = p.instruction_count;
+    if (stats)
+        lap(&stats->codegen_ms, &clock);
+
+    hvm_emitter_free(&e);
+    hvm_free(p.instructions);
+    hvm_symbol_table_free(&st);
+    return tr;
+}
+
+Hvm_Result hvm_translate_to_sink(char *buf, size_t size, char *module,
+    Hvm_Options *options, Hvm_Sink sink, void *sink_arg)
+{
+    Hvm_Options defaults = HVM_OPTIONS_DEFAULT;
+    if (!options)
+        options = &defaults;
+
+    // Parallel and incremental translation assemble the output in one piece
+    if (options->fragment_cache || (options->thread_count > 1
+        && size >= PARALLEL_PARSE_MIN_SIZE)) {
+        Hvm_Result r = hvm_translate(buf, size, module, options);
+        if (!r.error && sink(sink_arg, r.output, r.output_size) != 0)
+            r.error = "Output sink failed\n";
+        hvm_free(r.output);
+        r.output = NULL;
+        return r;
+    }
+
+    Hvm_Result r = EMPTY_RESULT;
+    char *input = terminated_input(buf, size, options);
+    if (!input) {
+        r.error = "Out of memory\n";
+        return r;
+    }
+
+    r = translate_to_sink(input, size, module, options, sink, sink_arg);
+
+    if (input != buf)
+        hvm_free(input);
+    return r;
+}
+
+Hvm_Result hvm_compile_object(char *buf, size_t size, Hvm_Options *options)
+{
+    Hvm_Options defaults = HVM_OPTIONS_DEFAULT;
+    if (!options)
+        options = &defaults;
+
+    Hvm_Result r = EMPTY_RESULT;
+    char *input = terminated_input(buf, size, options);
+    if (!input) {
+        r.error = "Out of memory\n";
+        return r;
+    }
+
+    Hvm_Stats *stats = options->stats;
+    double clock = stats ? hvm_now_ms() : 0;
+
+    Symbol_Table st;
+    hvm_symbol_table_init(&st);
+    Parse_Output p;
+    parse_input(input, size, &st, options, &p);
+    if (input != buf)
+        hvm_free(input);
+    if (stats)
+        lap(&stats->parse_ms, &clock);
+    if (p.error) {
+        hvm_symbol_table_free(&st);
+        r.error = p.error;
+        r.error_line = p.error_line;
+        return r;
+    }
+
+    r.output = hvm_write_object(p.instructions, p.instruction_count, &st,
+        &r.output_size);
+    if (stats) {
+        lap(&stats->codegen_ms, &clock);
+        count_translation(stats, p.instructions, p.instruction_count, NULL, 0);
+    }
+    hvm_free(p.instructions);
+    hvm_symbol_table_free(&st);
+    if (!r.output) {
+        r.error = "Out of memory\n";
+        return r;
+    }
+
+    r.instruction_count = p.instruction_count;
+    return r;
+}
+
+Hvm_Result hvm_translate_object(char *buf, size_t size, char *module,
+    Hvm_Options *options)
+{
+    Hvm_Options o = options ? *options : HVM_OPTIONS_DEFAULT;
+    Hvm_Result r = EMPTY_RESULT;
+
+    // Labels are numbered the way the fragment cache would number them,
+    // so the output matches the options key either way
+    o.function_labels = o.function_labels || o.fragment_cache;
+    if (size < PARALLEL_PARSE_MIN_SIZE)
+        o.thread_count = 1;
+
+    Hvm_Stats *stats = o.stats;
+    double clock = stats ? hvm_now_ms() : 0;
+
+    Symbol_Table st;
+    hvm_symbol_table_init(&st);
+    Object_View v;
+    r.error = hvm_read_object(buf, size, &st, &v);
+    if (stats)
+        lap(&stats->parse_ms, &clock);
+    if (r.error) {
+        hvm_symbol_table_free(&st);
+        return r;
+    }
+
+    // Passes rewrite instructions in place, not in the caller's object
+    Instruction *insts = v.instructions;
+    size_t count = v.count;
+    if (o.passes && !v.copy) {
+        insts = hvm_malloc((count ? count : 1) * sizeof(Instruction),
+            HVM_MEM_INSTRUCTIONS);
+        if (insts)
+            memcpy(insts, v.instructions, count * sizeof(Instruction));
+        else
+            r.error = "Out of memory\n";
+    }
+    if (!r.error)
+        r.error = optimize_instructions(insts, &count, &st, o.passes, 1,
+            stats, &clock);
+
+    if (!r.error) {
+        r.output = generate_code(insts, count, &st, module, &o,
+            &r.output_size);
+        if (stats)
+            lap(&stats->codegen_ms, &clock);
+        if (r.output)
+            r.output_size = optimize_output(r.output, r.output_size, o.passes,
+                stats);
+        else
+            r.error = "Out of memory\n";
+    }
+    r.instruction_count = v.count;
+    if (insts != v.instructions)
+        hvm_free(insts);
+    hvm_free_object_view(&v);
+    hvm_symbol_table_free(&st);
+    return r;
+}
+
+void hvm_free_result(Hvm_Result *r)
+{
+    hvm_free(r->output);
+    r->output = NULL;
+    r->output_size = 0;
+}
+
+// State carried from one chunk of a stream to the next
+typedef struct {
+    Hvm_Result result;
+    size_t line_base; // Lines before the chunk
+    char *function; // Name of the enclosing function, or NULL
+    size_t function_len;
+    size_t function_start;
+    unsigned passes;
+    Hvm_Stats *stats; // NULL if not measuring
+    size_t emitted; // Instructions left by the passes and emitted
+    // Instructions the IR passes held back for the next chunk. Their
+    // symbols are offsets of '\0'-terminated names in 'held_names'.
+    Instruction *held;
+    size_t held_count;
+    char *held_names;
+    size_t held_names_len;
+} Stream_State;
+
+// Puts the instructions held back by the last chunk in front of the 'count'
+// in '*insts', interning their names in 'st'. Returns 1 if out of memory,
+// with '*insts' still valid.
+static int take_held_instructions(Stream_State *ss, Instruction **insts,
+    size_t count, Symbol_Table *st)
+{
+    if (ss->held_count == 0)
+        return 0;
+    Instruction *all = hvm_realloc(*insts,
+        (ss->held_count + count) * sizeof(Instruction), HVM_MEM_INSTRUCTIONS);
+    if (!all)
+        return 1;
+    *insts = all;
+    memmove(all + ss->held_count, all, count * sizeof(Instruction));
+    for (size_t k = 0; k < ss->held_count; k++) {
+        all[k] = ss->held[k];
+        if (all[k].symbol == NO_SYMBOL)
+            continue;
+        char *name = ss->held_names + all[k].symbol;
+        all[k].symbol = hvm_intern_symbol(st, name, strlen(name));
+        if (all[k].symbol == NO_SYMBOL)
+            return 1;
+    }
+    ss->held_count = 0;
+    ss->held_names_len = 0;
+    return 0;
+}
+
+// Keeps the 'count' instructions at 'insts', named through 'st', for the
+// next chunk. Returns 1 if out of memory.
+static int hold_instructions(Stream_State *ss, Instruction *insts,
+    size_t count, Symbol_Table *st)
+{
+    size_t names_len = 0;
+    for (size_t k = 0; k < count; k++)
+        if (insts[k].symbol != NO_SYMBOL)
+            names_len += symbol_length(st, insts[k].symbol) + 1;
+
+    Instruction *held = hvm_realloc(ss->held, count * sizeof(Instruction),
+        HVM_MEM_INSTRUCTIONS);
+    if (held)
+        ss->held = held;
+    char *names = hvm_realloc(ss->held_names, names_len, HVM_MEM_SYMBOLS);
+    if (names)
+        ss->held_names = names;
+    if (!held || !names)
+        return 1;
+
+    size_t len = 0;
+    for (size_t k = 0; k < count; k++) {
+        held[k] = insts[k];
+        if (insts[k].symbol == NO_SYMBOL)
+            continue;
+        size_t name_len = symbol_length(st, insts[k].symbol);
+        memcpy(names + len, symbol_name(st, insts[k].symbol), name_len);
+        names[len + name_len] = '\0';
+        held[k].symbol = (uint32_t) len;
+        len += name_len + 1;
+    }
+    ss->held_count = count;
+    ss->held_names_len = len;
+    return 0;
+}
+
+// Translates the complete lines in 'buf' (followed by a '\0') with a symbol
+// table of their own. Unless it's the 'last' chunk, instructions the IR
+// passes could still combine with the next chunk's are held back for it,
+// so the passes see what they'd see in the whole input. Returns 1 on error.
+static int translate_stream_chunk(Stream_State *ss, char *buf, size_t size,
+    int last, Codegen *g, Hvm_Sink sink, void *sink_arg)
+{
+    Hvm_Result *r = &ss->result;
+    double clock = ss->stats ? hvm_now_ms() : 0;
+
+    Symbol_Table st;
+    hvm_symbol_table_init(&st);
+
+    Line_Index li;
+    if (hvm_build_line_index(buf, size, &li) != 0) {
+        r->error = "Out of memory\n";
+        return 1;
+    }
+
+    // The function name goes in first, so its id survives the parse
+    g->st = &st;
+    g->function = NO_SYMBOL;
+    g->function_start = ss->function_start;
+    if (ss->function)
+        g->function = hvm_intern_symbol(&st, ss->function, ss->function_len);
+
+    Parse_Output p = parse_lines(buf, &li, 0, li.count, &st);
+    if (ss->stats)
+        lap(&ss->stats->parse_ms, &clock);
+    if (p.error) {
+        r->error = p.error;
+        r->error_line = ss->line_base + p.error_line;
+    } else {
+        if (ss->stats)
+            count_translation(ss->stats, p.instructions, p.instruction_count,
+                NULL, 0);
+        // Held instructions were counted with the chunk they came from
+        size_t count = p.instruction_count + ss->held_count;
+        if (take_held_instructions(ss, &p.instructions, p.instruction_count,
+            &st) != 0)
+            r->error = "Out of memory\n";
+        if (!r->error)
+            r->error = hvm_run_ir_passes(ss->passes, p.instructions, &count,
+                &st, 0, ss->stats);
+        if (ss->stats)
+            clock = hvm_now_ms();
+
+        size_t held = 0;
+        if (!r->error && !last) {
+            held = hvm_ir_passes_held(ss->passes, p.instructions, count);
+            if (held > STREAM_HELD_MAX)
+                held = STREAM_HELD_MAX;
+            if (hold_instructions(ss, p.instructions + count - held, held,
+                &st) != 0)
+                r->error = "Out of memory\n";
+        }
+
+        // Chunks may split functions. Labels stay unique, and match those
+        // of a whole translation, as they're numbered from the
+        // instructions emitted before the chunk.
+        if (!r->error)
+            r->error = emit_to_sink(g, p.instructions, count - held,
+                ss->emitted, sink, sink_arg, &r->output_size, ss->stats);
+        ss->emitted += count - held;
+        r->instruction_count += p.instruction_count;
+        if (ss->stats)
+            lap(&ss->stats->codegen_ms, &clock);
+    }
+    ss->line_base += li.count;
+
+    // Keep the enclosing function by name, ids die with the table
+    if (!r->error && g->function != NO_SYMBOL) {
+        size_t len = symbol_length(&st, g->function);
+        char *name = hvm_realloc(ss->function, len, HVM_MEM_SYMBOLS);
+        if (name) {
+            memcpy(name, symbol_name(&st, g->function), len);
+            ss->function = name;
+            ss->function_len = len;
+            ss->function_start = g->function_start;
+        } else {
+            r->error = "Out of memory\n";
+        }
+    }
+
+    hvm_free(p.instructions);
+    hvm_free_line_index(&li);
+    hvm_symbol_table_free(&st);
+    return r->error != NULL;
+}
+
+Hvm_Result hvm_translate_stream(Hvm_Source source, void *source_arg,
+    char *module, Hvm_Options *options, Hvm_Sink sink, void *sink_arg)
+{
+    Hvm_Options defaults = HVM_OPTIONS_DEFAULT;
+    if (!options)
+        options = &defaults;
+
+    Stream_State ss = {
+        .result = EMPTY_RESULT,
+        .line_base = 0,
+        .function = NULL,
+        .function_len = 0,
+        .function_start = 0,
+        .passes = options->passes,
+        .stats = options->stats,
+        .emitted = 0,
+        .held = NULL,
+        .held_count = 0,
+        .held_names = NULL,
+        .held_names_len = 0
+    };
+
+    char *buf = hvm_malloc(STREAM_CHUNK_SIZE + 1, HVM_MEM_IO);
+    if (!buf) {
+        ss.result.error = "Out of memory\n";
+        return ss.result;
+    }
+
+    Emitter e = EMITTER_INIT;
+    Codegen g = {
+        .e = &e,
+        .st = NULL,
+        .module = module,
+        .module_len = strlen(module),
+        .function = NO_SYMBOL,
+        .function_start = 0,
+        .function_labels = options->function_labels || options->fragment_cache,
+        .passes = options->passes,
+        .held = 0
+    };
+
+    size_t len = 0; // Bytes in 'buf', starting with an unfinished line
+    int end_of_input = 0;
+    while (!end_of_input && !ss.result.error) {
+        // Chunks end where the buffer fills, not where reads happen to, so
+        // the output doesn't depend on how the input arrives
+        while (len < STREAM_CHUNK_SIZE) {
+            long n = source(source_arg, buf + len, STREAM_CHUNK_SIZE - len);
+            if (n < 0) {
+                ss.result.error = "Couldn't read input\n";
+                break;
+            }
+            if (n == 0) {
+                end_of_input = 1;
+                break;
+            }
+            len += (size_t) n;
+        }
+        if (ss.result.error)
+            break;
+
+        // Translate up to the last complete line, or everything at the end.
+        // A '\r' last in the buffer may be the start of "\r\n".
+        size_t done = len;
+        if (!end_of_input) {
+            while (done > 0 && buf[done - 1] != '\n'
+                && (buf[done - 1] != '\r' || done == len || buf[done] == '\n'))
+                done--;
+            if (done == 0) {
+                ss.result.error = "Line too long\n";
+                ss.result.error_line = ss.line_base + 1;
+                break;
+            }
+        }
+
+        char next = buf[done];
+        buf[done] = '\0';
+        if (translate_stream_chunk(&ss, buf, done, end_of_input, &g, sink,
+            sink_arg) != 0)
+            break;
+        buf[done] = next;
+
+        memmove(buf, buf + done, len - done);
+        len -= done;
+    }
+    if (!ss.result.error)
+        ss.result.error = flush_sink(&g, sink, sink_arg,
+            &ss.result.output_size, ss.stats);
+
+    hvm_emitter_free(&e);
+    hvm_free(ss.function);
+    hvm_free(ss.held);
+    hvm_free(ss.held_names);
+    hvm_free(buf);
+    return ss.result;
+}
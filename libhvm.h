@@ -0,0 +1,194 @@
+#ifndef LIBHVM_H
+#define LIBHVM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Translator library. Nothing here prints, touches files or keeps state
+// between calls, other than counts of memory in use, so any number of
+// threads can translate at once.
+
+// Caller's store of generated code for single functions, used to only
+// translate functions that changed. 'lookup' returns an hvm_malloc'd copy
+// of the code stored under 'key', followed by a '\0', or NULL. Both may be
+// called from several threads at once.
+typedef struct {
+    char *(*lookup)(void *arg, uint64_t key, size_t *size);
+    void (*store)(void *arg, uint64_t key, char *buf, size_t size);
+    void *arg;
+} Hvm_Fragment_Cache;
+
+#define HVM_OPCODE_COUNT                   17
+#define HVM_SEGMENT_COUNT                  9
+
+// Optimization passes. IR passes rewrite parsed instructions before code
+// is generated, Hack passes rewrite the generated code. Each one keeps
+// the meaning of the program.
+enum HVM_PASS {
+    HVM_PASS_FOLD = 0, // IR: folds constants, drops pairs that cancel out
+    HVM_PASS_UNREACHABLE, // IR: drops blocks no path in their function reaches
+    HVM_PASS_JUMPS, // IR: drops gotos to the label right after them
+    HVM_PASS_STACK, // Hack: turns a push straight into a pop into a move
+    HVM_PASS_COUNT
+};
+
+#define HVM_PASS_BIT(pass)                 (1u << (pass))
+
+// -O levels, each naming a set of passes
+enum HVM_LEVEL {
+    HVM_O0 = 0, // None, the output of the translator without passes
+    HVM_O1, // Passes that look at a few instructions at a time
+    HVM_O2, // Every pass
+    HVM_OS, // Every pass that makes code smaller, which is every pass
+    HVM_LEVEL_COUNT
+};
+
+// Measurements of a translation, added to the counts already there. Only
+// taken when asked for through Hvm_Options. Times are in milliseconds;
+// for sinks and streams, codegen includes the time spent in the sink.
+typedef struct {
+    double parse_ms; // Lexing and parsing, or checking an object
+    double codegen_ms;
+    size_t opcodes[HVM_OPCODE_COUNT]; // VM instructions by opcode
+    size_t segments[HVM_SEGMENT_COUNT]; // push and pop by segment
+    size_t hack_instructions; // Hack A- and C-instructions emitted
+    // By pass: times run (once per file, function or chunk), time taken
+    // and instructions removed and added, VM ones for IR passes and Hack
+    // ones for Hack passes. Pass time isn't part of codegen time.
+    size_t pass_runs[HVM_PASS_COUNT];
+    double pass_ms[HVM_PASS_COUNT];
+    size_t pass_removed[HVM_PASS_COUNT];
+    size_t pass_added[HVM_PASS_COUNT];
+} Hvm_Stats;
+
+typedef struct {
+    int thread_count; // Threads for splitting inputs of 4MB or more
+    int function_labels; // Number generated labels per function, not per file
+    int terminated_input; // buf[size] is a readable '\0', so it isn't copied
+    Hvm_Fragment_Cache *fragment_cache; // Implies function_labels, or NULL
+    Hvm_Stats *stats; // Filled in if not NULL
+    unsigned passes; // HVM_PASS_BIT of each pass to run, 0 for none
+} Hvm_Options;
+
+#define HVM_OPTIONS_DEFAULT ((Hvm_Options) { \
+    .thread_count = 1, \
+    .function_labels = 0, \
+    .terminated_input = 0, \
+    .fragment_cache = NULL, \
+    .stats = NULL, \
+    .passes = 0 \
+})
+
+typedef struct {
+    char *output; // Hack code followed by a '\0', NULL if sent to a sink
+    size_t output_size; // Excluding the '\0'
+    size_t instruction_count;
+    char *error; // Static message, NULL on success
+    size_t error_line; // Line of the error, 0 if not tied to one
+    int fragment_hits; // Functions found in the fragment cache
+    int fragment_misses;
+} Hvm_Result;
+
+// Receives output in order. Returns 0 to continue, anything else to stop.
+typedef int (*Hvm_Sink)(void *arg, char *buf, size_t size);
+
+// Translates 'size' bytes of VM code in 'buf' into Hack assembly.
+// 'module' prefixes static variables and generated labels, usually the
+// input's file name. 'options' may be NULL for the defaults.
+Hvm_Result hvm_translate(char *buf, size_t size, char *module,
+    Hvm_Options *options);
+
+// Same, but hands the output to 'sink' piece by piece instead of returning
+// it in one buffer
+Hvm_Result hvm_translate_to_sink(char *buf, size_t size, char *module,
+    Hvm_Options *options, Hvm_Sink sink, void *sink_arg);
+
+// Pulls up to 'size' bytes of input into 'buf'. Returns how many, 0 at the
+// end of input, or -1 on error.
+typedef long (*Hvm_Source)(void *arg, char *buf, size_t size);
+
+// Translates input pulled from 'source' a chunk of 1MB at a time, handing
+// output to 'sink' as it goes, so memory use doesn't grow with the input.
+// Generated labels are numbered across chunks exactly as hvm_translate
+// numbers them. Every line must fit in a chunk. Output sent before an
+// error stays sent. Threads and the fragment cache are not used, nor
+// passes that need whole functions, as chunks may split them.
+Hvm_Result hvm_translate_stream(Hvm_Source source, void *source_arg,
+    char *module, Hvm_Options *options, Hvm_Sink sink, void *sink_arg);
+
+// Parses VM code into a binary object, returned as the output. Objects
+// hold the instructions and names already parsed, see object.h. Passes
+// don't run, they run when the object is translated.
+Hvm_Result hvm_compile_object(char *buf, size_t size, Hvm_Options *options);
+
+// Translates an object from hvm_compile_object into exactly the code
+// hvm_translate gives for its source, without lexing anything. The object
+// is checked first and read in place. The fragment cache isn't used.
+Hvm_Result hvm_translate_object(char *buf, size_t size, char *module,
+    Hvm_Options *options);
+
+void hvm_free_result(Hvm_Result *r);
+
+// Names of the indices of Hvm_Stats.opcodes and Hvm_Stats.segments, as
+// written in VM code
+char *hvm_opcode_name(int opcode);
+char *hvm_segment_name(int segment);
+
+// Name of a pass, as in -fno-<name>, and the pass with a name, or -1
+char *hvm_pass_name(int pass);
+int hvm_find_pass(char *name);
+
+// What a pass's removed and added counts count: "vm" for VM instructions,
+// "hack" for Hack instructions
+char *hvm_pass_unit(int pass);
+
+// Whether a pass looks at whole functions, which a stream translated a
+// chunk at a time never has, so hvm_translate_stream skips it
+int hvm_pass_needs_functions(int pass);
+
+// Passes run at an -O level
+unsigned hvm_level_passes(int level);
+
+// What an allocation is for, to account memory by subsystem
+enum HVM_MEMORY {
+    HVM_MEM_IO = 0, // Input and output file buffers
+    HVM_MEM_LINES, // Line indexes of inputs
+    HVM_MEM_INSTRUCTIONS, // Parsed instruction arrays
+    HVM_MEM_SYMBOLS, // Symbol tables and their names
+    HVM_MEM_OUTPUT, // Generated code
+    HVM_MEM_ANALYSIS, // Control-flow graphs and dataflow sets
+    HVM_MEM_OTHER,
+    HVM_MEMORY_KIND_COUNT
+};
+
+// The library allocates through these, and so must callers for anything
+// they free that came from the library or hand to it to free, such as
+// outputs and fragment cache lookups. Other memory must go to free().
+void *hvm_malloc(size_t size, int kind);
+void *hvm_calloc(size_t count, size_t size, int kind);
+void *hvm_realloc(void *p, size_t size, int kind);
+void hvm_free(void *p);
+
+// Counts 'size' bytes of a mapped file as I/O memory in use, or no longer
+void hvm_count_mapping(size_t size);
+void hvm_count_unmapping(size_t size);
+
+// Memory allocated through the functions above, for the whole process
+typedef struct {
+    size_t current; // Bytes in use
+    size_t peak; // Most bytes in use at once
+    size_t allocations[HVM_MEMORY_KIND_COUNT]; // Reallocations count too
+    size_t bytes[HVM_MEMORY_KIND_COUNT]; // Total ever allocated
+} Hvm_Memory_Stats;
+
+void hvm_memory_stats(Hvm_Memory_Stats *m);
+
+// Zeroes the counts and lowers the peak to what is in use now
+void hvm_reset_memory_stats(void);
+
+char *hvm_memory_kind_name(int kind);
+
+// Word describing every option that changes the output, for cache keys
+uint64_t hvm_options_key(Hvm_Options *options);
+
+#endif // LIBHVM_H
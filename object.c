@@ -0,0 +1,158 @@
+#include <stdlib.h>
+#include <string.h>
+#include "object.h"
+#include "libhvm.h"
+
+// Fails to compile if the header isn't exactly 32 bytes
+typedef char object_header_size_check[sizeof(Object_Header) == 32 ? 1 : -1];
+
+#define LITTLE_ENDIAN_HOST (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+
+char *hvm_write_object(Instruction *insts, size_t count, Symbol_Table *st,
+    size_t *size)
+{
+    size_t names_size = 0;
+    for (uint32_t id = 0; id < st->count; id++)
+        names_size += symbol_length(st, id) + 1;
+
+    size_t insts_size = count * sizeof(Instruction);
+    size_t offsets_size = st->count * sizeof(uint32_t);
+    *size = sizeof(Object_Header) + insts_size + offsets_size + names_size;
+    char *buf = hvm_malloc(*size + 1, HVM_MEM_OUTPUT);
+    if (!buf)
+        return NULL;
+
+    Object_Header h = {
+        .version = OBJECT_VERSION,
+        .instruction_count = count,
+        .symbol_count = st->count,
+        .reserved = 0,
+        .names_size = names_size
+    };
+    memcpy(h.magic, OBJECT_MAGIC, sizeof(h.magic));
+    memcpy(buf, &h, sizeof(h));
+    memcpy(buf + sizeof(h), insts, insts_size);
+
+    uint32_t *offsets = (uint32_t*) (void*) (buf + sizeof(h) + insts_size);
+    char *names = buf + sizeof(h) + insts_size + offsets_size;
+    uint32_t offset = 0;
+    for (uint32_t id = 0; id < st->count; id++) {
+        uint32_t len = symbol_length(st, id);
+        offsets[id] = offset;
+        memcpy(names + offset, symbol_name(st, id), len + 1);
+        offset += len + 1;
+    }
+
+    buf[*size] = '\0';
+    return buf;
+}
+
+// Checks that 'i' is something the parser could have produced, so code
+// generation can trust it
+static int valid_instruction(Instruction *i, uint32_t symbol_count)
+{
+    if (i->opcode >= OPCODE_COUNT || i->segment >= SEGMENT_COUNT)
+        return 0;
+    if (i->symbol != NO_SYMBOL && i->symbol >= symbol_count)
+        return 0;
+
+    switch (OPCODE_TYPE[i->opcode]) {
+    case INST_ARITHLOGIC:
+        return i->segment == SEG_NONE && i->symbol == NO_SYMBOL;
+    case INST_STACK:
+        return i->segment != SEG_NONE && i->symbol == NO_SYMBOL
+            && !(i->segment == SEG_CONSTANT && i->opcode == OP_POP)
+            && !(i->segment == SEG_POINTER && i->number > 1);
+    case INST_FLOW:
+        return i->segment == SEG_NONE && i->symbol != NO_SYMBOL;
+    default:
+        return i->segment == SEG_NONE
+            && (i->opcode == OP_RETURN) == (i->symbol == NO_SYMBOL);
+    }
+}
+
+char *hvm_read_object(char *buf, size_t size, Symbol_Table *st, Object_View *v)
+{
+    v->instructions = NULL;
+    v->count = 0;
+    v->copy = NULL;
+
+    if (!LITTLE_ENDIAN_HOST)
+        return "Object files are only supported on little-endian hosts\n";
+
+    Object_Header h;
+    if (size < sizeof(h))
+        return "Object file truncated\n";
+    memcpy(&h, buf, sizeof(h));
+    if (memcmp(h.magic, OBJECT_MAGIC, sizeof(h.magic)) != 0)
+        return "Not an object file\n";
+    if (h.version != OBJECT_VERSION)
+        return "Object file version mismatch, recompile it\n";
+
+    // Sizes are checked one by one so none of the sums can overflow
+    size_t left = size - sizeof(h);
+    if (h.instruction_count > left / sizeof(Instruction))
+        return "Object file truncated\n";
+    size_t insts_size = h.instruction_count * sizeof(Instruction);
+    left -= insts_size;
+    if (h.symbol_count > left / sizeof(uint32_t))
+        return "Object file truncated\n";
+    size_t offsets_size = (size_t) h.symbol_count * sizeof(uint32_t);
+    left -= offsets_size;
+    if (h.names_size != left || h.names_size > UINT32_MAX || h.reserved != 0)
+        return "Object file corrupt\n";
+
+    char *insts = buf + sizeof(h);
+    char *offsets = insts + insts_size;
+    char *names = offsets + offsets_size;
+
+    // Names must be back to back, each ending at the first '\0'
+    uint32_t expected = 0;
+    for (uint32_t id = 0; id < h.symbol_count; id++) {
+        uint32_t offset;
+        memcpy(&offset, offsets + id * sizeof(uint32_t), sizeof(offset));
+        if (offset != expected || offset >= h.names_size)
+            return "Object file corrupt\n";
+        char *end = memchr(names + offset, '\0', h.names_size - offset);
+        if (!end)
+            return "Object file corrupt\n";
+        size_t len = end - (names + offset);
+        uint32_t interned = hvm_intern_symbol(st, names + offset, len);
+        if (interned == NO_SYMBOL)
+            return "Out of memory\n";
+        if (interned != id)
+            return "Object file corrupt\n"; // Repeated name
+        expected = offset + len + 1;
+    }
+    if (expected != h.names_size)
+        return "Object file corrupt\n";
+
+    // Used in place when aligned, as it is when mapped
+    Instruction *view = (Instruction*) (void*) insts;
+    if ((uintptr_t) insts % sizeof(uint32_t) != 0) { // Widest field
+        v->copy = hvm_malloc(insts_size, HVM_MEM_INSTRUCTIONS);
+        if (!v->copy)
+            return "Out of memory\n";
+        memcpy(v->copy, insts, insts_size);
+        view = v->copy;
+    }
+
+    for (size_t k = 0; k < h.instruction_count; k++) {
+        if (!valid_instruction(view + k, h.symbol_count)) {
+            hvm_free_object_view(v);
+            return "Object file corrupt\n";
+        }
+    }
+
+    v->instructions = view;
+    v->count = h.instruction_count;
+    return NULL;
+}
+
+void hvm_free_object_view(Object_View *v)
+{
+    hvm_free(v->copy);
+    v->copy = NULL;
+    v->instructions = NULL;
+    v->count = 0;
+}
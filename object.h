@@ -0,0 +1,51 @@
+#ifndef OBJECT_H
+#define OBJECT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "symbol.h"
+#include "hvm.h"
+
+// Object files ('.vmo') hold parsed VM code, so it can be translated again
+// without lexing. All fields are little-endian. Layout:
+//
+//     Object_Header
+//     Instruction[instruction_count]  same 8-byte layout as in memory
+//     uint32_t[symbol_count]          offset of each name in the names
+//     char[names_size]                names, each followed by a '\0'
+//
+// Symbol ids in the instructions index the names. Instructions start at
+// byte 32, so a mapped object can be used in place.
+#define OBJECT_MAGIC                       "HVMO"
+#define OBJECT_VERSION                     1 // Bump when the layout, the
+                                             // Instruction struct or the
+                                             // opcode and segment enums change
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t instruction_count;
+    uint32_t symbol_count;
+    uint32_t reserved; // 0
+    uint64_t names_size;
+} Object_Header;
+
+// Instructions of an object read by hvm_read_object
+typedef struct {
+    Instruction *instructions; // Into the object, or into 'copy'
+    size_t count;
+    Instruction *copy; // Aligned copy if the object wasn't aligned, or NULL
+} Object_View;
+
+// Serializes 'count' instructions and the names in 'st'. Returns an
+// hvm_malloc'd object followed by a '\0', or NULL if out of memory.
+char *hvm_write_object(Instruction *insts, size_t count, Symbol_Table *st,
+    size_t *size);
+
+// Checks the object in 'buf' and interns its names into the empty table
+// 'st' under the same ids. Returns an error message, or NULL on success.
+char *hvm_read_object(char *buf, size_t size, Symbol_Table *st, Object_View *v);
+
+void hvm_free_object_view(Object_View *v);
+
+#endif // OBJECT_H
@@ -0,0 +1,472 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include "pass.h"
+#include "cfg.h"
+#include "timer.h"
+
+#define MAX_PUSH_CONSTANT                  32767 // Largest Hack A-instruction
+
+// Instructions being rewritten by IR passes, and what's known about them
+typedef struct {
+    Instruction *insts;
+    size_t count;
+    Symbol_Table *st;
+    Cfg cfg;
+    int cfg_built; // Cleared when a pass changes the instructions
+} Pass_Ir;
+
+// What a pass did, in instructions
+typedef struct {
+    size_t removed;
+    size_t added;
+} Pass_Report;
+
+typedef struct {
+    char *name;
+    unsigned levels; // Bit per enum HVM_LEVEL it's on at
+    unsigned after; // HVM_PASS_BIT of passes that must run first if on
+    int needs_cfg;
+    int needs_functions; // Can't run on part of a function
+    // One of these. IR passes return 1 if out of memory, Hack passes the
+    // new size.
+    int (*run_ir)(Pass_Ir *ir, Pass_Report *r);
+    size_t (*run_hack)(char *buf, size_t size, Pass_Report *r);
+    // Instructions or bytes at the end that the pass could still rewrite
+    // once what follows them is known. NULL if none.
+    size_t (*held_ir)(Instruction *insts, size_t count);
+    size_t (*held)(char *buf, size_t size);
+} Pass;
+
+#define LEVELS_O1_UP                       (1u << HVM_O1 | 1u << HVM_O2 | 1u << HVM_OS)
+#define LEVELS_O2_UP                       (1u << HVM_O2 | 1u << HVM_OS)
+// -Os runs the same passes as -O2 until one trades speed for size
+
+static int is_push_constant(Instruction *i)
+{
+    return i->opcode == OP_PUSH && i->segment == SEG_CONSTANT
+        && i->number <= MAX_PUSH_CONSTANT;
+}
+
+// Whether 'b' right after 'a' leaves everything as it was
+static int cancels_out(Instruction *a, Instruction *b)
+{
+    if (a->opcode == OP_PUSH && a->segment == SEG_CONSTANT && a->number == 0)
+        return b->opcode == OP_ADD || b->opcode == OP_SUB || b->opcode == OP_OR;
+    if (a->opcode == OP_PUSH && b->opcode == OP_POP)
+        return a->segment == b->segment && a->number == b->number;
+    return (a->opcode == OP_NEG || a->opcode == OP_NOT) && b->opcode == a->opcode;
+}
+
+// Sets '*value' to 'a' 'opcode' 'b' as the Hack code would compute it.
+// Returns 0 unless it's -1 (true) or fits in a push constant.
+static int fold_value(int opcode, int a, int b, int *value)
+{
+    switch (opcode) {
+    case OP_ADD: *value = a + b; break;
+    case OP_SUB: *value = a - b; break;
+    case OP_AND: *value = a & b; break;
+    case OP_OR: *value = a | b; break;
+    case OP_EQ: *value = a == b ? -1 : 0; break;
+    case OP_GT: *value = a > b ? -1 : 0; break;
+    case OP_LT: *value = a < b ? -1 : 0; break;
+    default: return 0;
+    }
+    return *value == -1 || (*value >= 0 && *value <= MAX_PUSH_CONSTANT);
+}
+
+// Rewrites the end of the first 'n' instructions for as long as a rule
+// applies. Returns the new 'n'.
+static size_t fold_tail(Instruction *insts, size_t n, Pass_Report *r)
+{
+    for (;;) {
+        Instruction *last = insts + n - 1;
+        if (n >= 2 && cancels_out(last - 1, last)) {
+            n -= 2;
+            r->removed += 2;
+            continue;
+        }
+
+        int value;
+        if (n >= 3 && is_push_constant(last - 2) && is_push_constant(last - 1)
+            && fold_value(last->opcode, last[-2].number, last[-1].number,
+                &value)) {
+            // True is -1, which only 'push constant 0, not' gives
+            last[-2].number = value == -1 ? 0 : (uint16_t) value;
+            if (value == -1) {
+                last[-1] = *last;
+                last[-1].opcode = OP_NOT;
+                n -= 1;
+                r->added += 2;
+            } else {
+                n -= 2;
+                r->added += 1;
+            }
+            r->removed += 3;
+            continue;
+        }
+        return n;
+    }
+}
+
+// Instructions never move past one they haven't been compared with, so
+// the output can overwrite the input
+static int fold_constants(Pass_Ir *ir, Pass_Report *r)
+{
+    size_t n = 0;
+    for (size_t k = 0; k < ir->count; k++) {
+        ir->insts[n++] = ir->insts[k];
+        n = fold_tail(ir->insts, n, r);
+    }
+    ir->count = n;
+    return 0;
+}
+
+// Whether fold_tail could still remove or rewrite 'i' from the end
+static int may_fold(Instruction *i)
+{
+    return i->opcode == OP_PUSH || i->opcode == OP_NEG || i->opcode == OP_NOT;
+}
+
+// Anything after the last instruction fold_tail can't touch may still meet
+// what comes next
+static size_t fold_held(Instruction *insts, size_t count)
+{
+    size_t n = count;
+    while (n > 0 && may_fold(insts + n - 1))
+        n--;
+    return count - n;
+}
+
+// Blocks are reached from their function's entry, and from any jump the
+// graph couldn't follow, such as one to a label of a function declared
+// twice. Those keep every block with the label they name.
+static int remove_unreachable(Pass_Ir *ir, Pass_Report *r)
+{
+    Cfg *cfg = &ir->cfg;
+    size_t symbols = ir->st->count ? ir->st->count : 1;
+    uint64_t *unresolved = hvm_calloc(bitset_words(symbols), sizeof(uint64_t),
+        HVM_MEM_ANALYSIS);
+    char *reached = hvm_calloc(cfg->block_count + 1, 1, HVM_MEM_ANALYSIS);
+    uint32_t *stack = hvm_malloc((cfg->block_count + 1) * sizeof(uint32_t),
+        HVM_MEM_ANALYSIS);
+    if (!unresolved || !reached || !stack) {
+        hvm_free(unresolved);
+        hvm_free(reached);
+        hvm_free(stack);
+        return 1;
+    }
+
+    for (uint32_t b = 0; b < cfg->block_count; b++) {
+        Instruction *last = ir->insts + cfg->blocks[b].end - 1;
+        if ((last->opcode == OP_GOTO || last->opcode == OP_IF_GOTO)
+            && cfg->blocks[b].successors[0] == CFG_NONE)
+            bitset_set(unresolved, last->symbol);
+    }
+
+    size_t pending = 0;
+    for (uint32_t b = 0; b < cfg->block_count; b++) {
+        Instruction *first = ir->insts + cfg->blocks[b].first;
+        int root = cfg->functions[cfg->blocks[b].function].first_block == b
+            || (first->opcode == OP_LABEL
+                && bitset_test(unresolved, first->symbol));
+        if (root) {
+            reached[b] = 1;
+            stack[pending++] = b;
+        }
+    }
+    while (pending > 0) {
+        Basic_Block *block = cfg->blocks + stack[--pending];
+        for (int s = 0; s < 2; s++) {
+            uint32_t succ = block->successors[s];
+            if (succ != CFG_NONE && !reached[succ]) {
+                reached[succ] = 1;
+                stack[pending++] = succ;
+            }
+        }
+    }
+
+    size_t n = 0;
+    for (uint32_t b = 0; b < cfg->block_count; b++) {
+        Basic_Block *block = cfg->blocks + b;
+        size_t len = block->end - block->first;
+        if (!reached[b]) {
+            r->removed += len;
+            continue;
+        }
+        memmove(ir->insts + n, ir->insts + block->first,
+            len * sizeof(Instruction));
+        n += len;
+    }
+    ir->count = n;
+
+    hvm_free(unresolved);
+    hvm_free(reached);
+    hvm_free(stack);
+    return 0;
+}
+
+// goto L, then labels up to and including L
+static int remove_jumps_to_next(Pass_Ir *ir, Pass_Report *r)
+{
+    Instruction *insts = ir->insts;
+    size_t n = 0;
+    for (size_t k = 0; k < ir->count; k++) {
+        if (insts[k].opcode == OP_GOTO) {
+            size_t next = k + 1;
+            while (next < ir->count && insts[next].opcode == OP_LABEL
+                && insts[next].symbol != insts[k].symbol)
+                next++;
+            if (next < ir->count && insts[next].opcode == OP_LABEL) {
+                r->removed++;
+                continue;
+            }
+        }
+        insts[n++] = insts[k];
+    }
+    ir->count = n;
+    return 0;
+}
+
+// A goto followed by nothing but labels, and code that may fold away, may
+// still reach its label
+static size_t jumps_held(Instruction *insts, size_t count)
+{
+    size_t n = count;
+    while (n > 0
+        && (insts[n - 1].opcode == OP_LABEL || may_fold(insts + n - 1)))
+        n--;
+    if (n == 0 || insts[n - 1].opcode != OP_GOTO)
+        return 0;
+    return count - n + 1;
+}
+
+#define PUSH_D_LEN                         (sizeof(HACK_PUSH_D) - 1)
+#define POP_D_LEN                          (sizeof(HACK_POP_D) - 1)
+#define MOVE_LEN                           (sizeof("@SP\nA=M\n") - 1)
+
+// A push of D, comment lines, then a pop into D: D is unchanged and A
+// ends up at the top of the stack, which '@SP A=M' does in two
+// instructions instead of nine. The slot written above the stack is dead.
+static size_t fuse_push_pop(char *buf, size_t size, Pass_Report *r)
+{
+    char *end = buf + size;
+    char *out = buf; // Rewritten code ends here
+    char *copied = buf; // Code before this is rewritten
+    char *p = buf;
+    char *push;
+    while ((push = memmem(p, end - p, HACK_PUSH_D, PUSH_D_LEN))) {
+        p = push + 1;
+        if (push > buf && push[-1] != '\n')
+            continue;
+
+        char *pop = push + PUSH_D_LEN;
+        while (end - pop >= 2 && pop[0] == '/' && pop[1] == '/') {
+            char *newline = memchr(pop, '\n', end - pop);
+            pop = newline ? newline + 1 : end;
+        }
+        if ((size_t) (end - pop) < POP_D_LEN
+            || memcmp(pop, HACK_POP_D, POP_D_LEN) != 0)
+            continue;
+
+        memmove(out, copied, push - copied);
+        out += push - copied;
+        char *comments = push + PUSH_D_LEN;
+        memmove(out, comments, pop - comments);
+        out += pop - comments;
+        memcpy(out, "@SP\nA=M\n", MOVE_LEN);
+        out += MOVE_LEN;
+        copied = p = pop + POP_D_LEN;
+        r->removed += 9;
+        r->added += 2;
+    }
+    memmove(out, copied, end - copied);
+    out += end - copied;
+    return out - buf;
+}
+
+// A push of D at the very end may meet its pop in the next piece
+static size_t push_pop_held(char *buf, size_t size)
+{
+    if (size < PUSH_D_LEN
+        || memcmp(buf + size - PUSH_D_LEN, HACK_PUSH_D, PUSH_D_LEN) != 0)
+        return 0;
+    if (size > PUSH_D_LEN && buf[size - PUSH_D_LEN - 1] != '\n')
+        return 0;
+    return PUSH_D_LEN;
+}
+
+// Indexed by enum HVM_PASS
+static const Pass PASSES[] = {
+    [HVM_PASS_FOLD] = {
+        .name = "fold",
+        .levels = LEVELS_O1_UP,
+        .run_ir = fold_constants,
+        .held_ir = fold_held
+    },
+    [HVM_PASS_UNREACHABLE] = {
+        .name = "unreachable",
+        .levels = LEVELS_O2_UP,
+        .needs_cfg = 1,
+        .needs_functions = 1,
+        .run_ir = remove_unreachable
+    },
+    [HVM_PASS_JUMPS] = {
+        .name = "jumps",
+        .levels = LEVELS_O1_UP,
+        // Dropping dead code can leave a goto right before its label
+        .after = HVM_PASS_BIT(HVM_PASS_UNREACHABLE),
+        .run_ir = remove_jumps_to_next,
+        .held_ir = jumps_held
+    },
+    [HVM_PASS_STACK] = {
+        .name = "stack",
+        .levels = LEVELS_O1_UP,
+        .run_hack = fuse_push_pop,
+        .held = push_pop_held
+    },
+};
+
+// Fails to compile if a pass is missing from the table
+typedef char pass_table_check[sizeof(PASSES) / sizeof(PASSES[0])
+    == HVM_PASS_COUNT ? 1 : -1];
+
+char *hvm_pass_name(int pass)
+{
+    if (pass < 0 || pass >= HVM_PASS_COUNT)
+        return NULL;
+    return PASSES[pass].name;
+}
+
+char *hvm_pass_unit(int pass)
+{
+    if (pass < 0 || pass >= HVM_PASS_COUNT)
+        return NULL;
+    return PASSES[pass].run_hack ? "hack" : "vm";
+}
+
+int hvm_pass_needs_functions(int pass)
+{
+    if (pass < 0 || pass >= HVM_PASS_COUNT)
+        return 0;
+    return PASSES[pass].needs_functions;
+}
+
+int hvm_find_pass(char *name)
+{
+    for (int k = 0; k < HVM_PASS_COUNT; k++)
+        if (strcmp(PASSES[k].name, name) == 0)
+            return k;
+    return -1;
+}
+
+unsigned hvm_level_passes(int level)
+{
+    unsigned passes = 0;
+    for (int k = 0; k < HVM_PASS_COUNT; k++)
+        if (PASSES[k].levels & 1u << level)
+            passes |= HVM_PASS_BIT(k);
+    return passes;
+}
+
+// Next pass of 'todo' whose dependencies in 'todo' all ran, or -1
+static int next_pass(unsigned todo)
+{
+    for (int k = 0; k < HVM_PASS_COUNT; k++)
+        if (todo & HVM_PASS_BIT(k) && !(PASSES[k].after & todo))
+            return k;
+    return -1;
+}
+
+static void record(Hvm_Stats *stats, int pass, double start, Pass_Report *r)
+{
+    if (!stats)
+        return;
+    stats->pass_runs[pass]++;
+    stats->pass_ms[pass] += hvm_now_ms() - start;
+    stats->pass_removed[pass] += r->removed;
+    stats->pass_added[pass] += r->added;
+}
+
+char *hvm_run_ir_passes(unsigned passes, Instruction *insts, size_t *count,
+    Symbol_Table *st, int whole_functions, Hvm_Stats *stats)
+{
+    Pass_Ir ir = { .insts = insts, .count = *count, .st = st, .cfg_built = 0 };
+    char *error = NULL;
+    unsigned todo = 0;
+    for (int k = 0; k < HVM_PASS_COUNT; k++)
+        if (passes & HVM_PASS_BIT(k) && PASSES[k].run_ir
+            && (whole_functions || !PASSES[k].needs_functions))
+            todo |= HVM_PASS_BIT(k);
+
+    int pass;
+    while (!error && (pass = next_pass(todo)) != -1) {
+        todo &= ~HVM_PASS_BIT(pass);
+        double start = stats ? hvm_now_ms() : 0;
+        if (PASSES[pass].needs_cfg && !ir.cfg_built) {
+            if (hvm_cfg_build(&ir.cfg, ir.insts, ir.count, st) != 0) {
+                error = "Out of memory\n";
+                break;
+            }
+            ir.cfg_built = 1;
+        }
+
+        Pass_Report r = { 0, 0 };
+        if (PASSES[pass].run_ir(&ir, &r) != 0)
+            error = "Out of memory\n";
+        if ((r.removed || r.added) && ir.cfg_built) {
+            hvm_cfg_free(&ir.cfg);
+            ir.cfg_built = 0;
+        }
+        record(stats, pass, start, &r);
+    }
+
+    if (ir.cfg_built)
+        hvm_cfg_free(&ir.cfg);
+    *count = ir.count;
+    return error;
+}
+
+size_t hvm_run_hack_passes(unsigned passes, char *buf, size_t size,
+    Hvm_Stats *stats)
+{
+    unsigned todo = 0;
+    for (int k = 0; k < HVM_PASS_COUNT; k++)
+        if (passes & HVM_PASS_BIT(k) && PASSES[k].run_hack)
+            todo |= HVM_PASS_BIT(k);
+
+    int pass;
+    while ((pass = next_pass(todo)) != -1) {
+        todo &= ~HVM_PASS_BIT(pass);
+        double start = stats ? hvm_now_ms() : 0;
+        Pass_Report r = { 0, 0 };
+        size = PASSES[pass].run_hack(buf, size, &r);
+        record(stats, pass, start, &r);
+    }
+    return size;
+}
+
+size_t hvm_ir_passes_held(unsigned passes, Instruction *insts, size_t count)
+{
+    size_t held = 0;
+    for (int k = 0; k < HVM_PASS_COUNT; k++) {
+        if (!(passes & HVM_PASS_BIT(k)) || !PASSES[k].held_ir)
+            continue;
+        size_t n = PASSES[k].held_ir(insts, count);
+        if (n > held)
+            held = n;
+    }
+    return held;
+}
+
+size_t hvm_hack_passes_held(unsigned passes, char *buf, size_t size)
+{
+    size_t held = 0;
+    for (int k = 0; k < HVM_PASS_COUNT; k++) {
+        if (!(passes & HVM_PASS_BIT(k)) || !PASSES[k].held)
+            continue;
+        size_t n = PASSES[k].held(buf, size);
+        if (n > held)
+            held = n;
+    }
+    return held;
+}
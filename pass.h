@@ -0,0 +1,31 @@
+#ifndef PASS_H
+#define PASS_H
+
+#include <stddef.h>
+#include "hvm.h"
+#include "symbol.h"
+#include "libhvm.h"
+
+// Runs the IR passes among 'passes' over '*count' instructions in place,
+// in dependency order, and sets '*count' to how many are left. Passes that
+// need whole functions are skipped unless 'whole_functions'. Times and
+// counts go into 'stats' unless it's NULL. Returns an error message or
+// NULL.
+char *hvm_run_ir_passes(unsigned passes, Instruction *insts, size_t *count,
+    Symbol_Table *st, int whole_functions, Hvm_Stats *stats);
+
+// Runs the Hack passes among 'passes' over 'size' bytes of generated code
+// in place. Returns the new size, never larger.
+size_t hvm_run_hack_passes(unsigned passes, char *buf, size_t size,
+    Hvm_Stats *stats);
+
+// Instructions at the end of 'insts' that the IR passes could still
+// rewrite once the instructions after them are known, so streamed input
+// holds them back
+size_t hvm_ir_passes_held(unsigned passes, Instruction *insts, size_t count);
+
+// Bytes at the end of 'buf' that the Hack passes could still rewrite once
+// the code after them is known, so streamed output holds them back
+size_t hvm_hack_passes_held(unsigned passes, char *buf, size_t size);
+
+#endif // PASS_H
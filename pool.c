@@ -0,0 +1,139 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "pool.h"
+#include "libhvm.h"
+
+// Indices not yet taken by any worker: [next, end)
+typedef struct {
+    pthread_mutex_t lock;
+    size_t next;
+    size_t end;
+} Pool_Queue;
+
+typedef struct {
+    Pool_Queue *queues;
+    int queue_count;
+    Pool_Task task;
+    void *arg;
+} Pool;
+
+typedef struct {
+    Pool *pool;
+    int id;
+} Pool_Worker;
+
+// Takes the front index of a queue. Returns 0 if it was empty.
+static int take_front(Pool_Queue *q, size_t *index)
+{
+    int found = 0;
+    pthread_mutex_lock(&q->lock);
+    if (q->next < q->end) {
+        *index = q->next++;
+        found = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
+// Moves the back half of some other worker's queue into the thief's own,
+// empty queue. Returns 0 if every queue was empty.
+static int steal(Pool *p, int thief)
+{
+    for (int k = 1; k < p->queue_count; k++) {
+        Pool_Queue *victim = p->queues + (thief + k) % p->queue_count;
+
+        pthread_mutex_lock(&victim->lock);
+        size_t left = victim->end - victim->next;
+        size_t stolen = (left + 1) / 2;
+        size_t start = victim->end - stolen;
+        victim->end = start;
+        pthread_mutex_unlock(&victim->lock);
+
+        if (stolen > 0) {
+            Pool_Queue *own = p->queues + thief;
+            pthread_mutex_lock(&own->lock);
+            own->next = start;
+            own->end = start + stolen;
+            pthread_mutex_unlock(&own->lock);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void *work(void *arg)
+{
+    Pool_Worker *w = arg;
+    Pool *p = w->pool;
+    Pool_Queue *own = p->queues + w->id;
+
+    size_t index;
+    while (1) {
+        while (take_front(own, &index))
+            p->task(p->arg, index);
+
+        if (!steal(p, w->id))
+            break;
+    }
+
+    return NULL;
+}
+
+void hvm_pool_run(int thread_count, size_t count, Pool_Task task, void *arg)
+{
+    if (thread_count > (int) count)
+        thread_count = (int) count;
+
+    if (thread_count <= 1) {
+        for (size_t k = 0; k < count; k++)
+            task(arg, k);
+        return;
+    }
+
+    Pool p = {
+        .queues = hvm_malloc(thread_count * sizeof(Pool_Queue), HVM_MEM_OTHER),
+        .queue_count = thread_count,
+        .task = task,
+        .arg = arg
+    };
+    Pool_Worker *workers = hvm_malloc(thread_count * sizeof(Pool_Worker),
+        HVM_MEM_OTHER);
+    pthread_t *threads = hvm_malloc(thread_count * sizeof(pthread_t),
+        HVM_MEM_OTHER);
+    int *started = hvm_calloc(thread_count, sizeof(int), HVM_MEM_OTHER);
+    if (!p.queues || !workers || !threads || !started) {
+        hvm_free(p.queues);
+        hvm_free(workers);
+        hvm_free(threads);
+        hvm_free(started);
+        for (size_t k = 0; k < count; k++)
+            task(arg, k);
+        return;
+    }
+
+    // Even contiguous shares to start with
+    for (int t = 0; t < thread_count; t++) {
+        pthread_mutex_init(&p.queues[t].lock, NULL);
+        p.queues[t].next = count * t / thread_count;
+        p.queues[t].end = count * (t + 1) / thread_count;
+        workers[t] = (Pool_Worker) { .pool = &p, .id = t };
+    }
+
+    // Worker 0 is the calling thread. If a thread can't be started, its
+    // share is simply stolen by the others.
+    for (int t = 1; t < thread_count; t++)
+        started[t] = pthread_create(threads + t, NULL, work, workers + t) == 0;
+    work(workers);
+
+    for (int t = 1; t < thread_count; t++) {
+        if (started[t])
+            pthread_join(threads[t], NULL);
+    }
+
+    for (int t = 0; t < thread_count; t++)
+        pthread_mutex_destroy(&p.queues[t].lock);
+    hvm_free(p.queues);
+    hvm_free(workers);
+    hvm_free(threads);
+    hvm_free(started);
+}
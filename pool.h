@@ -0,0 +1,16 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+// Called once for every index, from any worker thread
+typedef void (*Pool_Task)(void *arg, size_t index);
+
+// Runs task(arg, k) for every k in [0, count) on up to 'thread_count'
+// threads, the calling thread included, and returns when all are done.
+// Each worker starts on its own contiguous share of the indices and, once
+// that runs out, steals half of what is left in another worker's share.
+// With thread_count <= 1 everything runs in order on the calling thread.
+void hvm_pool_run(int thread_count, size_t count, Pool_Task task, void *arg);
+
+#endif // POOL_H
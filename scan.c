@@ -0,0 +1,239 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "scan.h"
+#include "libhvm.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#else
+#define SCAN_X86 0
+#endif
+
+#define LINE_INDEX_INITIAL_CAPACITY        1024
+#define NO_COMMENT                         ((size_t) -1)
+
+// Line being built while scanning
+typedef struct {
+    Line_Index *li;
+    size_t start;
+    size_t code_end; // NO_COMMENT until a "//" is seen on this line
+    int error;
+} Scan_State;
+
+static void push_line(Scan_State *s, size_t end)
+{
+    Line_Index *li = s->li;
+    if (li->count == li->capacity) {
+        size_t capacity = li->capacity ? li->capacity * 2
+            : LINE_INDEX_INITIAL_CAPACITY;
+        size_t *starts = hvm_realloc(li->starts, capacity * sizeof(size_t),
+            HVM_MEM_LINES);
+        if (!starts) {
+            s->error = 1;
+            return;
+        }
+        li->starts = starts;
+        size_t *code_ends = hvm_realloc(li->code_ends,
+            capacity * sizeof(size_t), HVM_MEM_LINES);
+        if (!code_ends) {
+            s->error = 1;
+            return;
+        }
+        li->code_ends = code_ends;
+        li->capacity = capacity;
+    }
+
+    li->starts[li->count] = s->start;
+    li->code_ends[li->count] = s->code_end == NO_COMMENT ? end : s->code_end;
+    li->count++;
+
+    s->start = end + 1;
+    s->code_end = NO_COMMENT;
+}
+
+static void mark_comment(Scan_State *s, size_t pos)
+{
+    if (s->code_end == NO_COMMENT)
+        s->code_end = pos;
+}
+
+// Handles the events of one block. Bit k of 'newlines' is set if
+// buf[base + k] ends a line, bit k of 'comments' if a "//" starts there.
+static void scan_events(Scan_State *s, size_t base, uint32_t newlines,
+    uint32_t comments)
+{
+    uint32_t events = newlines | comments;
+    while (events) {
+        unsigned bit = __builtin_ctz(events);
+        if (newlines & (1u << bit))
+            push_line(s, base + bit);
+        else
+            mark_comment(s, base + bit);
+        events &= events - 1;
+    }
+}
+
+// Lines end at '\n', or at a '\r' on its own as old Mac files have them.
+// The '\r' of "\r\n" stays in the line, where parsing skips it.
+// Scans buf[from] up to buf[size] one byte at a time.
+static void scan_scalar_range(Scan_State *s, char *buf, size_t from, size_t size)
+{
+    for (size_t i = from; i < size; i++) {
+        if (buf[i] == '\n' || (buf[i] == '\r' && buf[i+1] != '\n'))
+            push_line(s, i);
+        else if (buf[i] == '/' && buf[i+1] == '/')
+            mark_comment(s, i);
+    }
+}
+
+static size_t scan_scalar(Scan_State *s, char *buf, size_t size)
+{
+    scan_scalar_range(s, buf, 0, size);
+    return size;
+}
+
+#if SCAN_X86
+// Blocks compare buf[i..i+15] and buf[i+1..i+16], so a block is only taken
+// while i + 16 < size + 1, keeping every load within the sentinel.
+static size_t scan_sse2(Scan_State *s, char *buf, size_t size)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i slash = _mm_set1_epi8('/');
+
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (buf + i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (buf + i + 1));
+        __m128i lone_cr = _mm_andnot_si128(_mm_cmpeq_epi8(b, newline),
+            _mm_cmpeq_epi8(a, cr));
+        uint32_t newlines = _mm_movemask_epi8(_mm_or_si128(
+            _mm_cmpeq_epi8(a, newline), lone_cr));
+        uint32_t comments = _mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(a, slash), _mm_cmpeq_epi8(b, slash)));
+        if (newlines | comments)
+            scan_events(s, i, newlines, comments);
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(Scan_State *s, char *buf, size_t size)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i slash = _mm256_set1_epi8('/');
+
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) (buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *) (buf + i + 1));
+        __m256i lone_cr = _mm256_andnot_si256(_mm256_cmpeq_epi8(b, newline),
+            _mm256_cmpeq_epi8(a, cr));
+        uint32_t newlines = _mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_cmpeq_epi8(a, newline), lone_cr));
+        uint32_t comments = _mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_cmpeq_epi8(a, slash), _mm256_cmpeq_epi8(b, slash)));
+        if (newlines | comments)
+            scan_events(s, i, newlines, comments);
+    }
+
+    return i;
+}
+#endif
+
+// Scans as many leading bytes as the kernel handles, returns how many
+typedef size_t (*Scan_Kernel)(Scan_State *s, char *buf, size_t size);
+
+typedef struct {
+    char *name;
+    Scan_Kernel kernel;
+} Scan_Kernel_Entry;
+
+static Scan_Kernel_Entry pick_kernel(void)
+{
+    Scan_Kernel_Entry scalar = { "scalar", scan_scalar };
+
+#if SCAN_X86
+    Scan_Kernel_Entry sse2 = { "sse2", scan_sse2 };
+    Scan_Kernel_Entry avx2 = { "avx2", scan_avx2 };
+
+    __builtin_cpu_init();
+    int has_sse2 = __builtin_cpu_supports("sse2");
+    int has_avx2 = __builtin_cpu_supports("avx2");
+
+    char *forced = getenv("HVM_SCAN");
+    if (forced) {
+        if (strcmp(forced, "scalar") == 0)
+            return scalar;
+        if (strcmp(forced, "sse2") == 0 && has_sse2)
+            return sse2;
+    }
+
+    if (has_avx2)
+        return avx2;
+    if (has_sse2)
+        return sse2;
+#endif
+
+    return scalar;
+}
+
+// Picked once, on first use from any thread
+static Scan_Kernel_Entry current_kernel = { NULL, NULL };
+static pthread_once_t current_kernel_once = PTHREAD_ONCE_INIT;
+
+static void init_kernel(void)
+{
+    current_kernel = pick_kernel();
+}
+
+static Scan_Kernel get_kernel(void)
+{
+    pthread_once(&current_kernel_once, init_kernel);
+    return current_kernel.kernel;
+}
+
+char *hvm_scan_kernel_name(void)
+{
+    get_kernel();
+    return current_kernel.name;
+}
+
+int hvm_build_line_index(char *buf, size_t size, Line_Index *li)
+{
+    li->starts = NULL;
+    li->code_ends = NULL;
+    li->count = 0;
+    li->capacity = 0;
+
+    Scan_State s = { .li = li, .start = 0, .code_end = NO_COMMENT, .error = 0 };
+
+    size_t done = get_kernel()(&s, buf, size);
+    scan_scalar_range(&s, buf, done, size);
+
+    // Last line without a trailing newline
+    if (s.start < size)
+        push_line(&s, size);
+
+    if (s.error) {
+        hvm_free_line_index(li);
+        return 1;
+    }
+
+    return 0;
+}
+
+void hvm_free_line_index(Line_Index *li)
+{
+    hvm_free(li->starts);
+    hvm_free(li->code_ends);
+    li->starts = NULL;
+    li->code_ends = NULL;
+    li->count = 0;
+    li->capacity = 0;
+}
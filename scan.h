@@ -0,0 +1,27 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+
+// Offsets of every line in a buffer. A line runs from starts[k] to
+// code_ends[k] (exclusive), where code_ends[k] is the offset of the first
+// "//" on that line, or of the '\n' or lone '\r' ending it, or of the end
+// of the buffer.
+// Line numbers for errors are k + 1.
+typedef struct {
+    size_t *starts;
+    size_t *code_ends;
+    size_t count;
+    size_t capacity;
+} Line_Index;
+
+// Scans 'size' bytes of 'buf' into 'li'. buf[size] must be readable.
+// Returns 0 on success, 1 if out of memory.
+int hvm_build_line_index(char *buf, size_t size, Line_Index *li);
+void hvm_free_line_index(Line_Index *li);
+
+// Name of the scanning kernel picked for this CPU ("avx2", "sse2" or
+// "scalar"). Setting HVM_SCAN to one of those forces it, if supported.
+char *hvm_scan_kernel_name(void);
+
+#endif // SCAN_H
@@ -0,0 +1,369 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "serve.h"
+#include "timer.h"
+#include "libhvm.h"
+
+#define SERVE_BACKLOG                      64
+#define SERVE_MAX_STRINGS                  (1 << 20)
+#define SERVE_MAX_STRING_SIZE              ((uint32_t) 1 << 31)
+#define SERVE_CWD_SIZE                     4096
+
+// Reads or writes exactly 'size' bytes. Returns 0 on success.
+static int read_all(int fd, void *buf, size_t size)
+{
+    char *p = buf;
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        p += n;
+        size -= (size_t) n;
+    }
+    return 0;
+}
+
+static int write_all(int fd, void *buf, size_t size)
+{
+    char *p = buf;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        p += n;
+        size -= (size_t) n;
+    }
+    return 0;
+}
+
+static int write_string(int fd, char *str, size_t len)
+{
+    uint32_t len32 = (uint32_t) len;
+    return write_all(fd, &len32, sizeof(len32)) || write_all(fd, str, len);
+}
+
+static int write_part(int fd, char *buf, size_t size)
+{
+    uint64_t size64 = size;
+    return write_all(fd, &size64, sizeof(size64)) || write_all(fd, buf, size);
+}
+
+static int write_reply(int fd, uint32_t status, char *out, size_t out_size,
+    char *err, size_t err_size)
+{
+    return write_all(fd, &status, sizeof(status))
+        || write_part(fd, out, out_size) || write_part(fd, err, err_size);
+}
+
+// Replies with status 1 and 'message' as the error, returns 1
+static int reply_error(int fd, char *message)
+{
+    write_reply(fd, 1, NULL, 0, message, strlen(message));
+    return 1;
+}
+
+static int open_socket(char *path, struct sockaddr_un *addr)
+{
+    if (strlen(path) >= sizeof(addr->sun_path))
+        return -1;
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+}
+
+// A decoded request, every string followed by a '\0'
+typedef struct {
+    uint32_t kind;
+    uint32_t count;
+    char **strings;
+    uint32_t *lengths;
+} Request;
+
+static void free_request(Request *req)
+{
+    for (uint32_t k = 0; k < req->count; k++)
+        hvm_free(req->strings[k]);
+    hvm_free(req->strings);
+    hvm_free(req->lengths);
+}
+
+static int read_request(int fd, Request *req)
+{
+    req->count = 0;
+    req->strings = NULL;
+    req->lengths = NULL;
+
+    uint32_t count;
+    if (read_all(fd, &req->kind, sizeof(req->kind))
+        || read_all(fd, &count, sizeof(count)) || count > SERVE_MAX_STRINGS)
+        return 1;
+
+    req->strings = hvm_calloc(count, sizeof(char*), HVM_MEM_OTHER);
+    req->lengths = hvm_calloc(count, sizeof(uint32_t), HVM_MEM_OTHER);
+    if (!req->strings || !req->lengths)
+        return 1;
+
+    for (; req->count < count; req->count++) {
+        uint32_t len;
+        if (read_all(fd, &len, sizeof(len)) || len >= SERVE_MAX_STRING_SIZE)
+            return 1;
+        char *str = hvm_malloc((size_t) len + 1, HVM_MEM_IO);
+        if (!str)
+            return 1;
+        req->strings[req->count] = str;
+        req->lengths[req->count] = len;
+        if (read_all(fd, str, len)) {
+            req->count++;
+            return 1;
+        }
+        str[len] = '\0';
+    }
+
+    return 0;
+}
+
+// Points 'fd' at the emptied 'capture'. Returns a copy of what 'fd' was,
+// to restore with end_capture, or -1.
+static int begin_capture(FILE *capture, int fd)
+{
+    int saved = dup(fd);
+    rewind(capture);
+    if (saved == -1 || ftruncate(fileno(capture), 0) == -1
+        || dup2(fileno(capture), fd) == -1) {
+        if (saved != -1)
+            close(saved);
+        return -1;
+    }
+    return saved;
+}
+
+static void end_capture(int saved, int fd)
+{
+    dup2(saved, fd);
+    close(saved);
+}
+
+// Everything written to 'capture', in an hvm_malloc'd buffer, or NULL
+static char *read_capture(FILE *capture, size_t *size)
+{
+    long end = lseek(fileno(capture), 0, SEEK_END);
+    char *printed = hvm_malloc(end > 0 ? (size_t) end : 0, HVM_MEM_IO);
+    if (end < 0 || !printed
+        || pread(fileno(capture), printed, end, 0) != end) {
+        hvm_free(printed);
+        return NULL;
+    }
+    *size = (size_t) end;
+    return printed;
+}
+
+// Runs a command line with stdout and stderr sent to 'captures', and
+// replies with what was printed on each
+static int handle_run(int fd, Request *req, FILE *captures[2], Serve_Run run,
+    void *arg)
+{
+    char cwd[SERVE_CWD_SIZE];
+    if (req->count < 1 || !getcwd(cwd, sizeof(cwd)) || chdir(req->strings[0]))
+        return reply_error(fd, "Bad request\n");
+
+    fflush(stdout);
+    fflush(stderr);
+    int saved_stdout = begin_capture(captures[0], STDOUT_FILENO);
+    int saved_stderr = saved_stdout == -1 ? -1
+        : begin_capture(captures[1], STDERR_FILENO);
+    if (saved_stderr == -1) {
+        if (saved_stdout != -1)
+            end_capture(saved_stdout, STDOUT_FILENO);
+        if (chdir(cwd) == -1)
+            printf("Couldn't return to '%s'\n", cwd);
+        return reply_error(fd, "Server error\n");
+    }
+
+    int status = run((int) req->count - 1, req->strings + 1, arg);
+
+    fflush(stdout);
+    fflush(stderr);
+    end_capture(saved_stdout, STDOUT_FILENO);
+    end_capture(saved_stderr, STDERR_FILENO);
+    if (chdir(cwd) == -1)
+        printf("Couldn't return to '%s'\n", cwd);
+
+    // Send back everything that was printed
+    size_t out_size = 0, err_size = 0;
+    char *out = read_capture(captures[0], &out_size);
+    char *err = read_capture(captures[1], &err_size);
+    if (!out || !err) {
+        hvm_free(out);
+        hvm_free(err);
+        return reply_error(fd, "Server error\n");
+    }
+
+    write_reply(fd, (uint32_t) status, out, out_size, err, err_size);
+    hvm_free(out);
+    hvm_free(err);
+    return status;
+}
+
+static int handle_translate(int fd, Request *req, Serve_Translate translate,
+    void *arg)
+{
+    if (req->count != 2)
+        return reply_error(fd, "Bad request\n");
+
+    char *output = NULL;
+    size_t output_size = 0;
+    int status = translate(req->strings[1], req->lengths[1], req->strings[0],
+        &output, &output_size, arg);
+    if (status == 0)
+        write_reply(fd, 0, output, output_size, NULL, 0);
+    else
+        write_reply(fd, (uint32_t) status, NULL, 0, output, output_size);
+    hvm_free(output);
+    return status;
+}
+
+int serve(char *path, Serve_Run run, Serve_Translate translate, void *arg)
+{
+    struct sockaddr_un addr;
+    int listen_fd = open_socket(path, &addr);
+    if (listen_fd == -1) {
+        printf("Couldn't create socket '%s'\n", path);
+        return 1;
+    }
+
+    // Replace a socket left over by an earlier server
+    unlink(path);
+    if (bind(listen_fd, (struct sockaddr*) &addr, sizeof(addr)) == -1
+        || listen(listen_fd, SERVE_BACKLOG) == -1) {
+        printf("Couldn't listen on '%s' (error %i)\n", path, errno);
+        close(listen_fd);
+        return 1;
+    }
+
+    // Command output is collected here before it's sent back, stdout in
+    // the first and stderr in the second
+    FILE *captures[2] = { tmpfile(), tmpfile() };
+    if (!captures[0] || !captures[1]) {
+        printf("Couldn't create a temporary file\n");
+        if (captures[0])
+            fclose(captures[0]);
+        if (captures[1])
+            fclose(captures[1]);
+        close(listen_fd);
+        return 1;
+    }
+
+    // A client going away mid-reply must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("Serving on '%s'\n", path);
+    fflush(stdout);
+
+    for (unsigned long request_number = 1;; request_number++) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            printf("accept failed (error %i)\n", errno);
+            break;
+        }
+
+        double start = hvm_now_ms();
+        Request req;
+        int status = 1;
+        char *kind = "invalid";
+        if (read_request(fd, &req) != 0) {
+            reply_error(fd, "Bad request\n");
+        } else if (req.kind == SERVE_RUN) {
+            kind = "run";
+            status = handle_run(fd, &req, captures, run, arg);
+        } else if (req.kind == SERVE_TRANSLATE) {
+            kind = "translate";
+            status = handle_translate(fd, &req, translate, arg);
+        } else {
+            reply_error(fd, "Bad request\n");
+        }
+        free_request(&req);
+        close(fd);
+
+        printf("Request %lu (%s): status %i in %.2f ms\n", request_number,
+            kind, status, hvm_now_ms() - start);
+        fflush(stdout);
+    }
+
+    fclose(captures[0]);
+    fclose(captures[1]);
+    close(listen_fd);
+    unlink(path);
+    return 1;
+}
+
+// Copies one part of a reply to 'out'. Returns 0 on success.
+static int pass_through(int fd, FILE *out)
+{
+    uint64_t size;
+    if (read_all(fd, &size, sizeof(size)))
+        return 1;
+
+    char buf[64 * 1024];
+    while (size > 0) {
+        size_t chunk = size < sizeof(buf) ? (size_t) size : sizeof(buf);
+        if (read_all(fd, buf, chunk))
+            return 1;
+        fwrite(buf, 1, chunk, out);
+        size -= chunk;
+    }
+    return 0;
+}
+
+int serve_client(char *path, int argc, char **argv, int *status)
+{
+    struct sockaddr_un addr;
+    int fd = open_socket(path, &addr);
+    if (fd == -1)
+        return 1;
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        close(fd);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    char cwd[SERVE_CWD_SIZE];
+    uint32_t header[2] = { SERVE_RUN, (uint32_t) argc + 1 };
+    int error = !getcwd(cwd, sizeof(cwd))
+        || write_all(fd, header, sizeof(header))
+        || write_string(fd, cwd, strlen(cwd));
+    for (int k = 0; k < argc && !error; k++)
+        error = write_string(fd, argv[k], strlen(argv[k]));
+
+    uint32_t reply_status;
+    if (error || read_all(fd, &reply_status, sizeof(reply_status))) {
+        close(fd);
+        return 1;
+    }
+
+    // The server's stdout and stderr, passed through as they arrive
+    if (pass_through(fd, stdout) || pass_through(fd, stderr)) {
+        printf("Lost connection to server '%s'\n", path);
+        reply_status = 1;
+    }
+
+    close(fd);
+    *status = (int) reply_status;
+    return 0;
+}
@@ -0,0 +1,42 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <stddef.h>
+
+// Requests and replies on the server socket. Integers are in host byte
+// order, as both ends run on the same machine.
+//
+// Request: u32 kind, u32 string count, then each string as u32 length and
+// its bytes.
+//   SERVE_RUN        strings are the client's working directory and its
+//                    argv, program name first. The server runs them like
+//                    the command line would, from that directory.
+//   SERVE_TRANSLATE  strings are a module name and VM code. Nothing touches
+//                    the file system, the reply holds the Hack code.
+// Reply: u32 status, then two parts, each a u64 length and that many bytes:
+// what the command line would have printed on stdout and on stderr for
+// SERVE_RUN, the Hack code and an error message for SERVE_TRANSLATE. Status
+// 0 means success.
+#define SERVE_RUN                          1
+#define SERVE_TRANSLATE                    2
+
+// Runs the command line 'argv', printing to stdout and stderr. Returns the
+// exit status.
+typedef int (*Serve_Run)(int argc, char **argv, void *arg);
+
+// Translates 'size' bytes of VM code in 'buf', followed by a '\0'. Sets
+// 'output' to an hvm_malloc'd buffer holding the Hack code, or an error message,
+// and returns 0 on success.
+typedef int (*Serve_Translate)(char *buf, size_t size, char *module,
+    char **output, size_t *output_size, void *arg);
+
+// Serves requests on a Unix socket at 'path' one at a time, until killed.
+// Prints the timing of every request. Returns 1 if the socket can't be set up.
+int serve(char *path, Serve_Run run, Serve_Translate translate, void *arg);
+
+// Sends 'argv' to the server at 'path' as a SERVE_RUN request, prints its
+// output on stdout and stderr and sets 'status'. Returns 1 if no server answered, so the caller
+// can do the work itself.
+int serve_client(char *path, int argc, char **argv, int *status);
+
+#endif // SERVE_H
@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include "stats.h"
+
+#define MB                                 (1024.0 * 1024.0)
+
+static size_t vm_instructions(Hvm_Stats *s)
+{
+    size_t count = 0;
+    for (int k = 0; k < HVM_OPCODE_COUNT; k++)
+        count += s->opcodes[k];
+    return count;
+}
+
+static double file_ms(File_Stats *f)
+{
+    double ms = f->load_ms + f->translation.parse_ms
+        + f->translation.codegen_ms + f->write_ms;
+    for (int k = 0; k < HVM_PASS_COUNT; k++)
+        ms += f->translation.pass_ms[k];
+    return ms;
+}
+
+// Megabytes of input per second, 0 if too fast to tell
+static double throughput(size_t bytes, double ms)
+{
+    return ms > 0 ? bytes / MB / (ms / 1000.0) : 0;
+}
+
+// Adds every file into one, for the totals
+static File_Stats sum_files(File_Stats *files, int count)
+{
+    File_Stats total;
+    memset(&total, 0, sizeof(total));
+    total.path = "total";
+    for (int i = 0; i < count; i++) {
+        File_Stats *f = files + i;
+        total.load_ms += f->load_ms;
+        total.write_ms += f->write_ms;
+        total.bytes_in += f->bytes_in;
+        total.bytes_out += f->bytes_out;
+        total.translation.parse_ms += f->translation.parse_ms;
+        total.translation.codegen_ms += f->translation.codegen_ms;
+        total.translation.hack_instructions += f->translation.hack_instructions;
+        for (int k = 0; k < HVM_OPCODE_COUNT; k++)
+            total.translation.opcodes[k] += f->translation.opcodes[k];
+        for (int k = 0; k < HVM_SEGMENT_COUNT; k++)
+            total.translation.segments[k] += f->translation.segments[k];
+        for (int k = 0; k < HVM_PASS_COUNT; k++) {
+            total.translation.pass_runs[k] += f->translation.pass_runs[k];
+            total.translation.pass_ms[k] += f->translation.pass_ms[k];
+            total.translation.pass_removed[k] += f->translation.pass_removed[k];
+            total.translation.pass_added[k] += f->translation.pass_added[k];
+        }
+    }
+    return total;
+}
+
+static void print_row(FILE *out, int width, File_Stats *f, double ms)
+{
+    fprintf(out, "%-*s %9.3f %9.3f %10.3f %9.3f %10zu %10zu %9zu %10zu %8.1f%s\n",
+        width, f->path, f->load_ms, f->translation.parse_ms,
+        f->translation.codegen_ms, f->write_ms, f->bytes_in, f->bytes_out,
+        vm_instructions(&f->translation), f->translation.hack_instructions,
+        throughput(f->bytes_in, ms), f->cached ? " (cached)" : "");
+}
+
+void print_stats_text(FILE *out, File_Stats *files, int count, Run_Stats *run)
+{
+    int width = (int) strlen("total");
+    for (int i = 0; i < count; i++)
+        if ((int) strlen(files[i].path) > width)
+            width = (int) strlen(files[i].path);
+
+    fprintf(out, "%-*s %9s %9s %10s %9s %10s %10s %9s %10s %8s\n", width,
+        "file", "load ms", "parse ms", "codegen ms", "write ms", "bytes in",
+        "bytes out", "VM insts", "Hack insts", "MB/s");
+    for (int i = 0; i < count; i++)
+        print_row(out, width, files + i, file_ms(files + i));
+
+    // Per-file write times are unknown when all went to one file
+    File_Stats total = sum_files(files, count);
+    total.write_ms = run->write_ms;
+    print_row(out, width, &total, run->wall_ms);
+
+    fprintf(out, "Wall time %.3f ms, I/O: %s, %li system calls\n", run->wall_ms,
+        run->io_backend, run->syscalls);
+
+    char *separator = " ";
+    fprintf(out, "VM instructions by opcode:");
+    for (int k = 0; k < HVM_OPCODE_COUNT; k++) {
+        if (!total.translation.opcodes[k])
+            continue;
+        fprintf(out, "%s%s %zu", separator, hvm_opcode_name(k),
+            total.translation.opcodes[k]);
+        separator = ", ";
+    }
+
+    separator = " ";
+    fprintf(out, "\npush and pop by segment:");
+    for (int k = 0; k < HVM_SEGMENT_COUNT; k++) {
+        if (!total.translation.segments[k])
+            continue;
+        fprintf(out, "%s%s %zu", separator, hvm_segment_name(k),
+            total.translation.segments[k]);
+        separator = ", ";
+    }
+    fprintf(out, "\n");
+
+    // Only passes that ran, none at -O0
+    Hvm_Stats *t = &total.translation;
+    for (int k = 0, first = 1; k < HVM_PASS_COUNT; k++) {
+        if (!t->pass_runs[k])
+            continue;
+        if (first)
+            fprintf(out, "%-12s %8s %9s %10s %10s %5s\n", "pass", "runs",
+                "ms", "removed", "added", "unit");
+        first = 0;
+        fprintf(out, "%-12s %8zu %9.3f %10zu %10zu %5s\n", hvm_pass_name(k),
+            t->pass_runs[k], t->pass_ms[k], t->pass_removed[k],
+            t->pass_added[k], hvm_pass_unit(k));
+    }
+}
+
+static void print_json_string(FILE *out, char *s)
+{
+    fputc('"', out);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char) *s;
+        if (c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(out, "\\u%04x", c);
+        else
+            fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+static void print_json_file(FILE *out, File_Stats *f, double ms)
+{
+    fprintf(out, "{\"path\":");
+    print_json_string(out, f->path);
+    fprintf(out, ",\"cached\":%s,\"load_ms\":%.6f,\"parse_ms\":%.6f,"
+        "\"codegen_ms\":%.6f,\"write_ms\":%.6f,\"bytes_in\":%zu,"
+        "\"bytes_out\":%zu,\"vm_instructions\":%zu,\"hack_instructions\":%zu,"
+        "\"mb_per_s\":%.3f",
+        f->cached ? "true" : "false", f->load_ms, f->translation.parse_ms,
+        f->translation.codegen_ms, f->write_ms, f->bytes_in, f->bytes_out,
+        vm_instructions(&f->translation), f->translation.hack_instructions,
+        throughput(f->bytes_in, ms));
+
+    fprintf(out, ",\"opcodes\":{");
+    for (int k = 0, first = 1; k < HVM_OPCODE_COUNT; k++) {
+        if (!f->translation.opcodes[k])
+            continue;
+        fprintf(out, "%s\"%s\":%zu", first ? "" : ",", hvm_opcode_name(k),
+            f->translation.opcodes[k]);
+        first = 0;
+    }
+    fprintf(out, "},\"segments\":{");
+    for (int k = 0, first = 1; k < HVM_SEGMENT_COUNT; k++) {
+        if (!f->translation.segments[k])
+            continue;
+        fprintf(out, "%s\"%s\":%zu", first ? "" : ",", hvm_segment_name(k),
+            f->translation.segments[k]);
+        first = 0;
+    }
+    fprintf(out, "},\"passes\":{");
+    for (int k = 0, first = 1; k < HVM_PASS_COUNT; k++) {
+        if (!f->translation.pass_runs[k])
+            continue;
+        fprintf(out, "%s\"%s\":{\"runs\":%zu,\"ms\":%.6f,\"removed\":%zu,"
+            "\"added\":%zu,\"unit\":\"%s\"}", first ? "" : ",",
+            hvm_pass_name(k), f->translation.pass_runs[k],
+            f->translation.pass_ms[k], f->translation.pass_removed[k],
+            f->translation.pass_added[k], hvm_pass_unit(k));
+        first = 0;
+    }
+    fprintf(out, "}}");
+}
+
+void print_stats_json(FILE *out, File_Stats *files, int count, Run_Stats *run)
+{
+    fprintf(out, "{\"files\":[");
+    for (int i = 0; i < count; i++) {
+        if (i > 0)
+            fputc(',', out);
+        print_json_file(out, files + i, file_ms(files + i));
+    }
+
+    File_Stats total = sum_files(files, count);
+    total.write_ms = run->write_ms;
+    fprintf(out, "],\"total\":");
+    print_json_file(out, &total, run->wall_ms);
+    fprintf(out, ",\"wall_ms\":%.6f,\"io_backend\":\"%s\",\"syscalls\":%li}\n",
+        run->wall_ms, run->io_backend, run->syscalls);
+}
+
+void print_memory_stats(FILE *out, size_t vm_instructions)
+{
+    Hvm_Memory_Stats m;
+    hvm_memory_stats(&m);
+
+    struct rusage usage;
+    long max_rss_kb = getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : 0;
+
+    fprintf(out, "Memory: peak %.3f MB in use, ", m.peak / MB);
+    if (vm_instructions)
+        fprintf(out, "%.1f bytes per VM instruction, ",
+            (double) m.peak / vm_instructions);
+    fprintf(out, "%zu bytes still in use, peak RSS %.3f MB\n", m.current,
+        max_rss_kb / 1024.0);
+
+    fprintf(out, "%-14s %11s %14s\n", "subsystem", "allocations", "bytes");
+    size_t allocations = 0, bytes = 0;
+    for (int k = 0; k < HVM_MEMORY_KIND_COUNT; k++) {
+        fprintf(out, "%-14s %11zu %14zu\n", hvm_memory_kind_name(k),
+            m.allocations[k], m.bytes[k]);
+        allocations += m.allocations[k];
+        bytes += m.bytes[k];
+    }
+    fprintf(out, "%-14s %11zu %14zu\n", "total", allocations, bytes);
+}
@@ -0,0 +1,45 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include "libhvm.h"
+
+enum STATS_FORMAT {
+    STATS_NONE = 0,
+    STATS_TEXT,
+    STATS_JSON,
+};
+
+// Measurements of one input file. Times are in milliseconds.
+typedef struct {
+    char *path;
+    int cached; // Output came from a cache, nothing was translated
+    double load_ms;
+    double write_ms;
+    size_t bytes_in;
+    size_t bytes_out;
+    Hvm_Stats translation; // Parse and codegen times, instruction counts
+} File_Stats;
+
+// Measurements of a whole run
+typedef struct {
+    double wall_ms; // From the first load to the last write
+    double write_ms;
+    char *io_backend;
+    long syscalls; // Made to read inputs and write outputs
+} Run_Stats;
+
+// Prints a table with a row per file and a total, then the instruction
+// counts of all files by opcode and segment, and what each pass did
+void print_stats_text(FILE *out, File_Stats *files, int count, Run_Stats *run);
+
+// Prints the same as a single JSON object, with counts for every file
+void print_stats_json(FILE *out, File_Stats *files, int count, Run_Stats *run);
+
+// Prints memory allocated through the library since the run started: the
+// most in use at once, how much of it each VM instruction took, what is
+// still in use, allocations by subsystem and the process's peak resident
+// size
+void print_memory_stats(FILE *out, size_t vm_instructions);
+
+#endif // STATS_H
@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include <string.h>
+#include "symbol.h"
+#include "libhvm.h"
+
+#define SYMBOL_TABLE_INITIAL_SLOTS         256
+
+// FNV-1a
+static uint32_t hash_symbol(char *str, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) str[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void hvm_symbol_table_init(Symbol_Table *st)
+{
+    st->arena = ARENA_INIT;
+    st->symbols = NULL;
+    st->count = 0;
+    st->capacity = 0;
+    st->slots = NULL;
+    st->slot_count = 0;
+}
+
+void hvm_symbol_table_free(Symbol_Table *st)
+{
+    hvm_arena_free(&st->arena);
+    hvm_free(st->symbols);
+    hvm_free(st->slots);
+    hvm_symbol_table_init(st);
+}
+
+// Returns slot holding 'str', or the empty slot where it would go
+static uint32_t *find_slot(Symbol_Table *st, char *str, size_t len, uint32_t hash)
+{
+    uint32_t mask = st->slot_count - 1;
+    for (uint32_t k = hash & mask;; k = (k + 1) & mask) {
+        uint32_t id = st->slots[k];
+        if (id == NO_SYMBOL)
+            return st->slots + k;
+
+        Symbol *s = st->symbols + id;
+        if (s->hash == hash && s->len == len && memcmp(s->name, str, len) == 0)
+            return st->slots + k;
+    }
+}
+
+// Doubles slot count and reinserts every symbol. Returns 1 if out of memory.
+static int grow_slots(Symbol_Table *st)
+{
+    uint32_t slot_count = st->slot_count ? st->slot_count * 2
+        : SYMBOL_TABLE_INITIAL_SLOTS;
+    uint32_t *slots = hvm_malloc(slot_count * sizeof(uint32_t),
+        HVM_MEM_SYMBOLS);
+    if (!slots)
+        return 1;
+    memset(slots, 0xff, slot_count * sizeof(uint32_t)); // All NO_SYMBOL
+
+    hvm_free(st->slots);
+    st->slots = slots;
+    st->slot_count = slot_count;
+
+    for (uint32_t id = 0; id < st->count; id++) {
+        Symbol *s = st->symbols + id;
+        *find_slot(st, s->name, s->len, s->hash) = id;
+    }
+
+    return 0;
+}
+
+uint32_t hvm_find_symbol(Symbol_Table *st, char *str, size_t len)
+{
+    if (st->slot_count == 0)
+        return NO_SYMBOL;
+
+    return *find_slot(st, str, len, hash_symbol(str, len));
+}
+
+uint32_t hvm_intern_symbol(Symbol_Table *st, char *str, size_t len)
+{
+    // Keep load factor under 1/2
+    if ((st->count + 1) * 2 > st->slot_count && grow_slots(st) != 0)
+        return NO_SYMBOL;
+
+    uint32_t hash = hash_symbol(str, len);
+    uint32_t *slot = find_slot(st, str, len, hash);
+    if (*slot != NO_SYMBOL)
+        return *slot;
+
+    if (st->count == st->capacity) {
+        uint32_t capacity = st->capacity ? st->capacity * 2 : 64;
+        Symbol *symbols = hvm_realloc(st->symbols, capacity * sizeof(Symbol),
+            HVM_MEM_SYMBOLS);
+        if (!symbols)
+            return NO_SYMBOL;
+        st->symbols = symbols;
+        st->capacity = capacity;
+    }
+
+    char *name = hvm_arena_alloc(&st->arena, len + 1);
+    if (!name)
+        return NO_SYMBOL;
+    memcpy(name, str, len);
+    name[len] = '\0';
+
+    uint32_t id = st->count++;
+    st->symbols[id] = (Symbol) { .name = name, .len = (uint32_t) len, .hash = hash };
+    *slot = id;
+    return id;
+}
@@ -0,0 +1,47 @@
+#ifndef SYMBOL_H
+#define SYMBOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "arena.h"
+
+#define NO_SYMBOL                          UINT32_MAX
+
+typedef struct {
+    char *name; // null-terminated, lives in the table's arena
+    uint32_t len;
+    uint32_t hash;
+} Symbol;
+
+// Interns label and function names. Each distinct name is stored once and
+// identified by its index into 'symbols'.
+typedef struct {
+    Arena arena;
+    Symbol *symbols;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t *slots; // open addressing, NO_SYMBOL marks an empty slot
+    uint32_t slot_count; // power of two
+} Symbol_Table;
+
+void hvm_symbol_table_init(Symbol_Table *st);
+void hvm_symbol_table_free(Symbol_Table *st);
+
+// Returns id of the 'len' chars at 'str', adding them if new.
+// Returns NO_SYMBOL if out of memory.
+uint32_t hvm_intern_symbol(Symbol_Table *st, char *str, size_t len);
+
+// Returns id of the 'len' chars at 'str', or NO_SYMBOL if never interned
+uint32_t hvm_find_symbol(Symbol_Table *st, char *str, size_t len);
+
+static inline char *symbol_name(Symbol_Table *st, uint32_t id)
+{
+    return st->symbols[id].name;
+}
+
+static inline uint32_t symbol_length(Symbol_Table *st, uint32_t id)
+{
+    return st->symbols[id].len;
+}
+
+#endif // SYMBOL_H
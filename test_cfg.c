@@ -0,0 +1,235 @@
+/*
+ hvm_test_cfg - checks the control-flow graphs, stack depths and dataflow
+ solver against libhvm.a
+
+ Usage: hvm_test_cfg
+        make test
+
+ Builds the graphs of a small hand-written program and compares the
+ blocks, edges, calls, stack depths and the fixed points of a forward
+ union problem and a backward intersection problem with the answers
+ worked out by hand. Prints each mismatch and exits with 1 if any.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "cfg.h"
+#include "libhvm.h"
+
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("%s:%i: failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static Instruction inst(Symbol_Table *st, int opcode, int segment,
+    int number, char *name)
+{
+    return (Instruction) {
+        .opcode = (uint8_t) opcode,
+        .segment = (uint8_t) segment,
+        .number = (uint16_t) number,
+        .symbol = name ? hvm_intern_symbol(st, name, strlen(name)) : NO_SYMBOL
+    };
+}
+
+// Blocks as a bitset of block indices, the program has fewer than 64
+static uint64_t blocks_of(uint64_t *set)
+{
+    return set[0];
+}
+
+#define B(b)                               ((uint64_t) 1 << (b))
+
+// Blocks, with the stack depth before each instruction:
+//  0  function Main.f 0      0
+//     push constant 1        0
+//     push constant 2        1
+//     add                    2
+//  1  label LOOP             1
+//     push constant 0        1
+//     if-goto LOOP           2
+//  2  pop temp 0             1
+//     goto END               0
+//  3  push constant 5        unknown, unreachable
+//  4  label END              0
+//     push constant 0        0
+//     return                 1
+//  5  function Main.g 0      0
+//     push constant 1        0
+//     if-goto ELSE           1
+//  6  call Main.f 0          0
+//  7  label ELSE             unknown, 0 or 1
+//     push constant 0        unknown
+//     return                 unknown
+static size_t build_program(Symbol_Table *st, Instruction *p)
+{
+    size_t n = 0;
+    p[n++] = inst(st, OP_FUNCTION, SEG_NONE, 0, "Main.f");
+    p[n++] = inst(st, OP_PUSH, SEG_CONSTANT, 1, NULL);
+    p[n++] = inst(st, OP_PUSH, SEG_CONSTANT, 2, NULL);
+    p[n++] = inst(st, OP_ADD, SEG_NONE, 0, NULL);
+    p[n++] = inst(st, OP_LABEL, SEG_NONE, 0, "LOOP");
+    p[n++] = inst(st, OP_PUSH, SEG_CONSTANT, 0, NULL);
+    p[n++] = inst(st, OP_IF_GOTO, SEG_NONE, 0, "LOOP");
+    p[n++] = inst(st, OP_POP, SEG_TEMP, 0, NULL);
+    p[n++] = inst(st, OP_GOTO, SEG_NONE, 0, "END");
+    p[n++] = inst(st, OP_PUSH, SEG_CONSTANT, 5, NULL);
+    p[n++] = inst(st, OP_LABEL, SEG_NONE, 0, "END");
+    p[n++] = inst(st, OP_PUSH, SEG_CONSTANT, 0, NULL);
+    p[n++] = inst(st, OP_RETURN, SEG_NONE, 0, NULL);
+    p[n++] = inst(st, OP_FUNCTION, SEG_NONE, 0, "Main.g");
+    p[n++] = inst(st, OP_PUSH, SEG_CONSTANT, 1, NULL);
+    p[n++] = inst(st, OP_IF_GOTO, SEG_NONE, 0, "ELSE");
+    p[n++] = inst(st, OP_CALL, SEG_NONE, 0, "Main.f");
+    p[n++] = inst(st, OP_LABEL, SEG_NONE, 0, "ELSE");
+    p[n++] = inst(st, OP_PUSH, SEG_CONSTANT, 0, NULL);
+    p[n++] = inst(st, OP_RETURN, SEG_NONE, 0, NULL);
+    return n;
+}
+
+static void test_graph(Cfg *cfg)
+{
+    static const size_t firsts[] = { 0, 4, 7, 9, 10, 13, 16, 17 };
+    CHECK(cfg->block_count == 8);
+    for (uint32_t b = 0; b < 8 && b < cfg->block_count; b++)
+        CHECK(cfg->blocks[b].first == firsts[b]);
+
+    CHECK(cfg->function_count == 2);
+    CHECK(cfg->functions[0].first_block == 0);
+    CHECK(cfg->functions[0].end_block == 5);
+    CHECK(cfg->functions[1].first_block == 5);
+    CHECK(cfg->blocks[6].function == 1);
+
+    // The loop's if-goto goes back to its own block or on
+    CHECK(cfg->blocks[1].successors[0] == 1);
+    CHECK(cfg->blocks[1].successors[1] == 2);
+    CHECK(cfg->blocks[2].successors[0] == 4);
+    CHECK(cfg->blocks[2].successors[1] == CFG_NONE);
+    CHECK(cfg->blocks[3].predecessor_count == 0);
+    CHECK(cfg->blocks[4].predecessor_count == 2);
+    CHECK(cfg->blocks[4].successors[0] == CFG_NONE);
+    CHECK(cfg->blocks[5].successors[0] == 7);
+    CHECK(cfg->blocks[5].successors[1] == 6);
+
+    CHECK(hvm_cfg_block_of(cfg, 0) == 0);
+    CHECK(hvm_cfg_block_of(cfg, 6) == 1);
+    CHECK(hvm_cfg_block_of(cfg, 12) == 4);
+    CHECK(hvm_cfg_block_of(cfg, 19) == 7);
+
+    CHECK(cfg->call_count == 1);
+    CHECK(cfg->calls[0].instruction == 16);
+    CHECK(cfg->calls[0].callee == 0);
+    CHECK(cfg->functions[1].call_count == 1);
+}
+
+static void test_stack_depths(Cfg *cfg)
+{
+    static const int32_t expected[] = {
+        0, 0, 1, 2, 1, 1, 2, 1, 0, CFG_UNKNOWN_DEPTH, 0, 0, 1,
+        0, 0, 1, 0, CFG_UNKNOWN_DEPTH, CFG_UNKNOWN_DEPTH, CFG_UNKNOWN_DEPTH
+    };
+    int32_t *depths = hvm_cfg_stack_depths(cfg);
+    CHECK(depths != NULL);
+    if (!depths)
+        return;
+    for (size_t k = 0; k < cfg->count; k++) {
+        if (depths[k] != expected[k])
+            printf("Instruction %zu: depth %i, expected %i\n", k,
+                (int) depths[k], (int) expected[k]);
+        CHECK(depths[k] == expected[k]);
+    }
+    hvm_free(depths);
+}
+
+// Which blocks can run before each block: forward, union, each block
+// generating its own bit
+static void test_forward_union(Cfg *cfg)
+{
+    static const uint64_t in[] = {
+        0, B(0) | B(1), B(0) | B(1), 0, B(0) | B(1) | B(2) | B(3),
+        0, B(5), B(5) | B(6)
+    };
+
+    Dataflow_Problem p;
+    CHECK(hvm_dataflow_problem_init(&p, cfg, DATAFLOW_FORWARD,
+        DATAFLOW_UNION, cfg->block_count) == 0);
+    for (uint32_t b = 0; b < cfg->block_count; b++)
+        bitset_set(p.gen + b * p.words, b);
+
+    Dataflow_Result r;
+    CHECK(hvm_dataflow_solve(cfg, &p, &r) == 0);
+    for (uint32_t b = 0; b < cfg->block_count; b++) {
+        CHECK(blocks_of(dataflow_in(&r, b)) == in[b]);
+        CHECK(blocks_of(dataflow_out(&r, b)) == (in[b] | B(b)));
+    }
+    hvm_dataflow_result_free(&r);
+    hvm_dataflow_problem_free(&p);
+}
+
+// Which blocks every path from a block to a return runs: backward,
+// intersection, each block generating its own bit
+static void test_backward_intersection(Cfg *cfg)
+{
+    static const uint64_t out[] = {
+        B(1) | B(2) | B(4), B(2) | B(4), B(4), B(4), 0,
+        B(7), B(7), 0
+    };
+
+    Dataflow_Problem p;
+    CHECK(hvm_dataflow_problem_init(&p, cfg, DATAFLOW_BACKWARD,
+        DATAFLOW_INTERSECTION, cfg->block_count) == 0);
+    for (uint32_t b = 0; b < cfg->block_count; b++)
+        bitset_set(p.gen + b * p.words, b);
+
+    // The solver's own allocations count as analysis memory
+    hvm_reset_memory_stats();
+    Dataflow_Result r;
+    CHECK(hvm_dataflow_solve(cfg, &p, &r) == 0);
+    Hvm_Memory_Stats m;
+    hvm_memory_stats(&m);
+    CHECK(m.allocations[HVM_MEM_OTHER] == 0);
+    CHECK(m.allocations[HVM_MEM_ANALYSIS] > 0);
+
+    for (uint32_t b = 0; b < cfg->block_count; b++) {
+        CHECK(blocks_of(dataflow_out(&r, b)) == out[b]);
+        CHECK(blocks_of(dataflow_in(&r, b)) == (out[b] | B(b)));
+    }
+    hvm_dataflow_result_free(&r);
+    hvm_dataflow_problem_free(&p);
+}
+
+int main(void)
+{
+    Symbol_Table st;
+    hvm_symbol_table_init(&st);
+    Instruction program[32];
+    size_t count = build_program(&st, program);
+
+    Cfg cfg;
+    if (hvm_cfg_build(&cfg, program, count, &st) != 0) {
+        printf("Out of memory\n");
+        return 1;
+    }
+    test_graph(&cfg);
+    test_stack_depths(&cfg);
+    test_forward_union(&cfg);
+    test_backward_intersection(&cfg);
+    hvm_cfg_free(&cfg);
+    hvm_symbol_table_free(&st);
+
+    Hvm_Memory_Stats m;
+    hvm_memory_stats(&m);
+    CHECK(m.current == 0);
+
+    if (failures) {
+        printf("%i checks failed\n", failures);
+        return 1;
+    }
+    printf("All cfg checks passed\n");
+    return 0;
+}
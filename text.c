@@ -0,0 +1,174 @@
+#include <string.h>
+#include "text.h"
+
+// Checks if char is allowed to be the first char of a symbol
+int hvm_is_valid_symbol_head(char c)
+{
+    return is_alpha(c) || c == '_' || c == '.' || c == '$' || c  == ':';
+}
+
+// Checks if char is allowed in a symbol as a non-first char
+int hvm_is_valid_symbol_tail(char c)
+{
+    return hvm_is_valid_symbol_head(c) || is_number(c);
+}
+
+// Returns a^b
+// 'b' must be non-negative (given the return type of the function)
+int hvm_power(int a, int b)
+{
+    if (a == 0)
+        return 0;
+
+    int ans = 1;
+    while (b-- > 0)
+        ans *= a;
+
+    return ans;
+}
+
+// Parses and returns first int from 'buf' to 'end' inclusive.
+// NOTE: The given range MUST ONLY contain digits or a leading minus,
+//  otherwise, undefined behavior
+int hvm_parse_next_int(char *buf, char *end)
+{
+    int num = 0;
+    int negative = 0;
+
+    // Check if negative
+    if (*buf == '-') {
+        negative = 1;
+        buf++;
+    }
+
+    // Skip leading zeros
+    if (*buf == '0') {
+        while (*(buf + 1) == '0') {
+            buf++;
+        }
+    }
+
+    // Build num up backwards
+    char *p = end;
+    size_t rpos = 0; // Position of current digit from right
+    while (p >= buf) {
+        int n = *p - '0';
+        num += n * hvm_power(10, rpos);
+        p--;
+        rpos++;
+    }
+
+    if (negative)
+        return -num;
+
+    return num;
+}
+
+// Return pointer to first occurrence of 'pat' in 'str'
+// Checks from 'str' to 'end' inclusive
+// Return NULL if not found
+char *hvm_strstr_range(char *str, char *end, char *pat)
+{
+    char *pat_start = pat;
+    while (*str && (str <= end)) {
+        while (*str++ == *pat++) {
+            if (*pat == '\0') {
+                // Pattern end reached
+                size_t pat_len = pat - pat_start;
+                return str - pat_len;
+            }
+        }
+        pat = pat_start; // Reset pat
+    }
+
+    return NULL;
+}
+
+// Find next occurence of any char from 'chars' or '\0' in 'str' and
+// return pointer to it.
+// Both 'chars' and 'str' must be null-terminated, so it doesn't halt
+char *hvm_find_next_any(char *str, char *chars)
+{
+    char *chars_start = chars;
+    for (; *str != '\0'; str++) {
+        for (; *chars != '\0'; chars++) {
+            if (*str == *chars)
+                return str;
+        }
+        chars = chars_start;
+    }
+
+    return str;
+}
+
+// Return 1 if str begins with pat (only stopping when pat reaches '\0')
+// Return 0 otherwise, or if str ends before pat
+int hvm_str_begins_with(char *str, char *pat)
+{
+    while (*pat != '\0') {
+        if (*str != *pat)
+            return 0;
+        pat++;
+        if (*pat == '\0')
+            return 1;
+        str++;
+    }
+    return 1;
+}
+
+// Return index of first occurrence of t in s
+// Return -1 if t not found in s
+int hvm_strindex(char *s, char *t)
+{
+    char *s_start = s;
+    char *t_start = t;
+    while (*s) {
+        while (*s++ == *t++) {
+            if (*t == 0) // Return index
+                return s - s_start - (t - t_start);
+        }
+        t = t_start; // Reset t
+    }
+    return -1;
+}
+
+// Return index of last occurrence of t in s
+// Return -1 if t not found in s
+int hvm_strindex_last(char *s, char *t)
+{
+    size_t s_len = strlen(s);
+    size_t t_len = strlen(t);
+
+    char *s_start = s;
+    char *s_end = s + s_len - 1;
+    s = s_end;
+    char *t_start = t;
+    char *t_end = t + t_len - 1;
+    t = t_end;
+
+    while (s != s_start) {
+        while (*s-- == *t--) {
+            if ((t == t_start && *s == *t) || t_end == t_start) // Return index
+                return s - s_start + ((t_end == t_start) ? 1 : 0);
+        }
+        t = t_end; // Reset t
+    }
+    return -1;
+}
+
+// Replaces last occurrence of sub in str with rep
+// Returns 0 on success
+// Returns 1 on failure
+// str must be large enough to fit rep
+int hvm_str_replace_last(char *str, char *sub, char *rep)
+{
+    int index = hvm_strindex_last(str, sub);
+    if (index == -1) {
+        return 1;
+    }
+
+    while (*rep)
+        str[index++] = *rep++;
+
+    return 0;
+}
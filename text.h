@@ -0,0 +1,74 @@
+#ifndef TEXT_H
+#define TEXT_H
+
+#include <stddef.h>
+
+// String, but defined by a range in memory (inclusive)
+// Doesn't have to be null-terminated
+typedef struct {
+    char *start; // inclusive
+    char *end; // inclusive
+} Slice;
+
+static inline int is_number(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static inline int is_alpha(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+// Checks if char is allowed to be the first char of a symbol
+int hvm_is_valid_symbol_head(char c);
+
+// Checks if char is allowed in a symbol as a non-first char
+int hvm_is_valid_symbol_tail(char c);
+
+// Returns a^b
+// 'b' must be non-negative (given the return type of the function)
+int hvm_power(int a, int b);
+
+// Parses and returns first int from 'buf' to 'end' inclusive.
+// NOTE: The given range MUST ONLY contain digits or a leading minus,
+//  otherwise, undefined behavior
+int hvm_parse_next_int(char *buf, char *end);
+
+// Return pointer to first occurrence of 'pat' in 'str'
+// Checks from 'str' to 'end' inclusive
+// Return NULL if not found
+char *hvm_strstr_range(char *str, char *end, char *pat);
+
+// Find next occurence of any char from 'chars' or '\0' in 'str' and
+// return pointer to it.
+// Both 'chars' and 'str' must be null-terminated, so it doesn't halt
+char *hvm_find_next_any(char *str, char *chars);
+
+// Return 1 if str begins with pat (only stopping when pat reaches '\0')
+// Return 0 otherwise, or if str ends before pat
+int hvm_str_begins_with(char *str, char *pat);
+
+// Return index of first occurrence of t in s
+// Return -1 if t not found in s
+int hvm_strindex(char *s, char *t);
+
+// Return index of last occurrence of t in s
+// Return -1 if t not found in s
+int hvm_strindex_last(char *s, char *t);
+
+// Replaces last occurrence of sub in str with rep
+// Returns 0 on success
+// Returns 1 on failure
+// str must be large enough to fit rep
+int hvm_str_replace_last(char *str, char *sub, char *rep);
+
+// Find next index of any char from 'c' or '\0' after 'str[i]'
+// Return last index (length - 1) if not found
+// Both 'c' and 'str' must be null-terminated, so it doesn't halt
+static inline size_t find_next_any_index(char *str, size_t i, char *c)
+{
+    return hvm_find_next_any(str + i, c) - str;
+}
+
+#endif // TEXT_H
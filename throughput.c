@@ -0,0 +1,259 @@
+/*
+ hvm_throughput - end-to-end translator throughput over a corpus
+
+ Usage: hvm_throughput dir [--hvm ./hvm] [--runs 5] [--jobs n]
+                           [--csv file] [--label text]
+        make bench-throughput
+
+ Runs hvm over every .vm file in 'dir' (made by hvm_gen, say) in three
+ modes: one output per input, all inputs into one file with -o, and the
+ same with -j 'jobs' (default: every online CPU). Each mode runs once to
+ warm the page cache, then 'runs' times.
+
+ Prints, and appends to the CSV file if given, the median wall time, MB/s
+ and VM instructions/s of input, and the highest peak RSS of any run.
+ Rows are tagged with 'label', such as a commit, to track regressions.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "file.h"
+#include "libhvm.h"
+
+#define THROUGHPUT_DEFAULT_RUNS            5
+#define THROUGHPUT_MAX_RUNS                101
+
+typedef struct {
+    char *name;
+    char **argv; // Ends with NULL
+} Mode;
+
+typedef struct {
+    double seconds; // Median
+    long peak_rss_kb; // Highest of all runs
+    int failed;
+} Measurement;
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+// Lines holding an instruction, skipping blank and comment-only lines
+static size_t count_instructions(char *buf, size_t size)
+{
+    size_t count = 0;
+    char *end = buf + size;
+    for (char *p = buf; p < end;) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+            p++;
+        if (p < end && *p != '\n' && !(*p == '/' && p + 1 < end && p[1] == '/'))
+            count++;
+        char *newline = memchr(p, '\n', end - p);
+        p = newline ? newline + 1 : end;
+    }
+    return count;
+}
+
+// Runs 'argv' with its output thrown away. Returns the wall time in
+// seconds, or a negative number if it failed.
+static double run_once(char **argv, long *max_rss_kb)
+{
+    double start = now_s();
+    pid_t pid = fork();
+    if (pid == -1)
+        return -1;
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if (null != -1) {
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+        execv(argv[0], argv);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) == -1)
+        return -1;
+    double seconds = now_s() - start;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+
+    if (usage.ru_maxrss > *max_rss_kb)
+        *max_rss_kb = usage.ru_maxrss;
+    return seconds;
+}
+
+static Measurement measure(Mode *m, int runs)
+{
+    Measurement result = { .seconds = 0, .peak_rss_kb = 0, .failed = 0 };
+    double times[THROUGHPUT_MAX_RUNS];
+    for (int k = -1; k < runs; k++) {
+        double seconds = run_once(m->argv, &result.peak_rss_kb);
+        if (seconds < 0) {
+            result.failed = 1;
+            return result;
+        }
+        if (k >= 0) // The first run only warms up
+            times[k] = seconds;
+    }
+    qsort(times, runs, sizeof(double), compare_doubles);
+    result.seconds = times[runs / 2];
+    return result;
+}
+
+// Builds "hvm inputs... extra..." for one mode
+static char **mode_argv(char *hvm, char **inputs, int input_count,
+    char **extra, int extra_count)
+{
+    char **argv = hvm_malloc((1 + input_count + extra_count + 1)
+        * sizeof(char*), HVM_MEM_OTHER);
+    int n = 0;
+    argv[n++] = hvm;
+    for (int k = 0; k < input_count; k++)
+        argv[n++] = inputs[k];
+    for (int k = 0; k < extra_count; k++)
+        argv[n++] = extra[k];
+    argv[n] = NULL;
+    return argv;
+}
+
+int main(int argc, char *argv[])
+{
+    char *dir = NULL;
+    char *hvm = "./hvm";
+    char *csv_path = NULL;
+    char *label = "";
+    int runs = THROUGHPUT_DEFAULT_RUNS;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 1; i < argc; i++) {
+        char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (argv[i][0] != '-') {
+            dir = argv[i];
+            continue;
+        }
+        if (!value) {
+            printf("Expected a value after '%s'\n", argv[i]);
+            return 1;
+        }
+        if (strcmp(argv[i], "--hvm") == 0)
+            hvm = value;
+        else if (strcmp(argv[i], "--runs") == 0)
+            runs = atoi(value);
+        else if (strcmp(argv[i], "--jobs") == 0)
+            jobs = atol(value);
+        else if (strcmp(argv[i], "--csv") == 0)
+            csv_path = value;
+        else if (strcmp(argv[i], "--label") == 0)
+            label = value;
+        else {
+            printf("Unknown argument '%s'\n", argv[i]);
+            return 1;
+        }
+        i++;
+    }
+    if (!dir) {
+        printf("Usage: hvm_throughput dir [--hvm ./hvm] [--runs 5] "
+            "[--jobs n] [--csv file] [--label text]\n");
+        return 1;
+    }
+    if (runs < 1 || runs > THROUGHPUT_MAX_RUNS || jobs < 1) {
+        printf("Runs must be from 1 to %i and jobs at least 1\n",
+            THROUGHPUT_MAX_RUNS);
+        return 1;
+    }
+
+    int input_count;
+    char **inputs = list_dir(dir, ".vm", &input_count);
+    if (!inputs || input_count == 0) {
+        printf("No .vm files in '%s'\n", dir);
+        return 1;
+    }
+
+    size_t bytes = 0, instructions = 0;
+    for (int k = 0; k < input_count; k++) {
+        Loaded_File f = load_file(inputs[k]);
+        if (!f.buf)
+            return 1;
+        bytes += f.size;
+        instructions += count_instructions(f.buf, f.size);
+        unload_file(&f);
+    }
+
+    char output[4096], jobs_arg[32];
+    snprintf(output, sizeof(output), "%s/throughput.asm", dir);
+    snprintf(jobs_arg, sizeof(jobs_arg), "%li", jobs);
+    char *single[] = { "-o", output };
+    char *parallel[] = { "-o", output, "-j", jobs_arg };
+    Mode modes[] = {
+        { "per-file", mode_argv(hvm, inputs, input_count, NULL, 0) },
+        { "single", mode_argv(hvm, inputs, input_count, single, 2) },
+        { "parallel", mode_argv(hvm, inputs, input_count, parallel, 4) }
+    };
+    int mode_count = sizeof(modes) / sizeof(modes[0]);
+
+    FILE *csv = NULL;
+    if (csv_path) {
+        csv = fopen(csv_path, "a");
+        if (!csv) {
+            printf("Couldn't open file '%s' for writing\n", csv_path);
+            return 1;
+        }
+        if (ftell(csv) == 0)
+            fprintf(csv, "time,label,mode,jobs,files,bytes,instructions,runs,"
+                "median_s,mb_per_s,instructions_per_s,peak_rss_kb\n");
+    }
+
+    printf("%i files, %zu bytes, %zu instructions, %i runs\n", input_count,
+        bytes, instructions, runs);
+    printf("%-10s %10s %10s %16s %12s\n", "mode", "median s", "MB/s",
+        "instructions/s", "peak RSS KB");
+    int status = 0;
+    for (int k = 0; k < mode_count; k++) {
+        Measurement m = measure(modes + k, runs);
+        if (m.failed) {
+            printf("%-10s failed\n", modes[k].name);
+            status = 1;
+            continue;
+        }
+
+        double mb_per_s = bytes / (1024.0 * 1024.0) / m.seconds;
+        double instructions_per_s = instructions / m.seconds;
+        printf("%-10s %10.4f %10.1f %16.0f %12li\n", modes[k].name, m.seconds,
+            mb_per_s, instructions_per_s, m.peak_rss_kb);
+        if (csv)
+            fprintf(csv, "%ld,%s,%s,%li,%i,%zu,%zu,%i,%.6f,%.3f,%.0f,%li\n",
+                (long) time(NULL), label, modes[k].name,
+                strcmp(modes[k].name, "parallel") == 0 ? jobs : 1,
+                input_count, bytes, instructions, runs, m.seconds, mb_per_s,
+                instructions_per_s, m.peak_rss_kb);
+    }
+
+    if (csv && fclose(csv) != 0) {
+        printf("Error when writing to '%s'\n", csv_path);
+        status = 1;
+    }
+    for (int k = 0; k < mode_count; k++)
+        hvm_free(modes[k].argv);
+    for (int k = 0; k < input_count; k++)
+        hvm_free(inputs[k]);
+    hvm_free(inputs);
+    return status;
+}
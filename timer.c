@@ -0,0 +1,10 @@
+#define _GNU_SOURCE
+#include <time.h>
+#include "timer.h"
+
+double hvm_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
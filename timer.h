@@ -0,0 +1,7 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+// Milliseconds on a monotonic clock, for measuring intervals
+double hvm_now_ms(void);
+
+#endif // TIMER_H
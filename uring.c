@@ -0,0 +1,404 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "file.h"
+#include "uring.h"
+#include "libhvm.h"
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup                425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter                426
+#endif
+
+// Files aren't stat'ed first, as the kernel can't do that without handing
+// it to a worker thread. Each buffer starts at this size and doubles.
+#define LOAD_INITIAL_SIZE                  (16 * 1024)
+
+// Called for every completion, with the 'user_data' of its submission
+typedef void (*Uring_Done)(Uring *u, void *arg, uint64_t data, int res);
+
+static int ring_setup(unsigned entries, struct io_uring_params *p)
+{
+    io_count_syscalls(1);
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int ring_enter(Uring *u, unsigned to_submit, unsigned min_complete)
+{
+    io_count_syscalls(1);
+    return (int) syscall(__NR_io_uring_enter, u->fd, to_submit, min_complete,
+        min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+static void *map_ring(int fd, size_t size, off_t offset)
+{
+    io_count_syscalls(1);
+    return mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        fd, offset);
+}
+
+int uring_init(Uring *u, unsigned entries)
+{
+    memset(u, 0, sizeof(Uring));
+    u->fd = -1;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = ring_setup(entries, &p);
+    if (fd < 0)
+        return 1;
+    u->fd = fd;
+    u->entries = p.sq_entries;
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_size > u->sq_ring_size)
+            u->sq_ring_size = u->cq_ring_size;
+        u->cq_ring_size = 0;
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    u->sq_ring = map_ring(fd, u->sq_ring_size, IORING_OFF_SQ_RING);
+    u->cq_ring = u->cq_ring_size
+        ? map_ring(fd, u->cq_ring_size, IORING_OFF_CQ_RING) : u->sq_ring;
+    u->sqes = map_ring(fd, u->sqes_size, IORING_OFF_SQES);
+    if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED
+        || u->sqes == MAP_FAILED) {
+        uring_free(u);
+        return 1;
+    }
+
+    char *sq = u->sq_ring;
+    char *cq = u->cq_ring;
+    u->sq_head = (unsigned*) (sq + p.sq_off.head);
+    u->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+    u->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned*) (sq + p.sq_off.array);
+    u->cq_head = (unsigned*) (cq + p.cq_off.head);
+    u->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+    u->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+    return 0;
+}
+
+void uring_free(Uring *u)
+{
+    if (u->sqes && u->sqes != MAP_FAILED)
+        munmap(u->sqes, u->sqes_size);
+    if (u->cq_ring_size && u->cq_ring && u->cq_ring != MAP_FAILED)
+        munmap(u->cq_ring, u->cq_ring_size);
+    if (u->sq_ring && u->sq_ring != MAP_FAILED)
+        munmap(u->sq_ring, u->sq_ring_size);
+    if (u->fd >= 0)
+        close(u->fd);
+    io_count_syscalls(4);
+    memset(u, 0, sizeof(Uring));
+    u->fd = -1;
+}
+
+// Calls 'done' for every completion already posted
+static void reap(Uring *u, Uring_Done done, void *arg)
+{
+    unsigned head = *u->cq_head;
+    unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe *cqe = u->cqes + (head & *u->cq_mask);
+        done(u, arg, cqe->user_data, cqe->res);
+        head++;
+        u->in_flight--;
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Submits everything queued and waits for 'min' completions. Returns 1 if
+// the ring stopped working; whatever was in flight is then lost.
+static int wait_for(Uring *u, Uring_Done done, void *arg, unsigned min)
+{
+    while (1) {
+        int n = ring_enter(u, u->queued, min);
+        if (n >= 0) {
+            u->queued -= (unsigned) n;
+            u->in_flight += (unsigned) n;
+            break;
+        }
+        if (errno == EAGAIN || errno == EBUSY) {
+            reap(u, done, arg);
+            continue;
+        }
+        if (errno != EINTR) {
+            u->queued = 0;
+            u->in_flight = 0;
+            return 1;
+        }
+    }
+    reap(u, done, arg);
+    return 0;
+}
+
+// Waits for every queued and in flight submission
+static int drain(Uring *u, Uring_Done done, void *arg)
+{
+    while (u->queued || u->in_flight)
+        if (wait_for(u, done, arg, u->in_flight + u->queued))
+            return 1;
+    return 0;
+}
+
+// Queues a copy of 'sqe', first emptying the ring if it's full. Never has
+// more in flight than the submission queue holds, so completions can't
+// overflow.
+static int push(Uring *u, struct io_uring_sqe *sqe, Uring_Done done, void *arg)
+{
+    if (u->queued + u->in_flight >= u->entries && drain(u, done, arg))
+        return 1;
+
+    unsigned tail = *u->sq_tail;
+    unsigned index = tail & *u->sq_mask;
+    u->sqes[index] = *sqe;
+    u->sq_array[index] = index;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->queued++;
+    return 0;
+}
+
+static struct io_uring_sqe prep(int opcode, int fd, void *addr, unsigned len,
+    uint64_t offset, uint64_t data)
+{
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = (uint8_t) opcode;
+    sqe.fd = fd;
+    sqe.addr = (uint64_t) (uintptr_t) addr;
+    sqe.len = len;
+    sqe.off = offset;
+    sqe.user_data = data;
+    return sqe;
+}
+
+// Largest single read or write, as the length field is 32 bits
+static unsigned io_len(size_t left)
+{
+    return left > (1u << 30) ? (1u << 30) : (unsigned) left;
+}
+
+// Loads
+
+static void load_opened(Uring *u, void *arg, uint64_t data, int res)
+{
+    Uring_Load *l = (Uring_Load*) arg + data;
+    if (res < 0)
+        l->error = -res;
+    else
+        l->fd = res;
+}
+
+static void load_read(Uring *u, void *arg, uint64_t data, int res)
+{
+    Uring_Load *l = (Uring_Load*) arg + data;
+    if (res < 0)
+        l->error = -res;
+    else if (res == 0)
+        l->at_end = 1;
+    else
+        l->size += (size_t) res;
+}
+
+static void load_closed(Uring *u, void *arg, uint64_t data, int res)
+{
+    Uring_Load *l = (Uring_Load*) arg + data;
+    // Kernels without the close operation reject it
+    if (res == -EINVAL) {
+        io_count_syscalls(1);
+        close(l->fd);
+    }
+    l->fd = -1;
+}
+
+void uring_load_start(Uring *u, Uring_Load *loads, int count)
+{
+    int failed = 0;
+    for (int i = 0; i < count && !failed; i++) {
+        Uring_Load *l = loads + i;
+        l->buf = NULL;
+        l->size = 0;
+        l->error = 0;
+        l->fd = -1;
+        l->capacity = 0;
+        l->at_end = 0;
+
+        struct io_uring_sqe sqe = prep(IORING_OP_OPENAT, AT_FDCWD, l->path,
+            0, 0, i);
+        sqe.open_flags = O_RDONLY | O_CLOEXEC;
+        failed = push(u, &sqe, load_opened, loads);
+    }
+
+    if (!failed && u->queued)
+        failed = wait_for(u, load_opened, loads, 0);
+    if (failed)
+        for (int i = 0; i < count; i++)
+            loads[i].error = EIO;
+}
+
+void uring_load_finish(Uring *u, Uring_Load *loads, int count)
+{
+    int failed = drain(u, load_opened, loads);
+
+    // Every file is read in rounds until a read comes back empty, growing
+    // buffers that fill up. Room for the sentinel is always kept.
+    int pending = 1;
+    while (pending && !failed) {
+        pending = 0;
+        for (int i = 0; i < count && !failed; i++) {
+            Uring_Load *l = loads + i;
+            if (l->error || l->at_end)
+                continue;
+            if (l->size + 1 >= l->capacity) {
+                size_t capacity = l->capacity ? l->capacity * 2
+                    : LOAD_INITIAL_SIZE;
+                char *buf = hvm_realloc(l->buf, capacity, HVM_MEM_IO);
+                if (!buf) {
+                    l->error = ENOMEM;
+                    continue;
+                }
+                l->buf = buf;
+                l->capacity = capacity;
+            }
+            struct io_uring_sqe sqe = prep(IORING_OP_READ, l->fd,
+                l->buf + l->size, io_len(l->capacity - 1 - l->size), l->size, i);
+            failed = push(u, &sqe, load_read, loads);
+            pending = 1;
+        }
+        if (!failed)
+            failed = drain(u, load_read, loads);
+    }
+
+    for (int i = 0; i < count; i++)
+        if (!loads[i].error && loads[i].size == 0)
+            loads[i].error = ENODATA;
+
+    for (int i = 0; i < count && !failed; i++) {
+        if (loads[i].fd < 0)
+            continue;
+        struct io_uring_sqe sqe = prep(IORING_OP_CLOSE, loads[i].fd, NULL, 0, 0, i);
+        failed = push(u, &sqe, load_closed, loads);
+    }
+    if (!failed)
+        failed = drain(u, load_closed, loads);
+
+    for (int i = 0; i < count; i++) {
+        Uring_Load *l = loads + i;
+        if (failed) {
+            if (l->fd >= 0)
+                close(l->fd);
+            l->fd = -1;
+            l->error = EIO;
+        }
+        if (l->error) {
+            hvm_free(l->buf);
+            l->buf = NULL;
+            l->size = 0;
+        } else {
+            l->buf[l->size] = '\0';
+        }
+    }
+}
+
+// Writes
+
+static void write_opened(Uring *u, void *arg, uint64_t data, int res)
+{
+    Uring_Write *w = (Uring_Write*) arg + data;
+    if (res < 0)
+        w->error = -res;
+    else
+        w->fd = res;
+}
+
+static void write_written(Uring *u, void *arg, uint64_t data, int res)
+{
+    Uring_Write *w = (Uring_Write*) arg + data;
+    if (res < 0)
+        w->error = -res;
+    else if (res == 0)
+        w->error = EIO;
+    else
+        w->done += (size_t) res;
+}
+
+static void write_closed(Uring *u, void *arg, uint64_t data, int res)
+{
+    Uring_Write *w = (Uring_Write*) arg + data;
+    if (res == -EINVAL) {
+        io_count_syscalls(1);
+        res = close(w->fd) == -1 ? -errno : 0;
+    }
+    // Delayed write errors show up on close
+    if (res < 0 && !w->error)
+        w->error = -res;
+    w->fd = -1;
+}
+
+int uring_write_files(Uring *u, Uring_Write *writes, int count)
+{
+    int failed = 0;
+    for (int i = 0; i < count && !failed; i++) {
+        Uring_Write *w = writes + i;
+        w->error = 0;
+        w->fd = -1;
+        w->done = 0;
+        struct io_uring_sqe sqe = prep(IORING_OP_OPENAT, AT_FDCWD, w->path,
+            0644, 0, i);
+        sqe.open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+        failed = push(u, &sqe, write_opened, writes);
+    }
+    if (!failed)
+        failed = drain(u, write_opened, writes);
+
+    int pending = 1;
+    while (pending && !failed) {
+        pending = 0;
+        for (int i = 0; i < count && !failed; i++) {
+            Uring_Write *w = writes + i;
+            if (w->error || w->done >= w->size)
+                continue;
+            struct io_uring_sqe sqe = prep(IORING_OP_WRITE, w->fd,
+                w->buf + w->done, io_len(w->size - w->done), w->done, i);
+            failed = push(u, &sqe, write_written, writes);
+            pending = 1;
+        }
+        if (!failed)
+            failed = drain(u, write_written, writes);
+    }
+
+    for (int i = 0; i < count && !failed; i++) {
+        if (writes[i].fd < 0)
+            continue;
+        struct io_uring_sqe sqe = prep(IORING_OP_CLOSE, writes[i].fd, NULL, 0, 0, i);
+        failed = push(u, &sqe, write_closed, writes);
+    }
+    if (!failed)
+        failed = drain(u, write_closed, writes);
+
+    int errors = 0;
+    for (int i = 0; i < count; i++) {
+        Uring_Write *w = writes + i;
+        if (failed) {
+            if (w->fd >= 0)
+                close(w->fd);
+            w->fd = -1;
+            w->error = EIO;
+        }
+        errors += w->error != 0;
+    }
+    return errors;
+}
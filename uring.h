@@ -0,0 +1,61 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+
+// An io_uring instance, driven with raw syscalls. Every file operation
+// below is queued for a whole batch of files and submitted with a single
+// io_uring_enter, instead of one syscall per file per step.
+typedef struct {
+    int fd;
+    unsigned entries; // Submission queue size
+    unsigned queued; // Prepared but not yet submitted
+    unsigned in_flight; // Submitted but not yet completed
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+} Uring;
+
+// Returns 0 on success, 1 if the kernel doesn't provide io_uring
+int uring_init(Uring *u, unsigned entries);
+void uring_free(Uring *u);
+
+// One file to read whole. On success 'buf' holds 'size' bytes followed by
+// a '\0' sentinel, to be released with hvm_free(). On failure 'buf' is NULL
+// and 'error' is set; the caller decides how to retry. Empty files are left
+// to the caller the same way.
+typedef struct {
+    char *path;
+    int tag; // Free for the caller
+    char *buf;
+    size_t size;
+    int error; // Positive errno of the failed step, or 0
+    int fd;
+    size_t capacity;
+    int at_end;
+} Uring_Load;
+
+// Opens the files of 'loads' in the background. Must be followed by
+// uring_load_finish on the same files before anything else is queued.
+void uring_load_start(Uring *u, Uring_Load *loads, int count);
+
+// Reads the files started by uring_load_start and closes them
+void uring_load_finish(Uring *u, Uring_Load *loads, int count);
+
+// One file to create or truncate and fill with 'size' bytes of 'buf'
+typedef struct {
+    char *path;
+    char *buf;
+    size_t size;
+    int error; // Positive errno of the failed step, or 0
+    int fd;
+    size_t done;
+} Uring_Write;
+
+// Writes every file of 'writes'. Returns the number that failed.
+int uring_write_files(Uring *u, Uring_Write *writes, int count);
+
+#endif // URING_H
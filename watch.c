@@ -0,0 +1,118 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include "watch.h"
+#include "libhvm.h"
+
+#define WATCH_EVENTS                       (IN_CLOSE_WRITE | IN_MOVED_TO)
+#define WATCH_SETTLE_MS                    20
+#define WATCH_BUF_SIZE                     (64 * 1024)
+
+int watcher_init(Watcher *w, char **paths, int count)
+{
+    w->count = count;
+    w->wds = hvm_malloc(count * sizeof(int), HVM_MEM_OTHER);
+    w->names = hvm_malloc(count * sizeof(char*), HVM_MEM_OTHER);
+    w->fd = inotify_init1(IN_CLOEXEC);
+    if (w->fd == -1) {
+        printf("Couldn't start watching files (inotify error %i)\n", errno);
+        watcher_free(w);
+        return 1;
+    }
+
+    for (int k = 0; k < count; k++) {
+        char *last_slash = strrchr(paths[k], '/');
+        w->names[k] = last_slash ? last_slash + 1 : paths[k];
+
+        // Watching one directory twice gives back the same descriptor
+        if (last_slash) {
+            size_t len = last_slash - paths[k];
+            char *dir = hvm_malloc(len + 2, HVM_MEM_OTHER);
+            memcpy(dir, paths[k], len);
+            strcpy(dir + len, len ? "" : "/");
+            w->wds[k] = inotify_add_watch(w->fd, dir, WATCH_EVENTS);
+            hvm_free(dir);
+        } else {
+            w->wds[k] = inotify_add_watch(w->fd, ".", WATCH_EVENTS);
+        }
+
+        if (w->wds[k] == -1) {
+            printf("Couldn't watch '%s' (inotify error %i)\n", paths[k], errno);
+            watcher_free(w);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Marks files named by the events in 'buf'
+static void mark_events(Watcher *w, char *buf, ssize_t len, int *changed)
+{
+    for (char *p = buf; p < buf + len;) {
+        struct inotify_event *ev = (struct inotify_event*) p;
+        if (ev->len) {
+            for (int k = 0; k < w->count; k++) {
+                if (w->wds[k] == ev->wd && strcmp(w->names[k], ev->name) == 0)
+                    changed[k] = 1;
+            }
+        }
+        p += sizeof(struct inotify_event) + ev->len;
+    }
+}
+
+int watcher_wait(Watcher *w, int *changed)
+{
+    static char buf[WATCH_BUF_SIZE]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    memset(changed, 0, w->count * sizeof(int));
+
+    int changed_count = 0;
+    while (changed_count == 0) {
+        // Block for the first event, then drain until writes settle
+        int timeout = -1;
+        while (1) {
+            struct pollfd pfd = { .fd = w->fd, .events = POLLIN };
+            int ready = poll(&pfd, 1, timeout);
+            if (ready < 0) {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            if (ready == 0)
+                break;
+
+            ssize_t len = read(w->fd, buf, sizeof(buf));
+            if (len < 0) {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            mark_events(w, buf, len, changed);
+            timeout = WATCH_SETTLE_MS;
+        }
+
+        for (int k = 0; k < w->count; k++)
+            changed_count += changed[k];
+    }
+
+    return changed_count;
+}
+
+void watcher_free(Watcher *w)
+{
+    if (w->fd != -1)
+        close(w->fd);
+    hvm_free(w->wds);
+    hvm_free(w->names);
+    w->fd = -1;
+    w->wds = NULL;
+    w->names = NULL;
+    w->count = 0;
+}
@@ -0,0 +1,24 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+// Watches a set of files for new contents. The directory holding each file
+// is watched rather than the file itself, so files replaced by rename (as
+// many editors save) are still seen.
+typedef struct {
+    int fd; // inotify instance
+    int count;
+    int *wds; // Watch on the directory of each file
+    char **names; // Name of each file within its directory
+} Watcher;
+
+// Returns 0 on success, prints an error and returns 1 otherwise
+int watcher_init(Watcher *w, char **paths, int count);
+
+// Blocks until at least one file was written, then waits for writes to
+// settle. Sets changed[k] to 1 for every changed file and 0 for the rest.
+// Returns the number of changed files, or -1 on error.
+int watcher_wait(Watcher *w, int *changed);
+
+void watcher_free(Watcher *w);
+
+#endif // WATCH_H